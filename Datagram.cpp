@@ -0,0 +1,494 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Datagram.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Datagram sockets and batched datagram I/O (recvmmsg/sendmmsg)
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Datagram.hpp"
+
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#include <sys/syscall.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramPeer ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramPeer::CDatagramPeer(int AHandle, LPCSTR AIP, ushort APort): Handle(AHandle) {
+            Address.sin_family = AF_INET;
+            Address.sin_port = htons(APort);
+            inet_pton(AF_INET, AIP, &Address.sin_addr);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CDatagramPeer::ToString() const {
+            char ip[INET_ADDRSTRLEN] = {0};
+            inet_ntop(AF_INET, &Address.sin_addr, ip, sizeof(ip));
+            return CString().Format("%s:%d", ip, ntohs(Address.sin_port));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramSocket -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramSocket::CDatagramSocket(): m_Handle(-1) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramSocket::~CDatagramSocket() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramSocket::Open(const CString &IP, ushort Port, bool ReusePort) {
+            Close();
+
+            sockaddr_in address {};
+
+            address.sin_family = AF_INET;
+            address.sin_port = htons(Port);
+
+            if (IP.IsEmpty() || inet_pton(AF_INET, IP.c_str(), &address.sin_addr) != 1)
+                address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+            m_Handle = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+            if (m_Handle == -1)
+                throw ExceptionFrm("socket() failed: %s", strerror(errno));
+
+            const int on = 1;
+
+            if (ReusePort && ::setsockopt(m_Handle, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+                Close();
+                throw ExceptionFrm("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+            }
+
+            if (::bind(m_Handle, (sockaddr *) &address, sizeof(address)) == -1) {
+                const auto error = errno;
+                Close();
+                throw ExceptionFrm("bind() to %s:%d failed: %s", IP.c_str(), Port, strerror(error));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramSocket::Close() {
+            if (m_Handle != -1) {
+                ::close(m_Handle);
+                m_Handle = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramSocket::AttachSteering(uint Groups) {
+            // Pick the socket of the SO_REUSEPORT group by the source address, so a device stays on one process:
+            // A = (src_addr ^ src_port) % Groups (IPv4 header without options).
+            sock_filter code[] = {
+                { BPF_LD  | BPF_W | BPF_ABS, 0, 0, (uint32_t) SKF_NET_OFF + 12 },
+                { BPF_ST, 0, 0, 0 },
+                { BPF_LD  | BPF_H | BPF_ABS, 0, 0, (uint32_t) SKF_NET_OFF + 20 },
+                { BPF_LDX | BPF_MEM, 0, 0, 0 },
+                { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+                { BPF_ALU | BPF_MOD | BPF_K, 0, 0, Groups },
+                { BPF_RET | BPF_A, 0, 0, 0 }
+            };
+
+            sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+
+            if (::setsockopt(m_Handle, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1)
+                throw ExceptionFrm("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed: %s", strerror(errno));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramSocket::SetBufferSizes(int Receive, int Send) {
+            bool result = true;
+
+            // The FORCE options pass net.core.rmem_max/wmem_max with CAP_NET_ADMIN; otherwise the limits apply.
+            if (Receive > 0 && ::setsockopt(m_Handle, SOL_SOCKET, SO_RCVBUFFORCE, &Receive, sizeof(Receive)) == -1)
+                result = ::setsockopt(m_Handle, SOL_SOCKET, SO_RCVBUF, &Receive, sizeof(Receive)) == 0 && result;
+
+            if (Send > 0 && ::setsockopt(m_Handle, SOL_SOCKET, SO_SNDBUFFORCE, &Send, sizeof(Send)) == -1)
+                result = ::setsockopt(m_Handle, SOL_SOCKET, SO_SNDBUF, &Send, sizeof(Send)) == 0 && result;
+
+            return result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramSocket::GetBufferSizes(int &Receive, int &Send) const {
+            socklen_t length = sizeof(Receive);
+
+            // The kernel reports twice the requested size: the doubled value includes its bookkeeping overhead.
+            if (::getsockopt(m_Handle, SOL_SOCKET, SO_RCVBUF, &Receive, &length) == -1)
+                return false;
+
+            length = sizeof(Send);
+            return ::getsockopt(m_Handle, SOL_SOCKET, SO_SNDBUF, &Send, &length) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramSocket::EnableDropCounter() {
+            const int on = 1;
+            return ::setsockopt(m_Handle, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramSocket::Drops(uint32_t &Value) const {
+            uint32_t info[SK_MEMINFO_VARS] = {};
+            socklen_t length = sizeof(info);
+
+            if (::getsockopt(m_Handle, SOL_SOCKET, SO_MEMINFO, info, &length) == -1 || length <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+                return false;
+
+            Value = info[SK_MEMINFO_DROPS];
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        ssize_t CDatagramSocket::ReadFrom(void *Buffer, size_t Size, sockaddr_in &Address) const {
+            socklen_t length = sizeof(Address);
+
+            const auto size = ::recvfrom(m_Handle, Buffer, Size, MSG_DONTWAIT | MSG_TRUNC, (sockaddr *) &Address, &length);
+
+            if (size < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+            return size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramSteering -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static int bpf(int Command, bpf_attr &Attr) {
+            return (int) ::syscall(__NR_bpf, Command, &Attr, sizeof(Attr));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramSteering::CDatagramSteering(): m_Map(-1), m_Program(-1), m_Groups(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramSteering::~CDatagramSteering() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramSteering::Create(uint Groups) {
+            Close();
+
+            if (Groups == 0)
+                return false;
+
+            bpf_attr Map {};
+
+            Map.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+            Map.key_size = sizeof(uint32_t);
+            Map.value_size = sizeof(uint32_t);
+            Map.max_entries = Groups;
+
+            m_Map = bpf(BPF_MAP_CREATE, Map);
+
+            if (m_Map == -1)
+                return false;
+
+            // Same hash as AttachSteering() (IPv4 header without options); the key is built on the stack at -12.
+            const bpf_insn code[] = {
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 },
+                // bpf_skb_load_bytes_relative(ctx, 12, fp - 8, 4, BPF_HDR_START_NET): source address
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 12 },
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0 },
+                { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 4 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET },
+                { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative },
+                { BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 22, 0 },
+                // bpf_skb_load_bytes_relative(ctx, 20, fp - 4, 2, BPF_HDR_START_NET): source port
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 20 },
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0 },
+                { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -4 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 2 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET },
+                { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative },
+                { BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 14, 0 },
+                // key = (ntohl(address) ^ ntohs(port)) % Groups
+                { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_10, -8, 0 },
+                { BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_7, 0, 0, 32 },
+                { BPF_LDX | BPF_MEM | BPF_H, BPF_REG_8, BPF_REG_10, -4, 0 },
+                { BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_8, 0, 0, 16 },
+                { BPF_ALU | BPF_XOR | BPF_X, BPF_REG_7, BPF_REG_8, 0, 0 },
+                { BPF_ALU | BPF_MOD | BPF_K, BPF_REG_7, 0, 0, (int32_t) Groups },
+                { BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_7, -12, 0 },
+                // bpf_sk_select_reuseport(ctx, map, fp - 12, 0)
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 },
+                { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, m_Map },
+                { 0, 0, 0, 0, 0 },
+                { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0 },
+                { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -12 },
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0 },
+                { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport },
+                // Whatever happened the datagram is delivered: without a selection the kernel hashes.
+                { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS },
+                { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 }
+            };
+
+            static const char License[] = "MIT";
+
+            bpf_attr Program {};
+
+            Program.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+            Program.insns = (uint64_t) (uintptr_t) code;
+            Program.insn_cnt = sizeof(code) / sizeof(code[0]);
+            Program.license = (uint64_t) (uintptr_t) License;
+
+            m_Program = bpf(BPF_PROG_LOAD, Program);
+
+            if (m_Program == -1) {
+                const auto error = errno;
+                Close();
+                errno = error;
+                return false;
+            }
+
+            m_Groups = Groups;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramSteering::Close() {
+            if (m_Program != -1) {
+                ::close(m_Program);
+                m_Program = -1;
+            }
+
+            if (m_Map != -1) {
+                ::close(m_Map);
+                m_Map = -1;
+            }
+
+            m_Groups = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramSteering::Attach(int Handle, uint Group) const {
+            if (!Active() || Group >= m_Groups)
+                return false;
+
+            // The program belongs to the group: attaching it again from a new socket is harmless.
+            if (::setsockopt(Handle, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, &m_Program, sizeof(m_Program)) == -1)
+                return false;
+
+            const uint32_t key = Group;
+            const uint32_t value = Handle;
+
+            bpf_attr Update {};
+
+            Update.map_fd = m_Map;
+            Update.key = (uint64_t) (uintptr_t) &key;
+            Update.value = (uint64_t) (uintptr_t) &value;
+            Update.flags = BPF_ANY;
+
+            return bpf(BPF_MAP_UPDATE_ELEM, Update) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramReader -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramReader::CDatagramReader(): CDatagramReader(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramReader::CDatagramReader(size_t Capacity, size_t Size): m_Capacity(0), m_Size(0), m_Count(0) {
+            Allocate(Capacity, Size);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramReader::Allocate(size_t Capacity, size_t Size) {
+            if (m_Capacity == Capacity && m_Size == Size)
+                return;
+
+            m_Capacity = Capacity;
+            m_Size = Size;
+
+            // Longer datagrams are cut to Size bytes and flagged with MSG_TRUNC.
+            m_Slab.resize(m_Capacity * m_Size);
+            m_Slab.shrink_to_fit();
+
+            m_Headers.resize(m_Capacity);
+            m_Vectors.resize(m_Capacity);
+            m_Addresses.resize(m_Capacity);
+            m_Control.resize(m_Capacity * CMSG_SPACE(sizeof(uint32_t)));
+
+            for (size_t i = 0; i < m_Capacity; ++i) {
+                m_Vectors[i].iov_base = m_Slab.data() + i * m_Size;
+                m_Vectors[i].iov_len = m_Size;
+
+                auto &hdr = m_Headers[i].msg_hdr;
+
+                hdr = {};
+                hdr.msg_iov = &m_Vectors[i];
+                hdr.msg_iovlen = 1;
+                hdr.msg_name = &m_Addresses[i];
+                hdr.msg_control = m_Control.data() + i * CMSG_SPACE(sizeof(uint32_t));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramReader::Read(int Handle) {
+            m_Count = 0;
+
+            if (m_Capacity == 0)
+                return 0;
+
+            for (size_t i = 0; i < m_Capacity; ++i) {
+                m_Headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+                m_Headers[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+                m_Headers[i].msg_hdr.msg_flags = 0;
+            }
+
+            const auto count = recvmmsg(Handle, m_Headers.data(), m_Capacity, MSG_DONTWAIT, nullptr);
+
+            if (count < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+            m_Count = count;
+
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramReader::Drops(uint32_t &Value) const {
+            for (size_t i = m_Count; i-- > 0;) {
+                auto &hdr = m_Headers[i].msg_hdr;
+
+                for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR((msghdr *) &hdr, cmsg)) {
+                    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                        ::memcpy(&Value, CMSG_DATA(cmsg), sizeof(Value));
+                        return true;
+                    }
+                }
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramWriter -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramWriter::CDatagramWriter(): CDatagramWriter(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramWriter::CDatagramWriter(size_t Capacity): m_Capacity(0) {
+            Allocate(Capacity);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramWriter::Allocate(size_t Capacity) {
+            m_Capacity = Capacity;
+
+            m_Queue.reserve(m_Capacity);
+            m_Headers.resize(m_Capacity);
+            m_Vectors.resize(m_Capacity);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramWriter::Add(const CDatagramPeer &Peer, const CString &Data) {
+            if (m_Queue.size() >= m_Capacity * DATAGRAM_QUEUE_FACTOR)
+                return false;
+
+            m_Queue.push_back({Peer, Data});
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramWriter::Flush() {
+            size_t index = 0;
+            int sent = 0;
+
+            while (index < m_Queue.size() && m_Capacity > 0) {
+                const auto handle = m_Queue[index].Peer.Handle;
+
+                size_t count = 0;
+                while (count < m_Capacity && index + count < m_Queue.size() && m_Queue[index + count].Peer.Handle == handle) {
+                    auto &item = m_Queue[index + count];
+
+                    m_Vectors[count].iov_base = item.Data.Data();
+                    m_Vectors[count].iov_len = item.Data.Size();
+
+                    auto &hdr = m_Headers[count].msg_hdr;
+
+                    hdr = {};
+                    hdr.msg_iov = &m_Vectors[count];
+                    hdr.msg_iovlen = 1;
+                    hdr.msg_name = &item.Peer.Address;
+                    hdr.msg_namelen = sizeof(sockaddr_in);
+
+                    count++;
+                }
+
+                const auto result = sendmmsg(handle, m_Headers.data(), count, MSG_DONTWAIT);
+
+                if (result < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                        break; // The socket buffer is full: keep the rest for the next flush.
+
+                    Log()->Error(APP_LOG_ERR, errno, _T("sendmmsg failed"));
+                    index++; // The first datagram is the one that failed.
+                    continue;
+                }
+
+                index += result;
+                sent += result;
+            }
+
+            m_Queue.erase(m_Queue.begin(), m_Queue.begin() + index);
+
+            return sent;
+        }
+
+    }
+}
+}
@@ -0,0 +1,232 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Datagram.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Datagram sockets and batched datagram I/O (recvmmsg/sendmmsg)
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_DATAGRAM_HPP
+#define APOSTOL_STREAM_DATAGRAM_HPP
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define DATAGRAM_MAX_SIZE 0xFFFF
+#define DATAGRAM_QUEUE_FACTOR 16
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramPeer ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CDatagramPeer {
+            int Handle = -1;
+            sockaddr_in Address {};
+
+            CDatagramPeer() = default;
+
+            CDatagramPeer(int AHandle, const sockaddr_in &AAddress): Handle(AHandle), Address(AAddress) {
+
+            }
+
+            CDatagramPeer(int AHandle, LPCSTR AIP, ushort APort);
+
+            CString ToString() const;
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramSocket -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CDatagramSocket {
+        private:
+
+            int m_Handle;
+
+        public:
+
+            CDatagramSocket();
+
+            ~CDatagramSocket();
+
+            CDatagramSocket(const CDatagramSocket &) = delete;
+            CDatagramSocket &operator=(const CDatagramSocket &) = delete;
+
+            void Open(const CString &IP, ushort Port, bool ReusePort);
+            void Close();
+
+            // Classic BPF steering: picks the socket by its index in the SO_REUSEPORT group.
+            void AttachSteering(uint Groups);
+
+            // SO_RCVBUF/SO_SNDBUF in bytes (0 - the system default); returns false if the kernel refused a size.
+            bool SetBufferSizes(int Receive, int Send);
+            bool GetBufferSizes(int &Receive, int &Send) const;
+
+            // SO_RXQ_OVFL: every datagram carries the number of datagrams the socket has dropped so far.
+            bool EnableDropCounter();
+
+            // The drop counter of the socket read directly (SO_MEMINFO), also when no datagram carries it.
+            bool Drops(uint32_t &Value) const;
+
+            // One datagram with recvfrom(): returns its full size (more than Size if it was truncated), 0 if none
+            // is waiting and -1 on error.
+            ssize_t ReadFrom(void *Buffer, size_t Size, sockaddr_in &Address) const;
+
+            int Handle() const { return m_Handle; }
+
+            bool Active() const { return m_Handle != -1; }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramSteering -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Steering of a SO_REUSEPORT group that does not depend on the order of its sockets: an eBPF program hashes
+        // the source address, (src_addr ^ src_port) % Groups, and selects that entry of a socket array. Each group
+        // member stores its socket under its own number and replaces it when it rebinds, so a device stays with
+        // the same member. The map and the program need CAP_BPF (or CAP_SYS_ADMIN) to be created; Attach() only
+        // needs the descriptors. If the entry is empty, the kernel picks a socket by its own hash.
+        class CDatagramSteering {
+        private:
+
+            int m_Map;
+            int m_Program;
+
+            uint m_Groups;
+
+        public:
+
+            CDatagramSteering();
+
+            ~CDatagramSteering();
+
+            CDatagramSteering(const CDatagramSteering &) = delete;
+            CDatagramSteering &operator=(const CDatagramSteering &) = delete;
+
+            bool Create(uint Groups);
+            void Close();
+
+            bool Attach(int Handle, uint Group) const;
+
+            bool Active() const { return m_Program != -1; }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramReader -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Receives up to Capacity() datagrams of up to Size() bytes per recvmmsg() call; the data is valid until the
+        // next Read().
+        class CDatagramReader {
+        private:
+
+            size_t m_Capacity;
+            size_t m_Size;
+            size_t m_Count;
+
+            std::vector<BYTE> m_Slab;
+            std::vector<mmsghdr> m_Headers;
+            std::vector<iovec> m_Vectors;
+            std::vector<sockaddr_in> m_Addresses;
+            std::vector<BYTE> m_Control;
+
+        public:
+
+            CDatagramReader();
+
+            explicit CDatagramReader(size_t Capacity, size_t Size = DATAGRAM_MAX_SIZE);
+
+            void Allocate(size_t Capacity, size_t Size = DATAGRAM_MAX_SIZE);
+
+            int Read(int Handle);
+
+            size_t Capacity() const { return m_Capacity; }
+            size_t Size() const { return m_Size; }
+            size_t Count() const { return m_Count; }
+
+            const BYTE *Data(int Index) const { return m_Slab.data() + Index * m_Size; }
+            size_t Size(int Index) const { return m_Headers[Index].msg_len; }
+            bool Truncated(int Index) const { return (m_Headers[Index].msg_hdr.msg_flags & MSG_TRUNC) != 0; }
+
+            CDatagramPeer Peer(int Handle, int Index) const { return {Handle, m_Addresses[Index]}; }
+
+            // The SO_RXQ_OVFL counter of the last datagram read that carries it.
+            bool Drops(uint32_t &Value) const;
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramWriter -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CDatagramWriter {
+        private:
+
+            struct CItem {
+                CDatagramPeer Peer;
+                CString Data;
+            };
+
+            size_t m_Capacity;
+
+            std::vector<CItem> m_Queue;
+
+            std::vector<mmsghdr> m_Headers;
+            std::vector<iovec> m_Vectors;
+
+        public:
+
+            CDatagramWriter();
+
+            explicit CDatagramWriter(size_t Capacity);
+
+            void Allocate(size_t Capacity);
+
+            bool Add(const CDatagramPeer &Peer, const CString &Data);
+
+            int Flush();
+
+            size_t Count() const { return m_Queue.size(); }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_DATAGRAM_HPP
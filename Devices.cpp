@@ -0,0 +1,326 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Devices.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Device state cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Devices.hpp"
+
+#include <cmath>
+#include <sys/mman.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define EARTH_METERS_PER_DEGREE 111320.0
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeviceCache ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDeviceCache::CDeviceCache(): m_Mask(0), m_Count(0), m_MaxDevices(0), m_Accuracy(1), m_Battery(1),
+                m_KeepAlive(300000) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeviceCache::Configure(size_t MaxDevices, double Accuracy, double Battery, uint32_t KeepAlive) {
+            m_Accuracy = Accuracy;
+            m_Battery = Battery;
+            m_KeepAlive = KeepAlive;
+
+            MaxDevices = MaxDevices ? MaxDevices : 1;
+
+            if (MaxDevices == m_MaxDevices)
+                return;
+
+            size_t capacity = 16;
+            while (capacity < MaxDevices * 2)
+                capacity <<= 1;
+
+            m_MaxDevices = MaxDevices;
+            m_Mask = capacity - 1;
+
+            // The devices are seen again soon enough: the table starts empty rather than being rehashed.
+            m_Slots.assign(capacity, CDevice());
+            m_Count = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CDeviceCache::Lookup(const std::string &Device, size_t Hash) const {
+            size_t index = Hash & m_Mask;
+
+            for (;;) {
+                const auto &Slot = m_Slots[index];
+
+                if (Slot.Size == 0)
+                    return index;
+
+                if (Slot.Hash == Hash && Slot.Size == Device.size() && memcmp(Slot.Key, Device.data(), Slot.Size) == 0)
+                    return index;
+
+                index = (index + 1) & m_Mask;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeviceCache::Erase(size_t Index) {
+            // Backward shift: later entries of the cluster move up unless that would put them before their home slot.
+            size_t next = Index;
+
+            for (;;) {
+                next = (next + 1) & m_Mask;
+
+                const auto &Slot = m_Slots[next];
+
+                if (Slot.Size == 0)
+                    break;
+
+                const auto home = Slot.Hash & m_Mask;
+
+                if (((next - home) & m_Mask) >= ((next - Index) & m_Mask)) {
+                    m_Slots[Index] = Slot;
+                    Index = next;
+                }
+            }
+
+            m_Slots[Index] = CDevice();
+            m_Count--;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDevice *CDeviceCache::Update(const std::string &Device, const CDatagramPeer &Peer, uint64_t Now) {
+            if (m_Slots.empty() || Device.size() > DEVICE_KEY_SIZE)
+                return nullptr;
+
+            const auto hash = std::hash<std::string>()(Device);
+            auto index = Lookup(Device, hash);
+
+            if (m_Slots[index].Size != 0) {
+                m_Counters.Hits++;
+            } else {
+                m_Counters.Misses++;
+
+                if (m_Count >= m_MaxDevices) {
+                    size_t victim = SIZE_MAX;
+                    size_t slot = hash & m_Mask;
+
+                    for (int i = 0; i < DEVICE_PROBE_LIMIT; ++i, slot = (slot + 1) & m_Mask) {
+                        if (m_Slots[slot].Size != 0 && (victim == SIZE_MAX || m_Slots[slot].Seen < m_Slots[victim].Seen))
+                            victim = slot;
+                    }
+
+                    // The home slot of a new key can be free while the table is full: take any device then.
+                    if (victim == SIZE_MAX) {
+                        for (victim = 0; m_Slots[victim].Size == 0; ++victim);
+                    }
+
+                    Erase(victim);
+                    m_Counters.Evicted++;
+
+                    index = Lookup(Device, hash);
+                }
+
+                auto &Slot = m_Slots[index];
+
+                Slot.Hash = hash;
+                Slot.Size = (BYTE) Device.size();
+                memcpy(Slot.Key, Device.data(), Device.size());
+
+                m_Count++;
+            }
+
+            auto &Slot = m_Slots[index];
+
+            Slot.Seen = Now;
+            Slot.Peer = Peer;
+
+            return &Slot;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CDevice *CDeviceCache::Find(const std::string &Device) const {
+            if (m_Slots.empty() || Device.size() > DEVICE_KEY_SIZE)
+                return nullptr;
+
+            const auto &Slot = m_Slots[Lookup(Device, std::hash<std::string>()(Device))];
+
+            return Slot.Size == 0 ? nullptr : &Slot;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDeviceCache::Coalesce(CDevice &Device, const LPWAN::CFrame &Frame, uint64_t Now) {
+            LPWAN::CCommand Command;
+
+            if (!LPWAN::ParseCommand(Frame.Payload, Frame.PayloadSize, Command) || !LPWAN::ParseValues(Command, m_Values))
+                return false;
+
+            double battery = NAN;
+            double latitude = NAN;
+            double longitude = NAN;
+            double accuracy = NAN;
+
+            for (const auto &Value : m_Values) {
+                switch (Value.Type) {
+                    case LPWAN::vtBattery:
+                        battery = Value.Value;
+                        break;
+                    case LPWAN::vtLatitude:
+                        latitude = Value.Value;
+                        break;
+                    case LPWAN::vtLongitude:
+                        longitude = Value.Value;
+                        break;
+                    case LPWAN::vtAccuracy:
+                        accuracy = Value.Value;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            const auto position = !std::isnan(latitude) && !std::isnan(longitude);
+
+            // Only battery and position are compared; the other values come with the position fix.
+            bool same = Device.Forwarded != 0 && Now - Device.Forwarded < m_KeepAlive &&
+                    (!std::isnan(battery) || position);
+
+            if (same && !std::isnan(battery))
+                same = std::fabs(battery - Device.Battery) < m_Battery;
+
+            if (same && position) {
+                const auto limit = m_Accuracy * std::fmax(std::isnan(accuracy) ? 0 : accuracy, std::isnan(Device.Accuracy) ? 0 : Device.Accuracy);
+
+                const auto dy = (latitude - Device.Latitude) * EARTH_METERS_PER_DEGREE;
+                const auto dx = (longitude - Device.Longitude) * EARTH_METERS_PER_DEGREE * std::cos(latitude * M_PI / 180);
+
+                same = std::sqrt(dx * dx + dy * dy) <= limit;
+            }
+
+            if (same) {
+                m_Counters.Suppressed++;
+                return true;
+            }
+
+            if (Device.Forwarded != 0 && Now - Device.Forwarded >= m_KeepAlive)
+                m_Counters.KeepAlives++;
+
+            if (!std::isnan(battery))
+                Device.Battery = battery;
+
+            if (position) {
+                Device.Latitude = latitude;
+                Device.Longitude = longitude;
+                Device.Accuracy = accuracy;
+            }
+
+            Device.Forwarded = Now;
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeviceCache::Clear() {
+            m_Slots.clear();
+            m_Mask = 0;
+            m_Count = 0;
+            m_MaxDevices = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeviceOwners ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDeviceOwners::CDeviceOwners(): m_Slots(nullptr), m_Mask(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDeviceOwners::~CDeviceOwners() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDeviceOwners::Create(size_t Count) {
+            Close();
+
+            size_t size = 1024;
+            while (size < Count)
+                size <<= 1;
+
+            auto pMap = ::mmap(nullptr, size * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (pMap == MAP_FAILED)
+                return false;
+
+            m_Slots = static_cast<uint64_t *>(pMap);
+            m_Mask = size - 1;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeviceOwners::Close() {
+            if (m_Slots != nullptr) {
+                ::munmap(m_Slots, (m_Mask + 1) * sizeof(uint64_t));
+                m_Slots = nullptr;
+                m_Mask = 0;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeviceOwners::Set(const CDevice &Device, int Worker) {
+            if (m_Slots == nullptr)
+                return;
+
+            auto &slot = m_Slots[Device.Hash & m_Mask];
+            const auto value = Tag(Device.Hash) | (uint64_t) (Worker + 1);
+
+            // Every packet gets here: the line is written only when the owner changes.
+            if (__atomic_load_n(&slot, __ATOMIC_RELAXED) != value)
+                __atomic_store_n(&slot, value, __ATOMIC_RELAXED);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDeviceOwners::Get(const std::string &Device) const {
+            if (m_Slots == nullptr)
+                return -1;
+
+            const auto hash = std::hash<std::string>()(Device);
+            const auto value = __atomic_load_n(&m_Slots[hash & m_Mask], __ATOMIC_RELAXED);
+
+            if (value == 0 || (value & ~(uint64_t) 0xFF) != Tag(hash))
+                return -1;
+
+            return (int) (value & 0xFF) - 1;
+        }
+
+    }
+}
+}
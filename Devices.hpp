@@ -0,0 +1,176 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Devices.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Device state cache
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_DEVICES_HPP
+#define APOSTOL_STREAM_DEVICES_HPP
+
+#include <cmath>
+
+#include "LPWAN.hpp"
+#include "Datagram.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define DEVICE_KEY_SIZE 33
+#define DEVICE_PROBE_LIMIT 8
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeviceCounters -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CDeviceCounters {
+            uint64_t Hits = 0;
+            uint64_t Misses = 0;
+            uint64_t Evicted = 0;
+
+            uint64_t Suppressed = 0;
+            uint64_t KeepAlives = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDevice ---------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // The last known values are the ones last forwarded to the database, so small changes do not add up unseen.
+        struct CDevice {
+            size_t Hash = 0;
+
+            BYTE Size = 0;                  // Key size, 0 - free slot
+            char Key[DEVICE_KEY_SIZE] {};   // Device type and serial number
+
+            uint64_t Seen = 0;
+            uint64_t Forwarded = 0;
+
+            double Battery = NAN;
+            double Latitude = NAN;
+            double Longitude = NAN;
+            double Accuracy = NAN;
+
+            CDatagramPeer Peer;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeviceCache ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Open addressing with linear probing over a power-of-two table at most half full. When the table holds
+        // MaxDevices, the least recently seen device among the first slots of the probe sequence makes room.
+        class CDeviceCache {
+        private:
+
+            std::vector<CDevice> m_Slots;
+            size_t m_Mask;
+
+            size_t m_Count;
+            size_t m_MaxDevices;
+
+            double m_Accuracy;
+            double m_Battery;
+            uint32_t m_KeepAlive;
+
+            std::vector<LPWAN::CValue> m_Values;
+
+            CDeviceCounters m_Counters;
+
+            size_t Lookup(const std::string &Device, size_t Hash) const;
+            void Erase(size_t Index);
+
+        public:
+
+            CDeviceCache();
+
+            void Configure(size_t MaxDevices, double Accuracy, double Battery, uint32_t KeepAlive);
+
+            // Finds or adds the device and records the peer it was last seen at. Returns nullptr for serial numbers
+            // too long to be cached.
+            CDevice *Update(const std::string &Device, const CDatagramPeer &Peer, uint64_t Now);
+
+            const CDevice *Find(const std::string &Device) const;
+
+            // Returns true if the current values (0x04) in Frame are within the thresholds of the values last
+            // forwarded and the keep-alive interval has not passed, so the packet need not reach the database.
+            bool Coalesce(CDevice &Device, const LPWAN::CFrame &Frame, uint64_t Now);
+
+            void Clear();
+
+            size_t Count() const { return m_Count; }
+
+            const CDeviceCounters &Counters() const { return m_Counters; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeviceOwners ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // The worker that last heard from each device, shared by all workers: a direct-mapped table in anonymous
+        // shared memory that the master maps before the workers are forked. A slot holds the device hash with the
+        // worker number in its low byte; a device whose slot has been taken by another one is unknown again.
+        class CDeviceOwners {
+        private:
+
+            uint64_t *m_Slots;
+            size_t m_Mask;
+
+            static uint64_t Tag(size_t Hash) { return (uint64_t) Hash & ~(uint64_t) 0xFF; }
+
+        public:
+
+            CDeviceOwners();
+
+            ~CDeviceOwners();
+
+            CDeviceOwners(const CDeviceOwners &) = delete;
+            CDeviceOwners &operator=(const CDeviceOwners &) = delete;
+
+            bool Create(size_t Count);
+            void Close();
+
+            void Set(const CDevice &Device, int Worker);
+
+            // Returns the worker, or -1 if the device is not known.
+            int Get(const std::string &Device) const;
+
+            bool Active() const { return m_Slots != nullptr; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_DEVICES_HPP
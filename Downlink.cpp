@@ -0,0 +1,324 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Downlink.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Commands to devices
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Downlink.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define DOWNLINK_RECENT_IDS 4096
+#define DOWNLINK_MAX_BACKOFF 6
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDownlink -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDownlink::CDownlink(): m_Wheel(10), m_NextId(0), m_Number(0), m_PacketSize(512), m_MaxCommands(10000),
+                m_Timeout(1000), m_Expiry(3600000), m_Retries(5), m_Released(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Configure(size_t PacketSize, size_t MaxCommands, uint32_t Timeout, int Retries, uint32_t Expiry) {
+            m_PacketSize = PacketSize ? PacketSize : 1;
+            m_MaxCommands = MaxCommands;
+            m_Timeout = Timeout ? Timeout : 1;
+            m_Retries = Retries < 0 ? 0 : Retries;
+            m_Expiry = Expiry;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::string CDownlink::NumberKey(const std::string &Device, BYTE Number) {
+            std::string Key(Device);
+            Key.push_back((char) Number);
+            return Key;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDownlink::Known(const CString &Id) const {
+            return m_Recent.count(std::string(Id.c_str(), Id.Size())) != 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Remember(const CString &Id) {
+            std::string Key(Id.c_str(), Id.Size());
+
+            if (!m_Recent.insert(Key).second)
+                return;
+
+            m_RecentOrder.push_back(std::move(Key));
+
+            if (m_RecentOrder.size() > DOWNLINK_RECENT_IDS) {
+                m_Recent.erase(m_RecentOrder.front());
+                m_RecentOrder.pop_front();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDownlink::Add(const CString &Id, BYTE DeviceType, const std::string &Serial, const CString &Data,
+                uint64_t Now, const COnSend &Send) {
+
+            // Only an accepted command is remembered: one rejected here may be sent again under the same id.
+            if (!Id.IsEmpty() && Known(Id)) {
+                m_Counters.Duplicates++;
+                return false;
+            }
+
+            if (Serial.empty() || Serial.size() > 0xFF || m_Commands.size() >= m_MaxCommands) {
+                m_Counters.Rejected++;
+                return false;
+            }
+
+            std::string Device;
+
+            Device.reserve(1 + Serial.size());
+            Device.push_back((char) DeviceType);
+            Device.append(Serial);
+
+            if (m_OnOwner && m_OnOwner(Device) == doOther)
+                return false;
+
+            // The next command number the device has no command under yet.
+            int count = 0;
+            while (count < 256 && m_Numbers.count(NumberKey(Device, m_Number)) != 0) {
+                m_Number++;
+                count++;
+            }
+
+            if (count == 256) {
+                m_Counters.Rejected++;
+                return false;
+            }
+
+            const size_t total = Data.IsEmpty() ? 1 : (Data.Size() + m_PacketSize - 1) / m_PacketSize;
+
+            if (total > 256) {
+                m_Counters.Rejected++;
+                return false;
+            }
+
+            const auto id = ++m_NextId;
+
+            auto &Command = m_Commands[id];
+
+            Command.Id = Id;
+            Command.Device = Device;
+            Command.Number = m_Number++;
+            Command.Created = Now;
+
+            LPWAN::CFrame Header;
+
+            Header.DeviceType = DeviceType;
+            Header.SerialSize = (BYTE) Serial.size();
+            Header.Serial = Serial.data();
+            Header.Command = Command.Number;
+
+            Command.Packets.reserve(total);
+
+            for (size_t i = 0; i < total; ++i) {
+                const size_t offset = i * m_PacketSize;
+                const size_t size = Data.IsEmpty() ? 0 : std::min(m_PacketSize, Data.Size() - offset);
+
+                Header.Parameters = LPWAN_TO_DEVICE;
+                if (i == 0)
+                    Header.Parameters |= LPWAN_FIRST_PACKET;
+                if (i == total - 1)
+                    Header.Parameters |= LPWAN_LAST_PACKET;
+
+                Header.Packet = (BYTE) i;
+
+                const auto &Packet = LPWAN::Encode(Header, Data.Data() + offset, size);
+
+                if (Packet.IsEmpty()) {
+                    m_Commands.erase(id);
+                    m_Counters.Rejected++;
+                    return false;
+                }
+
+                Command.Packets.push_back(Packet);
+            }
+
+            if (!Id.IsEmpty())
+                Remember(Id);
+
+            m_Numbers[NumberKey(Device, Command.Number)] = id;
+            m_Counters.Commands++;
+
+            Transmit(id, Command, Now, Send);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Schedule(uint64_t Id, CCommand &Command, uint64_t Deadline) {
+            Command.Deadline = Deadline;
+            m_Wheel.Schedule(Deadline, CTimer(Id, Deadline));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Transmit(uint64_t Id, CCommand &Command, uint64_t Now, const COnSend &Send) {
+            if (!Send(Command.Device, Command.Packets)) {
+                if (!Command.Waiting) {
+                    Command.Waiting = true;
+                    m_Waiting.emplace(Command.Device, Id);
+                }
+                Schedule(Id, Command, Command.Created + m_Expiry);
+                return;
+            }
+
+            Command.Attempts++;
+            m_Counters.Packets += Command.Packets.size();
+
+            const int shift = std::min(Command.Attempts - 1, DOWNLINK_MAX_BACKOFF);
+            Schedule(Id, Command, std::min(Now + ((uint64_t) m_Timeout << shift), Command.Created + m_Expiry));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Delete(uint64_t Id) {
+            const auto it = m_Commands.find(Id);
+            if (it == m_Commands.end())
+                return;
+
+            const auto &Command = it->second;
+
+            m_Numbers.erase(NumberKey(Command.Device, Command.Number));
+
+            if (Command.Waiting) {
+                auto range = m_Waiting.equal_range(Command.Device);
+                for (auto w = range.first; w != range.second; ++w) {
+                    if (w->second == Id) {
+                        m_Waiting.erase(w);
+                        break;
+                    }
+                }
+            }
+
+            m_Commands.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDownlink::Acknowledge(const std::string &Device, BYTE Number) {
+            const auto it = m_Numbers.find(NumberKey(Device, Number));
+            if (it == m_Numbers.end())
+                return false;
+
+            Delete(it->second);
+            m_Counters.Acknowledged++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Resume(const std::string &Device, uint64_t Now, const COnSend &Send) {
+            auto range = m_Waiting.equal_range(Device);
+            if (range.first == range.second)
+                return;
+
+            std::vector<uint64_t> ids;
+            for (auto it = range.first; it != range.second; ++it)
+                ids.push_back(it->second);
+
+            m_Waiting.erase(range.first, range.second);
+
+            for (auto id : ids) {
+                const auto it = m_Commands.find(id);
+                if (it == m_Commands.end())
+                    continue;
+
+                it->second.Waiting = false;
+                Transmit(id, it->second, Now, Send);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Release(uint64_t Now) {
+            // Once a second: a device another process has heard from is that process's to command.
+            if (!m_OnOwner || m_Waiting.empty() || Now < m_Released + 1000)
+                return;
+
+            m_Released = Now;
+
+            std::vector<uint64_t> ids;
+
+            for (const auto &waiting : m_Waiting) {
+                if (m_OnOwner(waiting.first) == doOther)
+                    ids.push_back(waiting.second);
+            }
+
+            for (auto id : ids)
+                Delete(id);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Expire(uint64_t Now, const COnSend &Send) {
+            std::vector<uint64_t> due;
+
+            Release(Now);
+
+            m_Wheel.Advance(Now, [this, &due](const CTimer &Timer) {
+                const auto it = m_Commands.find(Timer.first);
+                // Timers are not cancelled: a stale one no longer matches the deadline of its command.
+                if (it != m_Commands.end() && it->second.Deadline == Timer.second)
+                    due.push_back(Timer.first);
+            });
+
+            for (auto id : due) {
+                const auto it = m_Commands.find(id);
+                if (it == m_Commands.end())
+                    continue;
+
+                auto &Command = it->second;
+
+                if (Now >= Command.Created + m_Expiry) {
+                    if (!Command.Waiting || !m_OnOwner || m_OnOwner(Command.Device) == doSelf)
+                        m_Counters.Expired++;
+                    Delete(id);
+                } else if (Command.Attempts > m_Retries) {
+                    m_Counters.Failed++;
+                    Delete(id);
+                } else if (!Command.Waiting) {
+                    m_Counters.Retries++;
+                    Transmit(id, Command, Now, Send);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDownlink::Clear() {
+            m_Commands.clear();
+            m_Numbers.clear();
+            m_Waiting.clear();
+        }
+
+    }
+}
+}
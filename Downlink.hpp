@@ -0,0 +1,172 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Downlink.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Commands to devices
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_DOWNLINK_HPP
+#define APOSTOL_STREAM_DOWNLINK_HPP
+
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "LPWAN.hpp"
+#include "TimerWheel.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDownlinkCounters -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CDownlinkCounters {
+            uint64_t Commands = 0;
+            uint64_t Duplicates = 0;
+            uint64_t Rejected = 0;
+
+            uint64_t Packets = 0;
+            uint64_t Retries = 0;
+
+            uint64_t Acknowledged = 0;
+            uint64_t Failed = 0;
+            uint64_t Expired = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDownlink -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Which process sends the commands of a device when several of them receive the same notifications.
+        enum CDownlinkOwner { doSelf = 0, doOther, doUnknown };
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Commands waiting for the device's reply, keyed by device (type and serial number) and command number. A
+        // command is sent again with a doubling delay until the device replies with the same command number or the
+        // retries run out. A command for a device whose address is not known waits for its next packet until Expiry.
+        class CDownlink {
+        public:
+
+            // Send(Device, Packets) returns false if the address of the device is not known.
+            typedef std::function<bool (const std::string &Device, const std::vector<CString> &Packets)> COnSend;
+
+            typedef std::function<CDownlinkOwner (const std::string &Device)> COnOwner;
+
+        private:
+
+            struct CCommand {
+                CString Id;
+                std::string Device;
+                BYTE Number = 0;
+
+                std::vector<CString> Packets;
+
+                int Attempts = 0;
+                bool Waiting = false;
+
+                uint64_t Created = 0;
+                uint64_t Deadline = 0;
+            };
+
+            typedef std::pair<uint64_t, uint64_t> CTimer; // Command id and deadline
+
+            std::unordered_map<uint64_t, CCommand> m_Commands;
+            std::unordered_map<std::string, uint64_t> m_Numbers;
+            std::unordered_multimap<std::string, uint64_t> m_Waiting;
+
+            std::unordered_set<std::string> m_Recent;
+            std::deque<std::string> m_RecentOrder;
+
+            CTimerWheel<CTimer> m_Wheel;
+
+            uint64_t m_NextId;
+            BYTE m_Number;
+
+            size_t m_PacketSize;
+            size_t m_MaxCommands;
+
+            uint32_t m_Timeout;
+            uint32_t m_Expiry;
+            int m_Retries;
+
+            CDownlinkCounters m_Counters;
+
+            COnOwner m_OnOwner;
+            uint64_t m_Released;
+
+            static std::string NumberKey(const std::string &Device, BYTE Number);
+
+            bool Known(const CString &Id) const;
+            void Remember(const CString &Id);
+
+            void Schedule(uint64_t Id, CCommand &Command, uint64_t Deadline);
+            void Transmit(uint64_t Id, CCommand &Command, uint64_t Now, const COnSend &Send);
+            void Delete(uint64_t Id);
+
+            void Release(uint64_t Now);
+
+        public:
+
+            CDownlink();
+
+            void Configure(size_t PacketSize, size_t MaxCommands, uint32_t Timeout, int Retries, uint32_t Expiry);
+
+            // Splits the command data into packets to the device and sends them. The same Id is taken once.
+            bool Add(const CString &Id, BYTE DeviceType, const std::string &Serial, const CString &Data, uint64_t Now,
+                     const COnSend &Send);
+
+            // A reply from the device: the command with its number is done.
+            bool Acknowledge(const std::string &Device, BYTE Number);
+
+            // The device has been heard from: commands waiting for its address go out now.
+            void Resume(const std::string &Device, uint64_t Now, const COnSend &Send);
+
+            void Expire(uint64_t Now, const COnSend &Send);
+
+            void Clear();
+
+            // Without the handler every device is this process's own. A command for a device of another process is
+            // not taken, one waiting for it is dropped, and a command that expires waiting for a device nobody owns
+            // is counted by the process the handler calls its owner.
+            void OnOwner(COnOwner Handler) { m_OnOwner = std::move(Handler); }
+
+            size_t Count() const { return m_Commands.size(); }
+            bool Waiting() const { return !m_Waiting.empty(); }
+
+            const CDownlinkCounters &Counters() const { return m_Counters; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_DOWNLINK_HPP
@@ -0,0 +1,177 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Duplicates.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Duplicate packet suppression
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Duplicates.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDuplicateCache -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDuplicateCache::CDuplicateCache(): m_MaxEntries(65536), m_Window(30000), m_Generation(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Configure(size_t MaxEntries, uint32_t Window) {
+            m_MaxEntries = MaxEntries ? MaxEntries : 1;
+            m_Window = Window;
+
+            m_Entries.reserve(m_MaxEntries);
+
+            while (m_Entries.size() > m_MaxEntries)
+                Evict();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Evict() {
+            // Drops the oldest live entry, skipping the places of the entries already removed.
+            while (!m_Order.empty()) {
+                const auto &front = m_Order.front();
+                const auto it = m_Entries.find(front.first);
+                const auto live = it != m_Entries.end() && it->second.Generation == front.second;
+
+                if (live)
+                    m_Entries.erase(it);
+
+                m_Order.pop_front();
+
+                if (live)
+                    break;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDuplicateStatus CDuplicateCache::Check(const std::string &Key, uint64_t Now, CString &Reply) {
+            Expire(Now);
+
+            const auto it = m_Entries.find(Key);
+
+            if (it != m_Entries.end()) {
+                m_Counters.Hits++;
+
+                if (!it->second.Replied)
+                    return dsPending;
+
+                m_Counters.Resent++;
+                Reply = it->second.Reply;
+
+                return dsReplied;
+            }
+
+            m_Counters.Misses++;
+
+            while (!m_Entries.empty() && m_Entries.size() >= m_MaxEntries)
+                Evict();
+
+            auto &entry = m_Entries[Key];
+            entry.Expires = Now + m_Window;
+            entry.Generation = ++m_Generation;
+
+            m_Order.emplace_back(Key, entry.Generation);
+
+            return dsNew;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Link(const std::string &Key, const std::vector<std::string> &Keys) {
+            const auto it = m_Entries.find(Key);
+
+            if (it == m_Entries.end())
+                return;
+
+            for (const auto &key : Keys) {
+                if (key != Key && m_Entries.count(key) != 0)
+                    it->second.Linked.push_back(key);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Store(const std::string &Key, const CString &Reply) {
+            const auto it = m_Entries.find(Key);
+
+            if (it == m_Entries.end())
+                return;
+
+            it->second.Replied = true;
+            it->second.Reply = Reply;
+
+            for (const auto &key : it->second.Linked) {
+                const auto linked = m_Entries.find(key);
+
+                if (linked != m_Entries.end()) {
+                    linked->second.Replied = true;
+                    linked->second.Reply = Reply;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Remove(const std::string &Key) {
+            const auto it = m_Entries.find(Key);
+
+            if (it == m_Entries.end())
+                return;
+
+            for (const auto &key : it->second.Linked)
+                m_Entries.erase(key);
+
+            m_Entries.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Expire(uint64_t Now) {
+            while (!m_Order.empty()) {
+                const auto &front = m_Order.front();
+                const auto it = m_Entries.find(front.first);
+
+                if (it != m_Entries.end() && it->second.Generation == front.second) {
+                    if (it->second.Expires > Now)
+                        break;
+                    m_Entries.erase(it);
+                }
+
+                m_Order.pop_front();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDuplicateCache::Clear() {
+            m_Entries.clear();
+            m_Order.clear();
+        }
+
+    }
+}
+}
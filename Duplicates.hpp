@@ -0,0 +1,134 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Duplicates.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Duplicate packet suppression
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_DUPLICATES_HPP
+#define APOSTOL_STREAM_DUPLICATES_HPP
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDuplicateCounters ----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CDuplicateCounters {
+            uint64_t Hits = 0;
+            uint64_t Misses = 0;
+            uint64_t Resent = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDuplicateCache -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CDuplicateStatus { dsNew = 0, dsPending, dsReplied };
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Packets seen within the window, keyed by (serial number, command number, packet number, CRC), with the reply
+        // from the database once it has arrived. Every entry lives for the same window, so they expire in FIFO order.
+        // An entry removed early leaves its place in the order behind: the generation tells it from a newer entry
+        // stored under the same key.
+        class CDuplicateCache {
+        private:
+
+            struct CEntry {
+                uint64_t Expires = 0;
+                uint64_t Generation = 0;
+                bool Replied = false;
+                CString Reply;
+                std::vector<std::string> Linked;
+            };
+
+            typedef std::pair<std::string, uint64_t> COrder;
+
+            std::unordered_map<std::string, CEntry> m_Entries;
+            std::deque<COrder> m_Order;
+
+            size_t m_MaxEntries;
+            uint32_t m_Window;
+            uint64_t m_Generation;
+
+            CDuplicateCounters m_Counters;
+
+            void Evict();
+
+        public:
+
+            CDuplicateCache();
+
+            void Configure(size_t MaxEntries, uint32_t Window);
+
+            // Any frame with a command and packet number, a CRC and a serial number.
+            template <class TFrame>
+            static std::string Key(const TFrame &Frame) {
+                std::string key;
+
+                key.reserve(4 + Frame.SerialSize);
+                key.push_back((char) Frame.Command);
+                key.push_back((char) Frame.Packet);
+                key.push_back((char) (Frame.CRC & 0xFF));
+                key.push_back((char) (Frame.CRC >> 8));
+                key.append(Frame.Serial, Frame.SerialSize);
+
+                return key;
+            }
+
+            // Remembers a new packet; for a duplicate returns dsPending or dsReplied with the cached reply in Reply.
+            CDuplicateStatus Check(const std::string &Key, uint64_t Now, CString &Reply);
+
+            // Ties the keys of the packets of an assembled command to the key of its final packet: they share its
+            // reply, or go with it when the command fails.
+            void Link(const std::string &Key, const std::vector<std::string> &Keys);
+
+            void Store(const std::string &Key, const CString &Reply);
+            void Remove(const std::string &Key);
+
+            void Expire(uint64_t Now);
+
+            void Clear();
+
+            size_t Count() const { return m_Entries.size(); }
+
+            const CDuplicateCounters &Counters() const { return m_Counters; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_DUPLICATES_HPP
@@ -0,0 +1,602 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  LPWAN.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  LPWAN protocol
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_LPWAN_HPP
+#define APOSTOL_STREAM_LPWAN_HPP
+
+#include <endian.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+// CRC16 bytes per step: 1 - table per byte, 4 - slice-by-4, 8 - slice-by-8.
+#ifndef LPWAN_CRC16_SLICE
+#define LPWAN_CRC16_SLICE 8
+#endif
+
+// Maximum value of the length field
+#define LPWAN_MAX_LENGTH 0x7FFF
+
+// Parameters bits
+#define LPWAN_FIRST_PACKET  0x01
+#define LPWAN_LAST_PACKET   0x02
+#define LPWAN_TO_DEVICE     0x04
+#define LPWAN_REPLY         0x08
+
+// Command types
+#define LPWAN_COMMAND_STATE  0x01
+#define LPWAN_COMMAND_VALUES 0x04
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace LPWAN {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCRC16 ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // CRC16 (Modbus): polynomial x16 + x15 + x2 + 1 (0xA001 reflected), initial value 0xFFFF.
+        template <int Slice>
+        class CCRC16 {
+        private:
+
+            struct CTable {
+                ushort Row[8][256];
+            };
+
+            static constexpr CTable Generate() {
+                CTable table {};
+
+                for (int b = 0; b < 256; ++b) {
+                    ushort crc = b;
+
+                    for (int j = 0; j < 8; ++j)
+                        crc = (crc & 0x01) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+
+                    table.Row[0][b] = crc;
+                }
+
+                for (int k = 1; k < 8; ++k) {
+                    for (int b = 0; b < 256; ++b) {
+                        const ushort crc = table.Row[k - 1][b];
+                        table.Row[k][b] = (crc >> 8) ^ table.Row[0][crc & 0xFF];
+                    }
+                }
+
+                return table;
+            }
+
+            static constexpr CTable Table = Generate();
+
+        public:
+
+            static ushort Calculate(const void *Buffer, size_t Size, ushort CRC = 0xFFFF) {
+                auto p = static_cast<const BYTE *>(Buffer);
+                unsigned crc = CRC;
+
+                if (Slice == 8) {
+                    for (; Size >= 8; Size -= 8, p += 8) {
+                        crc = Table.Row[7][(p[0] ^ crc) & 0xFF] ^ Table.Row[6][(p[1] ^ (crc >> 8)) & 0xFF] ^
+                              Table.Row[5][p[2]] ^ Table.Row[4][p[3]] ^ Table.Row[3][p[4]] ^ Table.Row[2][p[5]] ^
+                              Table.Row[1][p[6]] ^ Table.Row[0][p[7]];
+                    }
+                } else if (Slice == 4) {
+                    for (; Size >= 4; Size -= 4, p += 4) {
+                        crc = Table.Row[3][(p[0] ^ crc) & 0xFF] ^ Table.Row[2][(p[1] ^ (crc >> 8)) & 0xFF] ^
+                              Table.Row[1][p[2]] ^ Table.Row[0][p[3]];
+                    }
+                }
+
+                for (; Size > 0; --Size, ++p)
+                    crc = (crc >> 8) ^ Table.Row[0][(crc ^ *p) & 0xFF];
+
+                return (ushort) crc;
+            }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        template <int Slice>
+        constexpr typename CCRC16<Slice>::CTable CCRC16<Slice>::Table;
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline ushort CRC16(const void *Buffer, size_t Size) {
+            return CCRC16<LPWAN_CRC16_SLICE>::Calculate(Buffer, Size);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- Data types ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // All data types are transmitted little-endian.
+        inline uint16_t GetUInt16(const BYTE *p) {
+            uint16_t value;
+            ::memcpy(&value, p, sizeof(value));
+            return le16toh(value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline uint32_t GetUInt32(const BYTE *p) {
+            uint32_t value;
+            ::memcpy(&value, p, sizeof(value));
+            return le32toh(value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline float GetFloat(const BYTE *p) {
+            const uint32_t bits = GetUInt32(p);
+            float value;
+            ::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline double GetDouble(const BYTE *p) {
+            uint64_t bits;
+            ::memcpy(&bits, p, sizeof(bits));
+            bits = le64toh(bits);
+            double value;
+            ::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CFrame ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CFrameStatus { fsOk = 0, fsEnd, fsIncorrectLength, fsInvalidCRC, fsInvalidHeader };
+        //--------------------------------------------------------------------------------------------------------------
+
+        // A packet inside the receive buffer: pointers refer to the buffer, nothing is copied.
+        struct CFrame {
+            const BYTE *Data = nullptr;     // Packet start (the length field)
+            size_t Offset = 0;              // Offset of the packet in the buffer
+            size_t Size = 0;                // Size of the whole packet, including the length field
+
+            size_t Length = 0;              // Value of the length field
+
+            BYTE Version = 0;
+            BYTE Parameters = 0;
+            BYTE DeviceType = 0;
+            BYTE SerialSize = 0;
+            const char *Serial = nullptr;
+            BYTE Command = 0;               // Command number
+            BYTE Packet = 0;                // Packet number
+
+            const BYTE *Payload = nullptr;  // Packet data
+            size_t PayloadSize = 0;
+
+            ushort CRC = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CLengthFraming --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Framing policy: every packet starts with its length (1 or 2 bytes).
+        struct CLengthFraming {
+
+            static CFrameStatus Split(const BYTE *p, size_t Available, size_t &Prefix, size_t &Length) {
+                // length – длина данных (1 или 2 байта).
+                // 1 байт: 0-6 бит – младшие биты длины, 7 бит – длина данных 2 байта).
+                // 2 байт: присутствует если установлен 7 бит первого байта, 0-7 бит – старшие биты длины.
+                Prefix = 1;
+                Length = p[0];
+
+                if ((Length & 0x80) == 0x80) {
+                    if (Available < 2)
+                        return fsIncorrectLength;
+
+                    Length = ((Length & 0x7F) << 8) | p[1];
+                    Prefix = 2;
+                }
+
+                if (Length < sizeof(ushort) || Length > Available - Prefix)
+                    return fsIncorrectLength;
+
+                return fsOk;
+            }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CVersion1 -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Decoder policy of protocol version 1: CRC16 at the end of the packet and the header described in README.
+        struct CVersion1 {
+
+            static bool Accepts(BYTE Version) { return Version == 1; }
+
+            static bool Check(CFrame &Frame) {
+                const BYTE *p = Frame.Data;
+
+                Frame.CRC = (ushort) (p[Frame.Size - 1] << 8 | p[Frame.Size - 2]);
+
+                return Frame.CRC == CRC16(p, Frame.Size - sizeof(ushort));
+            }
+
+            static bool Header(const BYTE *Header, size_t Size, CFrame &Frame) {
+                // Version, parameters, device type, serial number size, serial number, command and packet numbers.
+                Size -= sizeof(ushort);
+
+                if (Size < 4 || Size < 4 + (size_t) Header[3] + 2)
+                    return false;
+
+                Frame.Version = Header[0];
+                Frame.Parameters = Header[1];
+                Frame.DeviceType = Header[2];
+                Frame.SerialSize = Header[3];
+                Frame.Serial = reinterpret_cast<const char *>(Header + 4);
+                Frame.Command = Header[4 + Frame.SerialSize];
+                Frame.Packet = Header[5 + Frame.SerialSize];
+
+                Frame.Payload = Header + 6 + Frame.SerialSize;
+                Frame.PayloadSize = Size - 6 - Frame.SerialSize;
+
+                return true;
+            }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CProtocolReader -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Splits a datagram into packets with the framing policy; the version byte that follows the length picks
+        // the first decoder policy that accepts it. All of it is resolved at compile time: no virtual calls.
+        template <class TFraming, class... TVersions>
+        class CProtocolReader {
+        private:
+
+            const BYTE *m_Data;
+            size_t m_Size;
+            size_t m_Position;
+
+            template <class TVersion>
+            static CFrameStatus Decode(const BYTE *Header, CFrame &Frame) {
+                if (!TVersion::Accepts(Header[0]))
+                    return fsInvalidHeader;
+
+                if (!TVersion::Check(Frame))
+                    return fsInvalidCRC;
+
+                return TVersion::Header(Header, Frame.Length, Frame) ? fsOk : fsInvalidHeader;
+            }
+
+            template <class TVersion, class TNext, class... TRest>
+            static CFrameStatus Decode(const BYTE *Header, CFrame &Frame) {
+                if (TVersion::Accepts(Header[0]))
+                    return Decode<TVersion>(Header, Frame);
+
+                return Decode<TNext, TRest...>(Header, Frame);
+            }
+
+        public:
+
+            CProtocolReader(const void *Data, size_t Size): m_Data(static_cast<const BYTE *>(Data)), m_Size(Size), m_Position(0) {
+
+            }
+
+            size_t Position() const { return m_Position; }
+            size_t Remaining() const { return m_Size - m_Position; }
+
+            CFrameStatus Next(CFrame &Frame) {
+                if (m_Position >= m_Size)
+                    return fsEnd;
+
+                const BYTE *p = m_Data + m_Position;
+                const size_t available = m_Size - m_Position;
+
+                Frame = CFrame();
+
+                Frame.Data = p;
+                Frame.Offset = m_Position;
+                Frame.Size = available;
+
+                size_t prefix;
+                size_t length;
+
+                if (TFraming::Split(p, available, prefix, length) != fsOk) {
+                    m_Position = m_Size;
+                    return fsIncorrectLength;
+                }
+
+                Frame.Length = length;
+                Frame.Size = prefix + length;
+                m_Position += Frame.Size;
+
+                return Decode<TVersions...>(p + prefix, Frame);
+            }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef CProtocolReader<CLengthFraming, CVersion1> CFrameReader;
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CProtocol -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // The LPWAN entry of the protocol registry (see CStreamServer::FindProtocol). CStreamServer::Receive() knows
+        // a protocol only through this policy: the reader, its frame and statuses, and what it needs from a frame.
+        struct CProtocol {
+            typedef CFrameReader CReader;
+            typedef LPWAN::CFrame CFrame;
+            typedef CFrameStatus CStatus;
+
+            static constexpr CStatus Ok = fsOk;
+            static constexpr CStatus End = fsEnd;
+            static constexpr CStatus IncorrectLength = fsIncorrectLength;
+            static constexpr CStatus InvalidCRC = fsInvalidCRC;
+            static constexpr CStatus InvalidHeader = fsInvalidHeader;
+
+            static const char *Name() { return "LPWAN"; }
+
+            // A dropped frame is not parsed: the device type is taken from its place in the header, if it is there.
+            static BYTE DeviceType(const CFrame &Frame) {
+                if (Frame.Data == nullptr || Frame.Size == 0)
+                    return 0;
+
+                const size_t prefix = (Frame.Data[0] & 0x80) == 0x80 ? 2 : 1;
+
+                return Frame.Size > prefix + 2 ? Frame.Data[prefix + 2] : 0;
+            }
+
+            // The packet is a whole command: nothing to reassemble.
+            static bool Single(const CFrame &Frame) {
+                return (Frame.Parameters & (LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET)) == (LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET);
+            }
+
+            // The CRC the packet should have carried.
+            static unsigned Checksum(const CFrame &Frame) {
+                return Frame.Size < sizeof(ushort) ? 0 : CRC16(Frame.Data, Frame.Size - sizeof(ushort));
+            }
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- Encode ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Builds a packet with the header of Frame (version, parameters, device type, serial, command and packet
+        // numbers) and the given data. Returns an empty string if the packet does not fit into the length field.
+        inline CString Encode(const CFrame &Frame, const void *Data, size_t Size) {
+            const size_t length = 4 + Frame.SerialSize + 2 + Size + sizeof(ushort);
+
+            if (length > LPWAN_MAX_LENGTH)
+                return {};
+
+            const size_t prefix = length < 0x80 ? 1 : 2;
+
+            CString Packet;
+            Packet.SetLength(prefix + length);
+
+            auto p = (BYTE *) Packet.Data();
+
+            if (prefix == 1) {
+                *p++ = (BYTE) length;
+            } else {
+                *p++ = (BYTE) (0x80 | (length >> 8));
+                *p++ = (BYTE) (length & 0xFF);
+            }
+
+            *p++ = Frame.Version;
+            *p++ = Frame.Parameters;
+            *p++ = Frame.DeviceType;
+            *p++ = Frame.SerialSize;
+
+            ::memcpy(p, Frame.Serial, Frame.SerialSize);
+            p += Frame.SerialSize;
+
+            *p++ = Frame.Command;
+            *p++ = Frame.Packet;
+
+            if (Size > 0)
+                ::memcpy(p, Data, Size);
+            p += Size;
+
+            const ushort crc = CRC16(Packet.Data(), prefix + length - sizeof(ushort));
+
+            *p++ = (BYTE) (crc & 0xFF);
+            *p = (BYTE) (crc >> 8);
+
+            return Packet;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        // The acknowledgement of a command from a device: a single reply packet to the device with the same command
+        // and packet numbers, holding the command type and a zero error code.
+        inline CString Acknowledge(const CFrame &Frame, BYTE Type) {
+            CFrame Header(Frame);
+
+            Header.Parameters = LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET | LPWAN_TO_DEVICE | LPWAN_REPLY;
+
+            const BYTE Data[] = {Type, 0};
+
+            return Encode(Header, Data, sizeof(Data));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCommand --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Command from a device: timestamp, command type, error code and command data (absent on error).
+        struct CCommand {
+            uint32_t Time = 0;
+            BYTE Type = 0;
+            BYTE Error = 0;
+
+            const BYTE *Data = nullptr;
+            size_t Size = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline bool ParseCommand(const BYTE *Data, size_t Size, CCommand &Command) {
+            if (Size < 6)
+                return false;
+
+            Command.Time = GetUInt32(Data);
+            Command.Type = Data[4];
+            Command.Error = Data[5];
+            Command.Data = Data + 6;
+            Command.Size = Size - 6;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeviceState ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Command 0x01: current device state.
+        struct CDeviceState {
+            uint16_t State = 0;
+            BYTE Tariff = 0;
+            uint32_t ConfigTime = 0;
+            BYTE SyncType = 0;
+            uint32_t SyncTime = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline bool ParseState(const CCommand &Command, CDeviceState &State) {
+            if (Command.Type != LPWAN_COMMAND_STATE || Command.Error != 0 || Command.Size < 12)
+                return false;
+
+            const BYTE *p = Command.Data;
+
+            State.State = GetUInt16(p);
+            State.Tariff = p[2];
+            State.ConfigTime = GetUInt32(p + 3);
+            State.SyncType = p[7];
+            State.SyncTime = GetUInt32(p + 8);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CValue ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CValueType { vtBattery = 0, vtLatitude, vtLongitude, vtAltitude, vtAccuracy, vtAltitudeAccuracy, vtBearing, vtSpeed };
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Command 0x04: current device values.
+        struct CValue {
+            BYTE Type = 0;
+            BYTE Size = 0;
+            double Value = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline bool ParseValues(const CCommand &Command, std::vector<CValue> &Values) {
+            if (Command.Type != LPWAN_COMMAND_VALUES || Command.Error != 0 || Command.Size < 1)
+                return false;
+
+            const BYTE *p = Command.Data + 1;
+            const BYTE *end = Command.Data + Command.Size;
+
+            Values.clear();
+            Values.reserve(Command.Data[0]);
+
+            for (int i = 0; i < Command.Data[0]; ++i) {
+                if (end - p < 2 || end - p - 2 < p[1])
+                    return false;
+
+                CValue Value;
+
+                Value.Type = p[0];
+                Value.Size = p[1];
+
+                const BYTE *v = p + 2;
+
+                // percent and degree are uint16 (percent x 100), the rest are ieee754 by size.
+                switch (Value.Size) {
+                    case 1:
+                        Value.Value = v[0];
+                        break;
+                    case 2:
+                        Value.Value = GetUInt16(v);
+                        break;
+                    case 4:
+                        Value.Value = GetFloat(v);
+                        break;
+                    case 8:
+                        Value.Value = GetDouble(v);
+                        break;
+                    default:
+                        return false;
+                }
+
+                if (Value.Type == vtBattery && Value.Size == 2)
+                    Value.Value /= 100;
+
+                Values.push_back(Value);
+
+                p += 2 + Value.Size;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline const char *ValueName(BYTE Type) {
+            switch (Type) {
+                case vtBattery:
+                    return "battery";
+                case vtLatitude:
+                    return "latitude";
+                case vtLongitude:
+                    return "longitude";
+                case vtAltitude:
+                    return "altitude";
+                case vtAccuracy:
+                    return "accuracy";
+                case vtAltitudeAccuracy:
+                    return "altitude_accuracy";
+                case vtBearing:
+                    return "bearing";
+                case vtSpeed:
+                    return "speed";
+                default:
+                    return nullptr;
+            }
+        }
+
+    }
+}
+}
+#endif //APOSTOL_STREAM_LPWAN_HPP
@@ -0,0 +1,157 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Metrics.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Stage latency histograms and drop counters
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Metrics.hpp"
+
+#include <cmath>
+#include <fcntl.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHistogram ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CHistogram::Percentile(double Quantile) const {
+            if (m_Interval == 0)
+                return 0;
+
+            const auto rank = std::max((uint64_t) std::ceil(Quantile * (double) m_Interval), (uint64_t) 1);
+
+            uint64_t count = 0;
+            for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                count += m_Buckets[i];
+                if (count >= rank)
+                    return std::min(Highest(i), m_Max);
+            }
+
+            return m_Max;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CMetrics --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static const char *StageNames[stCount] = {"receive", "framing", "queue", "database", "send", "total"};
+        static const char *DropNames[drCount] = {"length", "crc", "header"};
+        //--------------------------------------------------------------------------------------------------------------
+
+        CMetrics::CMetrics(): m_Active(false), m_Failed(false) {
+            memset(m_Drops, 0, sizeof(m_Drops));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CMetrics::Drops(CDropReason Reason) const {
+            uint64_t count = 0;
+
+            for (const auto drops : m_Drops[Reason])
+                count += drops;
+
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Counter(CString &Text, LPCSTR Name, const CString &Labels, uint64_t Value) {
+            Text << CString().Format("# TYPE %s counter\n%s{%s} %llu\n", Name, Name, Labels.c_str(), (unsigned long long) Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Gauge(CString &Text, LPCSTR Name, const CString &Labels, uint64_t Value) {
+            Text << CString().Format("# TYPE %s gauge\n%s{%s} %llu\n", Name, Name, Labels.c_str(), (unsigned long long) Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Format(CString &Text, const CString &Labels) const {
+            static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+
+            Text << "# TYPE stream_stage_seconds summary\n";
+
+            for (int i = 0; i < stCount; ++i) {
+                const auto &Stage = m_Stages[i];
+
+                for (const auto quantile : quantiles) {
+                    const auto value = quantile < 1 ? Stage.Percentile(quantile) : Stage.Max();
+                    Text << CString().Format("stream_stage_seconds{%s,stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                                             Labels.c_str(), StageNames[i], quantile, (double) value / 1e9);
+                }
+
+                Text << CString().Format("stream_stage_seconds_sum{%s,stage=\"%s\"} %.9f\n", Labels.c_str(), StageNames[i], (double) Stage.Sum() / 1e9);
+                Text << CString().Format("stream_stage_seconds_count{%s,stage=\"%s\"} %llu\n", Labels.c_str(), StageNames[i], (unsigned long long) Stage.Count());
+            }
+
+            Text << "# TYPE stream_drops_total counter\n";
+
+            for (int i = 0; i < drCount; ++i) {
+                for (int type = 0; type < 256; ++type) {
+                    if (m_Drops[i][type] == 0)
+                        continue;
+
+                    Text << CString().Format("stream_drops_total{%s,reason=\"%s\",type=\"0x%02X\"} %llu\n",
+                                             Labels.c_str(), DropNames[i], type, (unsigned long long) m_Drops[i][type]);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Reset() {
+            for (auto &Stage : m_Stages)
+                Stage.Reset();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMetrics::Export(const CString &FileName, const CString &Text) {
+            const auto &TempName = FileName + ".tmp";
+
+            bool done = false;
+
+            const auto handle = ::open(TempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (handle != -1) {
+                done = ::write(handle, Text.Data(), Text.Size()) == (ssize_t) Text.Size();
+                ::close(handle);
+
+                done = done && ::rename(TempName.c_str(), FileName.c_str()) == 0;
+            }
+
+            // Only the first failure in a row is logged: the export is repeated every interval.
+            if (!done && !m_Failed)
+                Log()->Error(APP_LOG_ERR, errno, _T("Could not write stats file \"%s\""), FileName.c_str());
+
+            m_Failed = !done;
+
+            return done;
+        }
+
+    }
+}
+}
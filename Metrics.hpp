@@ -0,0 +1,180 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Metrics.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Stage latency histograms and drop counters
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_METRICS_HPP
+#define APOSTOL_STREAM_METRICS_HPP
+
+#include "TimerWheel.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHistogram ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Log-linear buckets (HDR style): each power of two is split into 16 buckets, so a value is known to within
+        // 1/16 of itself. Count and Sum are totals; the buckets and Max cover the interval since the last Reset().
+        class CHistogram {
+        private:
+
+            uint64_t m_Buckets[HISTOGRAM_BUCKETS];
+
+            uint64_t m_Interval;
+            uint64_t m_Max;
+
+            uint64_t m_Count;
+            uint64_t m_Sum;
+
+            static size_t Index(uint64_t Value) {
+                if (Value < 2 * HISTOGRAM_SUB_BUCKETS)
+                    return (size_t) Value;
+
+                const int shift = 63 - __builtin_clzll(Value) - HISTOGRAM_SUB_BITS;
+
+                return (size_t) (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((Value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+            }
+
+            static uint64_t Highest(size_t Index) {
+                if (Index < 2 * HISTOGRAM_SUB_BUCKETS)
+                    return Index;
+
+                const auto shift = Index / HISTOGRAM_SUB_BUCKETS - 1;
+                const auto sub = Index % HISTOGRAM_SUB_BUCKETS;
+
+                return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+            }
+
+        public:
+
+            CHistogram() {
+                m_Count = 0;
+                m_Sum = 0;
+                Reset();
+            }
+
+            void Record(uint64_t Value) {
+                m_Buckets[Index(Value)]++;
+                m_Interval++;
+                m_Count++;
+                m_Sum += Value;
+
+                if (Value > m_Max)
+                    m_Max = Value;
+            }
+
+            void Reset() {
+                memset(m_Buckets, 0, sizeof(m_Buckets));
+                m_Interval = 0;
+                m_Max = 0;
+            }
+
+            uint64_t Percentile(double Quantile) const;
+
+            uint64_t Interval() const { return m_Interval; }
+            uint64_t Max() const { return m_Max; }
+
+            uint64_t Count() const { return m_Count; }
+            uint64_t Sum() const { return m_Sum; }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CMetrics --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CStage { stReceive = 0, stFraming, stQueue, stDatabase, stSend, stTotal, stCount };
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CDropReason { drIncorrectLength = 0, drInvalidCRC, drInvalidHeader, drCount };
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Everything is written by the owning process only, so nothing is locked or atomic. Export() renders a
+        // snapshot in the Prometheus text format and replaces the file with rename(), so a reader never sees a partial
+        // file and never blocks the writer.
+        class CMetrics {
+        private:
+
+            bool m_Active;
+            bool m_Failed;
+
+            CHistogram m_Stages[stCount];
+
+            uint64_t m_Drops[drCount][256];
+
+        public:
+
+            CMetrics();
+
+            void Active(bool Value) { m_Active = Value; }
+            bool Active() const { return m_Active; }
+
+            // Start() is zero while inactive, and Stop() then records nothing: a disabled stage costs one branch.
+            uint64_t Start() const { return m_Active ? MonotonicNanoTime() : 0; }
+
+            void Stop(CStage Stage, uint64_t Start) {
+                if (Start != 0)
+                    m_Stages[Stage].Record(MonotonicNanoTime() - Start);
+            }
+
+            void Record(CStage Stage, uint64_t Value) {
+                m_Stages[Stage].Record(Value);
+            }
+
+            void Drop(CDropReason Reason, BYTE DeviceType) {
+                m_Drops[Reason][DeviceType]++;
+            }
+
+            uint64_t Drops(CDropReason Reason) const;
+
+            const CHistogram &Stage(CStage Stage) const { return m_Stages[Stage]; }
+
+            void Format(CString &Text, const CString &Labels) const;
+            void Reset();
+
+            bool Export(const CString &FileName, const CString &Text);
+
+            static void Counter(CString &Text, LPCSTR Name, const CString &Labels, uint64_t Value);
+            static void Gauge(CString &Text, LPCSTR Name, const CString &Labels, uint64_t Value);
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_METRICS_HPP
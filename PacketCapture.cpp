@@ -0,0 +1,239 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  PacketCapture.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Packet capture ring (pcap)
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "PacketCapture.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PCAP_MAGIC_NSEC 0xA1B23C4D
+#define PCAP_LINKTYPE_IPV4 228
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPacketCapture --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CPCAPHeader {
+            uint32_t Magic;
+            uint16_t VersionMajor;
+            uint16_t VersionMinor;
+            int32_t ThisZone;
+            uint32_t SigFigs;
+            uint32_t SnapLength;
+            uint32_t LinkType;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CPCAPRecord {
+            uint32_t Seconds;
+            uint32_t Nanoseconds;
+            uint32_t CapturedLength;
+            uint32_t Length;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        static ushort IPChecksum(const void *Data, size_t Size) {
+            auto p = static_cast<const uint16_t *>(Data);
+            uint32_t sum = 0;
+
+            for (; Size > 1; Size -= 2)
+                sum += *p++;
+
+            while (sum >> 16)
+                sum = (sum & 0xFFFF) + (sum >> 16);
+
+            return (ushort) ~sum;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPacketCapture::CPacketCapture(): m_Handle(-1), m_Size(0), m_pMap(nullptr), m_MapSize(0), m_SnapLength(0),
+                m_RecordSize(0), m_Records(0), m_Index(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPacketCapture::~CPacketCapture() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPacketCapture::Opened(const CString &FileName, size_t Size, size_t SnapLength) const {
+            if (m_pMap == nullptr || FileName != m_FileName || Size != m_Size || SnapLength != m_SnapLength)
+                return false;
+
+            struct stat path {};
+            struct stat file {};
+
+            // The file may have been removed or replaced since it was mapped.
+            if (::stat(FileName.c_str(), &path) == -1 || ::fstat(m_Handle, &file) == -1)
+                return false;
+
+            return path.st_dev == file.st_dev && path.st_ino == file.st_ino;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPacketCapture::Open(const CString &FileName, size_t Size, size_t SnapLength) {
+            // Reopening the same ring (on log rotation, say) keeps the packets it holds.
+            if (Opened(FileName, Size, SnapLength))
+                return;
+
+            Close();
+
+            m_SnapLength = SnapLength;
+            m_RecordSize = sizeof(CPCAPRecord) + sizeof(iphdr) + sizeof(udphdr) + m_SnapLength;
+            m_Records = (Size - sizeof(CPCAPHeader)) / m_RecordSize;
+
+            if (Size <= sizeof(CPCAPHeader) || m_Records == 0)
+                throw ExceptionFrm("Packet capture size is too small: %d", (int) Size);
+
+            m_MapSize = sizeof(CPCAPHeader) + m_Records * m_RecordSize;
+
+            m_Handle = ::open(FileName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+            if (m_Handle == -1)
+                throw ExceptionFrm("Could not open packet capture file \"%s\": %s", FileName.c_str(), strerror(errno));
+
+            if (::ftruncate(m_Handle, (off_t) m_MapSize) == -1) {
+                const auto error = errno;
+                Close();
+                throw ExceptionFrm("ftruncate(\"%s\") failed: %s", FileName.c_str(), strerror(error));
+            }
+
+            auto pMap = ::mmap(nullptr, m_MapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_Handle, 0);
+            if (pMap == MAP_FAILED) {
+                const auto error = errno;
+                Close();
+                throw ExceptionFrm("mmap(\"%s\") failed: %s", FileName.c_str(), strerror(error));
+            }
+
+            m_pMap = static_cast<BYTE *>(pMap);
+            m_Index = 0;
+
+            m_FileName = FileName;
+            m_Size = Size;
+
+            auto pHeader = reinterpret_cast<CPCAPHeader *>(m_pMap);
+
+            pHeader->Magic = PCAP_MAGIC_NSEC;
+            pHeader->VersionMajor = 2;
+            pHeader->VersionMinor = 4;
+            pHeader->ThisZone = 0;
+            pHeader->SigFigs = 0;
+            pHeader->SnapLength = (uint32_t) (m_RecordSize - sizeof(CPCAPRecord));
+            pHeader->LinkType = PCAP_LINKTYPE_IPV4;
+
+            Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPacketCapture::Clear() {
+            // Fill the ring with empty UDP packets (0.0.0.0:0 -> 0.0.0.0:0 at the epoch), so the file is valid as is.
+            const sockaddr_in none {};
+
+            for (size_t i = 0; i < m_Records; ++i) {
+                Write(none, none, nullptr, 0);
+
+                auto pRecord = reinterpret_cast<CPCAPRecord *>(m_pMap + sizeof(CPCAPHeader) + i * m_RecordSize);
+
+                pRecord->Seconds = 0;
+                pRecord->Nanoseconds = 0;
+            }
+
+            m_Index = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPacketCapture::Close() {
+            if (m_pMap != nullptr) {
+                ::munmap(m_pMap, m_MapSize);
+                m_pMap = nullptr;
+            }
+
+            if (m_Handle != -1) {
+                ::close(m_Handle);
+                m_Handle = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPacketCapture::Write(const sockaddr_in &Source, const sockaddr_in &Destination, const void *Data, size_t Size) {
+            if (m_pMap == nullptr)
+                return;
+
+            timespec now {};
+            clock_gettime(CLOCK_REALTIME, &now);
+
+            BYTE *p = m_pMap + sizeof(CPCAPHeader) + (m_Index++ % m_Records) * m_RecordSize;
+
+            const size_t captured = Size < m_SnapLength ? Size : m_SnapLength;
+            const size_t length = sizeof(iphdr) + sizeof(udphdr) + Size;
+
+            auto pRecord = reinterpret_cast<CPCAPRecord *>(p);
+            auto pIP = reinterpret_cast<iphdr *>(p + sizeof(CPCAPRecord));
+            auto pUDP = reinterpret_cast<udphdr *>(p + sizeof(CPCAPRecord) + sizeof(iphdr));
+            auto pData = p + sizeof(CPCAPRecord) + sizeof(iphdr) + sizeof(udphdr);
+
+            // Records have a fixed size: the bytes after the IP packet are padding.
+            pRecord->Seconds = (uint32_t) now.tv_sec;
+            pRecord->Nanoseconds = (uint32_t) now.tv_nsec;
+            pRecord->CapturedLength = (uint32_t) (m_RecordSize - sizeof(CPCAPRecord));
+            pRecord->Length = (uint32_t) (length > pRecord->CapturedLength ? length : pRecord->CapturedLength);
+
+            *pIP = {};
+            pIP->version = 4;
+            pIP->ihl = sizeof(iphdr) / 4;
+            pIP->tot_len = htons((uint16_t) length);
+            pIP->ttl = 64;
+            pIP->protocol = IPPROTO_UDP;
+            pIP->saddr = Source.sin_addr.s_addr;
+            pIP->daddr = Destination.sin_addr.s_addr;
+            pIP->check = IPChecksum(pIP, sizeof(iphdr));
+
+            pUDP->source = Source.sin_port;
+            pUDP->dest = Destination.sin_port;
+            pUDP->len = htons((uint16_t) (sizeof(udphdr) + Size));
+            pUDP->check = 0;
+
+            if (captured > 0)
+                ::memcpy(pData, Data, captured);
+
+            ::memset(pData + captured, 0, m_SnapLength - captured);
+        }
+
+    }
+}
+}
@@ -0,0 +1,90 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  PacketCapture.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Packet capture ring (pcap)
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_PACKET_CAPTURE_HPP
+#define APOSTOL_STREAM_PACKET_CAPTURE_HPP
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPacketCapture --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // A memory-mapped pcap file (LINKTYPE_IPV4) split into fixed-size records that are overwritten in a ring.
+        // Every record is a complete IPv4/UDP packet, so the file can be opened by pcap tools at any time.
+        class CPacketCapture {
+        private:
+
+            int m_Handle;
+
+            CString m_FileName;
+            size_t m_Size;
+
+            BYTE *m_pMap;
+            size_t m_MapSize;
+
+            size_t m_SnapLength;
+            size_t m_RecordSize;
+            size_t m_Records;
+
+            uint64_t m_Index;
+
+            void Clear();
+
+            bool Opened(const CString &FileName, size_t Size, size_t SnapLength) const;
+
+        public:
+
+            CPacketCapture();
+
+            ~CPacketCapture();
+
+            CPacketCapture(const CPacketCapture &) = delete;
+            CPacketCapture &operator=(const CPacketCapture &) = delete;
+
+            void Open(const CString &FileName, size_t Size, size_t SnapLength);
+            void Close();
+
+            void Write(const sockaddr_in &Source, const sockaddr_in &Destination, const void *Data, size_t Size);
+
+            bool Active() const { return m_pMap != nullptr; }
+
+            uint64_t Count() const { return m_Index; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_PACKET_CAPTURE_HPP
@@ -0,0 +1,148 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  RateLimit.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Token bucket rate limiter
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "RateLimit.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CRateLimiter ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static uint64_t Mix(uint64_t Value) {
+            Value ^= Value >> 33;
+            Value *= 0xFF51AFD7ED558CCDULL;
+            Value ^= Value >> 33;
+            Value *= 0xC4CEB9FE1A85EC53ULL;
+            Value ^= Value >> 33;
+            return Value ? Value : 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CRateLimiter::CRateLimiter(): m_Mask(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CRateLimiter::Configure(size_t Size) {
+            size_t sets = 1;
+            while (sets * RATE_LIMIT_WAYS < Size)
+                sets <<= 1;
+
+            if (m_Buckets.size() == sets * RATE_LIMIT_WAYS)
+                return;
+
+            m_Buckets.assign(sets * RATE_LIMIT_WAYS, CBucket());
+            m_Mask = sets - 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CRateLimiter::Clear() {
+            m_Buckets.clear();
+            m_Mask = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CRateLimiter::Key(const sockaddr_in &Address) {
+            // The address only: a flood from one host must not get a bucket per source port.
+            return Mix(((uint64_t) 1 << 32) | Address.sin_addr.s_addr);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CRateLimiter::Key(BYTE DeviceType, const char *Serial, size_t SerialSize) {
+            uint64_t hash = FNV_OFFSET;
+
+            hash = (hash ^ DeviceType) * FNV_PRIME;
+            for (size_t i = 0; i < SerialSize; ++i)
+                hash = (hash ^ (BYTE) Serial[i]) * FNV_PRIME;
+
+            return Mix(hash);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CRateLimiter::Take(uint64_t Key, double Rate, double Burst, uint64_t Now) {
+            auto pSet = &m_Buckets[(Key & m_Mask) * RATE_LIMIT_WAYS];
+            CBucket *pVictim = pSet;
+
+            for (int i = 0; i < RATE_LIMIT_WAYS; ++i) {
+                auto &Bucket = pSet[i];
+
+                if (Bucket.Key == Key) {
+                    Bucket.Tokens = std::min(Burst, Bucket.Tokens + Rate * (double) (Now - Bucket.Time) / 1000);
+                    Bucket.Time = Now;
+
+                    if (Bucket.Tokens < 1)
+                        return false;
+
+                    Bucket.Tokens -= 1;
+                    return true;
+                }
+
+                if (pVictim->Key != 0 && (Bucket.Key == 0 || Bucket.Time < pVictim->Time))
+                    pVictim = &Bucket;
+            }
+
+            if (pVictim->Key != 0)
+                m_Counters.Evicted++;
+
+            pVictim->Key = Key;
+            pVictim->Time = Now;
+            pVictim->Tokens = Burst - 1;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CRateLimiter::Peer(uint64_t Key, double Rate, double Burst, uint64_t Now) {
+            if (Take(Key, Rate, Burst, Now))
+                return true;
+
+            m_Counters.Peers++;
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CRateLimiter::Device(uint64_t Key, BYTE DeviceType, double Rate, double Burst, uint64_t Now) {
+            if (Take(Key, Rate, Burst, Now))
+                return true;
+
+            m_Counters.Devices[DeviceType]++;
+            return false;
+        }
+
+    }
+}
+}
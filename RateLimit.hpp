@@ -0,0 +1,106 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  RateLimit.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Token bucket rate limiter
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_RATE_LIMIT_HPP
+#define APOSTOL_STREAM_RATE_LIMIT_HPP
+
+#include <vector>
+
+#include <netinet/in.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define RATE_LIMIT_WAYS 4
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CRateCounters ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CRateCounters {
+            uint64_t Peers = 0;             // Datagrams throttled by source address
+            uint64_t Devices[256] {};       // Packets throttled by device, per device type
+            uint64_t Evicted = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CRateLimiter ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Token buckets in a fixed table of 4-way sets: a key lives in the set its hash selects, and a new key takes
+        // the place of the least recently used bucket of the set. A bucket holds up to Burst tokens and gains Rate
+        // tokens per second; every packet takes one.
+        class CRateLimiter {
+        private:
+
+            struct CBucket {
+                uint64_t Key = 0;           // 0 - free
+                uint64_t Time = 0;
+                double Tokens = 0;
+            };
+
+            std::vector<CBucket> m_Buckets;
+            size_t m_Mask;
+
+            CRateCounters m_Counters;
+
+            bool Take(uint64_t Key, double Rate, double Burst, uint64_t Now);
+
+        public:
+
+            CRateLimiter();
+
+            void Configure(size_t Size);
+            void Clear();
+
+            static uint64_t Key(const sockaddr_in &Address);
+            static uint64_t Key(BYTE DeviceType, const char *Serial, size_t SerialSize);
+
+            // Any frame with a device type and a serial number.
+            template <class TFrame>
+            static uint64_t Key(const TFrame &Frame) { return Key(Frame.DeviceType, Frame.Serial, Frame.SerialSize); }
+
+            bool Peer(uint64_t Key, double Rate, double Burst, uint64_t Now);
+            bool Device(uint64_t Key, BYTE DeviceType, double Rate, double Burst, uint64_t Now);
+
+            bool Active() const { return !m_Buckets.empty(); }
+
+            const CRateCounters &Counters() const { return m_Counters; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_RATE_LIMIT_HPP
@@ -0,0 +1,226 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Reassembly.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Multi-packet command reassembly
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Reassembly.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCommandAssembler -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CCommandAssembler::CCommandAssembler(): m_MaxCommands(4096), m_MaxMemory(16 * 1024 * 1024), m_Memory(0),
+                m_Timeout(10000), m_NextId(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCommandAssembler::Configure(size_t MaxCommands, size_t MaxMemory, uint32_t Timeout) {
+            m_MaxCommands = MaxCommands ? MaxCommands : 1;
+            m_MaxMemory = MaxMemory;
+            m_Timeout = Timeout;
+
+            m_Entries.reserve(m_MaxCommands);
+
+            Evict(0);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCommandAssembler::Drop(const std::string &Key) const {
+            if (m_OnDrop && !Key.empty())
+                m_OnDrop(Key);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCommandAssembler::Delete(std::unordered_map<std::string, CEntry>::iterator It, bool Dropped) {
+            if (Dropped) {
+                for (const auto &key : It->second.Keys)
+                    Drop(key);
+            }
+
+            m_Memory -= It->second.Size;
+            m_Order.erase(It->second.Position);
+            m_Entries.erase(It);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCommandAssembler::Evict(size_t Size) {
+            // The oldest commands go first: they are the closest to their timeout anyway.
+            while (!m_Order.empty() && (m_Entries.size() > m_MaxCommands || m_Memory + Size > m_MaxMemory)) {
+                Delete(m_Entries.find(m_Order.front()));
+                m_Counters.Evicted++;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CCommandAssembler::Add(const LPWAN::CFrame &Frame, const std::string &Key, CString &Packet, std::vector<std::string> &Keys) {
+            std::string key;
+
+            key.reserve(2 + Frame.SerialSize);
+            key.push_back((char) Frame.DeviceType);
+            key.push_back((char) Frame.Command);
+            key.append(Frame.Serial, Frame.SerialSize);
+
+            m_Counters.Packets++;
+
+            auto it = m_Entries.find(key);
+
+            if (it == m_Entries.end()) {
+                if (m_Entries.size() >= m_MaxCommands) {
+                    Delete(m_Entries.find(m_Order.front()));
+                    m_Counters.Evicted++;
+                }
+
+                it = m_Entries.emplace(key, CEntry()).first;
+
+                auto &entry = it->second;
+
+                entry.Id = ++m_NextId;
+                entry.Version = Frame.Version;
+                entry.DeviceType = Frame.DeviceType;
+                entry.Command = Frame.Command;
+                entry.Serial = key.substr(2);
+                entry.Position = m_Order.insert(m_Order.end(), key);
+
+                m_Wheel.Schedule(MonotonicTime() + m_Timeout, CTimer(entry.Id, key));
+            }
+
+            auto &entry = it->second;
+
+            if (entry.Received[Frame.Packet] || (entry.Last >= 0 && Frame.Packet > entry.Last)) {
+                Drop(Key);
+                return false;
+            }
+
+            if (entry.Size + Frame.PayloadSize > LPWAN_MAX_LENGTH) {
+                Delete(it);
+                Drop(Key);
+                m_Counters.Evicted++;
+                return false;
+            }
+
+            if (m_Memory + Frame.PayloadSize > m_MaxMemory) {
+                const auto id = entry.Id;
+
+                Evict(Frame.PayloadSize);
+
+                it = m_Entries.find(key);
+                if (it == m_Entries.end() || it->second.Id != id) {
+                    Drop(Key);
+                    return false;
+                }
+            }
+
+            if ((Frame.Parameters & LPWAN_FIRST_PACKET) == LPWAN_FIRST_PACKET)
+                entry.Parameters = Frame.Parameters;
+
+            if ((Frame.Parameters & LPWAN_LAST_PACKET) == LPWAN_LAST_PACKET)
+                entry.Last = Frame.Packet;
+
+            if (entry.Packets.size() <= Frame.Packet)
+                entry.Packets.resize(Frame.Packet + 1);
+
+            entry.Packets[Frame.Packet].assign((const char *) Frame.Payload, Frame.PayloadSize);
+            entry.Received.set(Frame.Packet);
+            entry.Count++;
+
+            if (!Key.empty())
+                entry.Keys.push_back(Key);
+            entry.Size += Frame.PayloadSize;
+
+            m_Memory += Frame.PayloadSize;
+
+            // Packets are combined from the initial to the final one in packet number order.
+            if (entry.Last < 0 || entry.Count != entry.Last + 1 || (entry.Parameters & LPWAN_FIRST_PACKET) == 0)
+                return false;
+
+            std::string data;
+
+            data.reserve(entry.Size);
+            for (int i = 0; i <= entry.Last; ++i)
+                data.append(entry.Packets[i]);
+
+            LPWAN::CFrame Header;
+
+            Header.Version = entry.Version;
+            Header.Parameters = entry.Parameters | LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET;
+            Header.DeviceType = entry.DeviceType;
+            Header.SerialSize = (BYTE) entry.Serial.size();
+            Header.Serial = entry.Serial.data();
+            Header.Command = entry.Command;
+            Header.Packet = 0;
+
+            Packet = LPWAN::Encode(Header, data.data(), data.size());
+
+            if (Packet.IsEmpty()) {
+                Delete(it);
+                m_Counters.Evicted++;
+                return false;
+            }
+
+            Keys.swap(entry.Keys);
+
+            Delete(it, false);
+
+            m_Counters.Completed++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCommandAssembler::Expire(uint64_t Now) {
+            m_Wheel.Advance(Now, [this](const CTimer &Timer) {
+                const auto it = m_Entries.find(Timer.second);
+
+                if (it != m_Entries.end() && it->second.Id == Timer.first) {
+                    Delete(it);
+                    m_Counters.Expired++;
+                }
+            });
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CCommandAssembler::Clear() {
+            for (const auto &entry : m_Entries) {
+                for (const auto &key : entry.second.Keys)
+                    Drop(key);
+            }
+
+            m_Entries.clear();
+            m_Order.clear();
+            m_Memory = 0;
+        }
+
+    }
+}
+}
@@ -0,0 +1,144 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Reassembly.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Multi-packet command reassembly
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_REASSEMBLY_HPP
+#define APOSTOL_STREAM_REASSEMBLY_HPP
+
+#include <bitset>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+#include "LPWAN.hpp"
+#include "TimerWheel.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CAssemblerCounters ----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CAssemblerCounters {
+            uint64_t Packets = 0;
+            uint64_t Completed = 0;
+            uint64_t Expired = 0;
+            uint64_t Evicted = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CCommandAssembler -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Collects the packets of a command, keyed by (device type, serial number, command number), until the initial
+        // packet, the final packet and every packet between them have arrived.
+        class CCommandAssembler {
+        public:
+
+            typedef std::function<void (const std::string &Key)> COnDrop;
+
+        private:
+
+            struct CEntry {
+                uint64_t Id = 0;
+
+                BYTE Version = 0;
+                BYTE Parameters = 0;
+                BYTE DeviceType = 0;
+                BYTE Command = 0;
+
+                std::string Serial;
+
+                int Last = -1;
+                int Count = 0;
+                size_t Size = 0;
+
+                std::bitset<256> Received;
+                std::vector<std::string> Packets;
+                std::vector<std::string> Keys;
+
+                std::list<std::string>::iterator Position;
+            };
+
+            typedef std::pair<uint64_t, std::string> CTimer;
+
+            std::unordered_map<std::string, CEntry> m_Entries;
+            std::list<std::string> m_Order;
+
+            CTimerWheel<CTimer> m_Wheel;
+
+            size_t m_MaxCommands;
+            size_t m_MaxMemory;
+            size_t m_Memory;
+
+            uint32_t m_Timeout;
+            uint64_t m_NextId;
+
+            CAssemblerCounters m_Counters;
+
+            COnDrop m_OnDrop;
+
+            void Drop(const std::string &Key) const;
+
+            void Delete(std::unordered_map<std::string, CEntry>::iterator It, bool Dropped = true);
+            void Evict(size_t Size);
+
+        public:
+
+            CCommandAssembler();
+
+            void Configure(size_t MaxCommands, size_t MaxMemory, uint32_t Timeout);
+
+            // Returns true and a single packet holding the whole command in Packet when Frame completes a command, with
+            // the duplicate keys of the other packets of the command in Keys. The key of every packet that does not
+            // make it into a command - rejected, expired or evicted - goes to the OnDrop handler.
+            bool Add(const LPWAN::CFrame &Frame, const std::string &Key, CString &Packet, std::vector<std::string> &Keys);
+
+            void Expire(uint64_t Now);
+
+            void Clear();
+
+            void OnDrop(COnDrop Handler) { m_OnDrop = std::move(Handler); }
+
+            size_t Count() const { return m_Entries.size(); }
+            size_t Memory() const { return m_Memory; }
+
+            const CAssemblerCounters &Counters() const { return m_Counters; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_REASSEMBLY_HPP
@@ -0,0 +1,88 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Shards.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Consistent hashing of devices to database shards
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Shards.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CShardRing ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CShardRing::Build(const std::vector<CString> &Names) {
+            m_Points.clear();
+            m_Points.reserve(Names.size() * SHARD_POINTS);
+
+            for (size_t index = 0; index < Names.size(); ++index) {
+                const auto &Name = Names[index];
+
+                CString Point;
+
+                for (int i = 0; i < SHARD_POINTS; ++i) {
+                    Point.Format("%s#%d", Name.c_str(), i);
+                    m_Points.emplace_back(Hash(Point.Data(), Point.Size()), index);
+                }
+            }
+
+            std::sort(m_Points.begin(), m_Points.end());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CShardRing::Hash(const void *Data, size_t Size) {
+            auto p = (const BYTE *) Data;
+            uint64_t hash = 0xcbf29ce484222325ULL;
+
+            for (size_t i = 0; i < Size; ++i) {
+                hash ^= p[i];
+                hash *= 0x100000001b3ULL;
+            }
+
+            // FNV-1a alone leaves similar serial numbers close together on the ring.
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ULL;
+            hash ^= hash >> 33;
+
+            return hash;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CShardRing::First(uint64_t Hash) const {
+            const auto it = std::lower_bound(m_Points.begin(), m_Points.end(), std::make_pair(Hash, (size_t) 0));
+            return it == m_Points.end() ? 0 : (size_t) (it - m_Points.begin());
+        }
+
+    }
+}
+}
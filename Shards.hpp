@@ -0,0 +1,94 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Shards.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Consistent hashing of devices to database shards
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_SHARDS_HPP
+#define APOSTOL_STREAM_SHARDS_HPP
+
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define SHARD_POINTS 128
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CShardRing ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // A hash ring with SHARD_POINTS points per shard, placed by the shard name: adding or removing a shard moves
+        // only the devices between its points and the previous ones, and the order is the same in every process.
+        class CShardRing {
+        private:
+
+            std::vector<std::pair<uint64_t, size_t>> m_Points;
+
+            size_t First(uint64_t Hash) const;
+
+        public:
+
+            CShardRing() = default;
+
+            void Build(const std::vector<CString> &Names);
+
+            // FNV-1a with a final mix, stable across processes and builds.
+            static uint64_t Hash(const void *Data, size_t Size);
+
+            static uint64_t Hash(const std::string &Key) { return Hash(Key.data(), Key.size()); }
+
+            // The shard that owns the key.
+            size_t Primary(uint64_t Hash) const { return m_Points[First(Hash)].second; }
+
+            // The first shard clockwise from the key for which Usable() is true, or -1.
+            template <class TUsable>
+            int Find(uint64_t Hash, TUsable &&Usable) const {
+                const auto first = First(Hash);
+
+                for (size_t i = 0; i < m_Points.size(); ++i) {
+                    const auto index = m_Points[(first + i) % m_Points.size()].second;
+
+                    if (Usable(index))
+                        return (int) index;
+                }
+
+                return -1;
+            }
+
+            bool Empty() const { return m_Points.empty(); }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_SHARDS_HPP
@@ -0,0 +1,361 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Spool.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Durable packet spool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Spool.hpp"
+#include "LPWAN.hpp"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define SPOOL_SEGMENT_MAGIC 0x4C4F4F53
+#define SPOOL_RECORD_MAGIC 0x44524352
+#define SPOOL_VERSION 1
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSpool ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CSpoolHeader {
+            uint32_t Magic;
+            uint32_t Version;
+            uint64_t Read;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CSpoolRecord {
+            uint32_t Magic;
+            uint32_t Size;
+            uint64_t Time;
+            uint16_t CRC;
+            uint16_t Reserved;
+            uint32_t Padding;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        static size_t RecordSize(size_t Size) {
+            return (sizeof(CSpoolRecord) + Size + 7) & ~(size_t) 7;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static uint16_t RecordCRC(const CSpoolRecord *Record, const void *Data) {
+            auto crc = LPWAN::CCRC16<LPWAN_CRC16_SLICE>::Calculate(&Record->Size, sizeof(Record->Size) + sizeof(Record->Time));
+            return LPWAN::CCRC16<LPWAN_CRC16_SLICE>::Calculate(Data, Record->Size, crc);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSpool::CSpool(): m_SegmentSize(0), m_MaxSegments(0), m_Sequence(0), m_Count(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSpool::~CSpool() {
+            Close();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CSpool::SegmentName(uint64_t Sequence) const {
+            CString Name;
+            Name.Format("%s/%s-%012llu.spool", m_Directory.c_str(), m_Prefix.c_str(), (unsigned long long) Sequence);
+            return Name;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CSpool::Map(CSegment &Segment, bool Create) {
+            Segment.Handle = ::open(Segment.FileName.c_str(), O_RDWR | O_CLOEXEC | (Create ? O_CREAT | O_EXCL : 0), 0640);
+            if (Segment.Handle == -1) {
+                Log()->Error(APP_LOG_ERR, errno, _T("Could not open spool segment \"%s\""), Segment.FileName.c_str());
+                return false;
+            }
+
+            struct stat st {};
+            if (Create) {
+                if (::ftruncate(Segment.Handle, (off_t) m_SegmentSize) == -1) {
+                    Log()->Error(APP_LOG_ERR, errno, _T("ftruncate(\"%s\") failed"), Segment.FileName.c_str());
+                    Unmap(Segment);
+                    ::unlink(Segment.FileName.c_str());
+                    return false;
+                }
+            } else if (::fstat(Segment.Handle, &st) == -1 || (size_t) st.st_size != m_SegmentSize) {
+                Log()->Error(APP_LOG_ERR, 0, _T("Spool segment \"%s\" has unexpected size, skipped"), Segment.FileName.c_str());
+                Unmap(Segment);
+                return false;
+            }
+
+            auto pMap = ::mmap(nullptr, m_SegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, Segment.Handle, 0);
+            if (pMap == MAP_FAILED) {
+                Log()->Error(APP_LOG_ERR, errno, _T("mmap(\"%s\") failed"), Segment.FileName.c_str());
+                Unmap(Segment);
+                return false;
+            }
+
+            Segment.Map = static_cast<BYTE *>(pMap);
+
+            auto pHeader = reinterpret_cast<CSpoolHeader *>(Segment.Map);
+
+            if (Create) {
+                pHeader->Version = SPOOL_VERSION;
+                pHeader->Read = sizeof(CSpoolHeader);
+                pHeader->Magic = SPOOL_SEGMENT_MAGIC;
+            } else if (pHeader->Magic != SPOOL_SEGMENT_MAGIC || pHeader->Version != SPOOL_VERSION ||
+                    pHeader->Read < sizeof(CSpoolHeader) || pHeader->Read > m_SegmentSize) {
+                Log()->Error(APP_LOG_ERR, 0, _T("Spool segment \"%s\" is damaged, skipped"), Segment.FileName.c_str());
+                Unmap(Segment);
+                return false;
+            }
+
+            Segment.Read = pHeader->Read;
+            Segment.Write = Segment.Read;
+
+            Segment.Synced = Segment.Read;
+            Segment.ReadSynced = Segment.Read;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSpool::Unmap(CSegment &Segment) {
+            if (Segment.Map != nullptr) {
+                ::munmap(Segment.Map, m_SegmentSize);
+                Segment.Map = nullptr;
+            }
+
+            if (Segment.Handle != -1) {
+                ::close(Segment.Handle);
+                Segment.Handle = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSpool::Scan(CSegment &Segment) {
+            // Walk the records from the read position; the first invalid one (torn by a crash) is the end.
+            while (Segment.Write + sizeof(CSpoolRecord) <= m_SegmentSize) {
+                auto pRecord = reinterpret_cast<const CSpoolRecord *>(Segment.Map + Segment.Write);
+
+                if (pRecord->Magic != SPOOL_RECORD_MAGIC || Segment.Write + RecordSize(pRecord->Size) > m_SegmentSize)
+                    break;
+
+                if (pRecord->CRC != RecordCRC(pRecord, pRecord + 1))
+                    break;
+
+                Segment.Write += RecordSize(pRecord->Size);
+                m_Count++;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSpool::Open(const CString &Directory, const CString &Prefix, size_t SegmentSize, size_t MaxSize) {
+            Close();
+
+            if (SegmentSize < sizeof(CSpoolHeader) + RecordSize(LPWAN_MAX_LENGTH))
+                throw ExceptionFrm("Spool segment size is too small: %d", (int) SegmentSize);
+
+            if (::mkdir(Directory.c_str(), 0750) == -1 && errno != EEXIST)
+                throw ExceptionFrm("Could not create spool directory \"%s\": %s", Directory.c_str(), strerror(errno));
+
+            auto pDir = ::opendir(Directory.c_str());
+            if (pDir == nullptr)
+                throw ExceptionFrm("Could not open spool directory \"%s\": %s", Directory.c_str(), strerror(errno));
+
+            m_Directory = Directory;
+            m_Prefix = Prefix;
+            m_SegmentSize = SegmentSize;
+            m_MaxSegments = std::max(MaxSize / SegmentSize, (size_t) 2);
+
+            std::vector<uint64_t> sequences;
+
+            const auto prefix = std::string(m_Prefix.c_str()) + "-";
+
+            dirent *pEntry;
+            while ((pEntry = ::readdir(pDir)) != nullptr) {
+                unsigned long long sequence;
+                char suffix[8];
+
+                if (strncmp(pEntry->d_name, prefix.c_str(), prefix.size()) != 0)
+                    continue;
+
+                if (sscanf(pEntry->d_name + prefix.size(), "%llu.%7s", &sequence, suffix) == 2 && strcmp(suffix, "spool") == 0)
+                    sequences.push_back(sequence);
+            }
+
+            ::closedir(pDir);
+
+            std::sort(sequences.begin(), sequences.end());
+
+            for (auto sequence : sequences) {
+                m_Sequence = sequence + 1;
+
+                CSegment segment;
+
+                segment.Sequence = sequence;
+                segment.FileName = SegmentName(sequence);
+
+                if (!Map(segment, false))
+                    continue;
+
+                Scan(segment);
+
+                if (segment.Read == segment.Write) {
+                    Unmap(segment);
+                    ::unlink(segment.FileName.c_str());
+                    continue;
+                }
+
+                m_Segments.push_back(segment);
+            }
+
+            if (m_Count != 0)
+                Log()->Notice(_T("[%s] Spool: %llu packets in %d segments to replay"), m_Prefix.c_str(),
+                              (unsigned long long) m_Count, (int) m_Segments.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSpool::Close() {
+            Sync();
+
+            for (auto &segment : m_Segments)
+                Unmap(segment);
+
+            m_Segments.clear();
+            m_Directory.Clear();
+            m_Count = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CSpool::Append() {
+            if (m_Segments.size() >= m_MaxSegments)
+                return false;
+
+            CSegment segment;
+
+            segment.Sequence = m_Sequence++;
+            segment.FileName = SegmentName(segment.Sequence);
+
+            if (!Map(segment, true))
+                return false;
+
+            m_Segments.push_back(segment);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CSpool::Write(const void *Data, size_t Size, uint64_t Time) {
+            const auto size = RecordSize(Size);
+
+            if (sizeof(CSpoolHeader) + size > m_SegmentSize)
+                return false;
+
+            if (m_Segments.empty() || m_Segments.back().Write + size > m_SegmentSize) {
+                if (!Append())
+                    return false;
+            }
+
+            auto &segment = m_Segments.back();
+            auto pRecord = reinterpret_cast<CSpoolRecord *>(segment.Map + segment.Write);
+
+            ::memcpy(pRecord + 1, Data, Size);
+
+            pRecord->Size = (uint32_t) Size;
+            pRecord->Time = Time;
+            pRecord->CRC = RecordCRC(pRecord, Data);
+
+            // The magic goes last: a record interrupted before this store is never seen as valid.
+            __atomic_store_n(&pRecord->Magic, SPOOL_RECORD_MAGIC, __ATOMIC_RELEASE);
+
+            segment.Write += size;
+            m_Count++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CSpool::Read(CString &Data, uint64_t &Time) {
+            if (m_Segments.empty())
+                return false;
+
+            auto &segment = m_Segments.front();
+            const auto result = segment.Read < segment.Write;
+
+            if (result) {
+                auto pRecord = reinterpret_cast<const CSpoolRecord *>(segment.Map + segment.Read);
+
+                Data.SetLength(pRecord->Size);
+                ::memcpy(Data.Data(), pRecord + 1, pRecord->Size);
+                Time = pRecord->Time;
+
+                segment.Read += RecordSize(pRecord->Size);
+                reinterpret_cast<CSpoolHeader *>(segment.Map)->Read = segment.Read;
+
+                m_Count--;
+            }
+
+            if (segment.Read == segment.Write) {
+                Unmap(segment);
+                ::unlink(segment.FileName.c_str());
+                m_Segments.pop_front();
+            }
+
+            return result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSpool::Sync() {
+            // Only the pages touched since the last call: the records appended and the header with the read position.
+            const auto page = (size_t) ::sysconf(_SC_PAGESIZE);
+
+            for (auto &segment : m_Segments) {
+                if (segment.Synced < segment.Write) {
+                    const auto from = segment.Synced & ~(page - 1);
+
+                    if (::msync(segment.Map + from, segment.Write - from, MS_SYNC) == -1)
+                        Log()->Error(APP_LOG_ERR, errno, _T("msync(\"%s\") failed"), segment.FileName.c_str());
+
+                    segment.Synced = segment.Write;
+                }
+
+                if (segment.ReadSynced != segment.Read) {
+                    if (::msync(segment.Map, page, MS_SYNC) == -1)
+                        Log()->Error(APP_LOG_ERR, errno, _T("msync(\"%s\") failed"), segment.FileName.c_str());
+
+                    segment.ReadSynced = segment.Read;
+                }
+            }
+        }
+
+    }
+}
+}
@@ -0,0 +1,115 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Spool.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Durable packet spool
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_SPOOL_HPP
+#define APOSTOL_STREAM_SPOOL_HPP
+
+#include <deque>
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSpool ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Append-only segment files mapped into memory. A record is valid only if its magic and CRC match, so a record
+        // torn by a crash ends the segment. The read position is kept in the segment header; fully read segments are
+        // deleted. A process crash loses nothing: the pages stay in the page cache. Against a crash of the host, Sync()
+        // writes the records appended and the read position moved since the last call to disk.
+        class CSpool {
+        private:
+
+            struct CSegment {
+                uint64_t Sequence = 0;
+                CString FileName;
+
+                int Handle = -1;
+                BYTE *Map = nullptr;
+
+                size_t Read = 0;
+                size_t Write = 0;
+
+                size_t Synced = 0;
+                size_t ReadSynced = 0;
+            };
+
+            CString m_Directory;
+            CString m_Prefix;
+
+            size_t m_SegmentSize;
+            size_t m_MaxSegments;
+
+            uint64_t m_Sequence;
+            uint64_t m_Count;
+
+            std::deque<CSegment> m_Segments;
+
+            CString SegmentName(uint64_t Sequence) const;
+
+            bool Map(CSegment &Segment, bool Create);
+            void Unmap(CSegment &Segment);
+
+            void Scan(CSegment &Segment);
+
+            bool Append();
+
+        public:
+
+            CSpool();
+
+            ~CSpool();
+
+            CSpool(const CSpool &) = delete;
+            CSpool &operator=(const CSpool &) = delete;
+
+            void Open(const CString &Directory, const CString &Prefix, size_t SegmentSize, size_t MaxSize);
+            void Close();
+
+            bool Write(const void *Data, size_t Size, uint64_t Time);
+            bool Read(CString &Data, uint64_t &Time);
+
+            void Sync();
+
+            bool Active() const { return !m_Directory.IsEmpty(); }
+            bool Empty() const { return m_Count == 0; }
+
+            uint64_t Count() const { return m_Count; }
+            size_t Segments() const { return m_Segments.size(); }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_SPOOL_HPP
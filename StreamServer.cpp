@@ -23,15 +23,27 @@ Author:
 
 #include "Core.hpp"
 #include "StreamServer.hpp"
+
+#include <cmath>
+#include <unordered_set>
+
+#include <sched.h>
 //----------------------------------------------------------------------------------------------------------------------
 
 #define SERVICE_APPLICATION_NAME "service"
 #define CONFIG_SECTION_NAME "process/StreamServer"
-#define PROTOCOL_NAME "LPWAN"
+
+#define SPOOL_RECORD_FORMAT 2
+
+#define PARSE_STATEMENT "stream_parse"
+#define DECODE_STATEMENT "stream_parse_lpwan"
+#define PREPARE_ATTEMPTS 32
 
 #define API_BOT_USERNAME "apibot"
 #define PG_CONFIG_NAME "helper"
 
+#define LISTENER_DRAIN_MAX 65536
+
 extern "C++" {
 
 namespace Apostol {
@@ -44,24 +56,152 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
-        CStreamServer::CStreamServer(CCustomProcess *AParent, CApplication *AApplication):
-                inherited(AParent, AApplication, "stream process") {
+        CStreamServer::CStreamServer(CCustomProcess *AParent, CApplication *AApplication, int AWorker, CStreamGroupPtr AGroup):
+                inherited(AParent, AApplication, "stream process"), m_Group(std::move(AGroup)) {
 
             m_Agent = CString().Format("%s (%s)", GApplication->Title().c_str(), ProcessName().c_str());
             m_Host = CApostolModule::GetIPByHostName(CApostolModule::GetHostName());
 
-            m_AuthDate = 0;
-
             m_HeartbeatInterval = 5000;
+
+            m_BatchSize = 100;
+            m_BatchWindow = 50;
+
+            m_QueueHigh = 100000;
+            m_QueueLow = 80000;
+            m_InFlightMax = 1000;
+
+            m_ShedPolicy = spSuperseded;
+            m_Shedding = false;
+
+            m_Standby = -1;
+
+            m_SpoolSegment = 16;
+            m_SpoolSize = 1024;
+            m_SpoolRate = 1000;
+            m_SpoolSync = 1000;
+
+            m_SpoolCredit = 0;
+            m_SpoolTime = 0;
+            m_SpoolSyncTime = 0;
+
+            m_mmsg = true;
+            m_mmsgCount = 64;
+
+            m_DatagramSize = 2048;
+
+            m_IoUring = false;
+            m_IoUringBuffers = 1024;
+            m_IoUringBufferSize = 2048;
+
+            m_ReceiveBuffer = 0;
+            m_SendBuffer = 0;
+
+            m_Workers = m_Group->Workers;
+            m_Worker = AWorker;
+
+            m_Affinity = true;
+            m_Steering = true;
+
+            m_StreamLog = false;
+
+            m_Decode = false;
+            m_Prepared = true;
+
+            m_Reassembly = true;
+
+            m_DuplicateWindow = 30000;
+
+            m_DeviceCache = 0;
+            m_DownlinkHeartbeat = 10000;
+            m_Coalesce = false;
+
+            m_RatePeer = 100;
+            m_RateIoT = 1;
+            m_RateAndroid = 5;
+            m_RateIOS = 5;
+            m_RateBurst = 10;
+
+            m_CaptureSize = 64;
+            m_CaptureSnapLength = 512;
+
+            m_StatsInterval = 1000;
+            m_StatsTime = 0;
+
+            m_LocalAddress = {};
+            m_LocalHandle = -1;
+
+            m_OnDownlink = [this](const std::string &Device, const std::vector<CString> &Packets) {
+                return SendCommand(Device, Packets);
+            };
+
+            // A packet that never makes it into a command must not hold its duplicate key: the retransmission of the
+            // packet has to reach the assembler again.
+            m_Assembler.OnDrop([this](const std::string &Key) {
+                m_Duplicates.Remove(Key);
+            });
+
+            // Every worker receives every command. The one its device last sent to sends it; a command for a device
+            // no worker has heard from waits in all of them, and the first worker counts it if it expires.
+            if (m_Group->Owners.Active()) {
+                m_Downlink.OnOwner([this](const std::string &Device) {
+                    const auto owner = m_Group->Owners.Get(Device);
+
+                    if (owner == -1)
+                        return m_Worker == 0 ? doSelf : doUnknown;
+
+                    return owner == m_Worker ? doSelf : doOther;
+                });
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStreamServer *CStreamServer::CreateProcess(CCustomProcess *AParent, CApplication *AApplication) {
+            // Every worker is a process of its own: the master starts it, passes the signals to it and restarts it
+            // when it exits. The socket steering is created here, in the master, so that all workers share it.
+            auto Group = std::make_shared<CStreamGroup>();
+
+            Group->Workers = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "workers", 1);
+
+            if (Group->Workers < 1)
+                Group->Workers = 1;
+
+            if (Group->Workers > 1 && Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "steering", true)) {
+                CListenerList Listeners;
+
+                ParseListeners(Listeners);
+
+                for (const auto &Listener : Listeners) {
+                    if (!Group->Steering[Listener.first].Create(Group->Workers)) {
+                        Log()->Error(APP_LOG_WARN, errno, _T("[Stream] eBPF steering is not available on port %d"), (int) Listener.first);
+                        Group->Steering.erase(Listener.first);
+                    }
+                }
+            }
+
+            const auto DeviceCache = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "device_cache", 0);
+
+            if (Group->Workers > 1 && DeviceCache > 0 && !Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "downlink", "").IsEmpty()) {
+                if (!Group->Owners.Create((size_t) DeviceCache * 2))
+                    Log()->Error(APP_LOG_WARN, errno, _T("[Stream] Could not share device owners: every worker sends commands to the devices it knows"));
+            }
+
+            CStreamServer *pProcess = nullptr;
+
+            for (int i = 0; i < Group->Workers; ++i) {
+                auto pWorker = new CStreamServer(AParent, AApplication, i, Group);
+
+                if (pProcess == nullptr)
+                    pProcess = pWorker;
+            }
+
+            return pProcess;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CStreamServer::InitializeStreamServer(const CString &Title) {
             m_Server.ServerName() = Title;
-            m_Server.AllocateEventHandlers(GetPQClient(PG_CONFIG_NAME));
-
-            m_Server.DefaultIP() = Config()->Listen();
-            m_Server.DefaultPort(Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "port", (ushort) Config()->Port()));
+            m_Server.AllocateEventHandlers(GetPQClient(m_Shards.front()->Name.c_str()));
 
 #if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
             //m_Server.OnVerbose([this](auto && Sender, auto && AFormat, auto && args) { DoVerbose(Sender, AFormat, args); });
@@ -70,8 +210,8 @@ namespace Apostol {
             m_Server.OnEventHandlerException([this](auto && AHandler, auto && AException) { DoServerEventHandlerException(AHandler, AException); });
             m_Server.OnNoCommandHandler([this](auto && Sender, auto && AData, auto && AConnection) { DoNoCommandHandler(Sender, AData, AConnection); });
 
-            m_Server.OnRead([this](auto && Server, auto && Socket, auto && Buffer) { DoRead(Server, Socket, Buffer); });
-            m_Server.OnWrite([this](auto && Server, auto && Socket, auto && Buffer) { DoWrite(Server, Socket, Buffer); });
+            for (const auto &pShard : m_Shards)
+                GetPQClient(pShard->Name.c_str()).OnNotify([this](auto && AConnection, auto && ANotify) { DoPostgresNotify(AConnection, ANotify); });
 #else
             //m_Server.OnVerbose(std::bind(&CStreamServer::DoVerbose, this, _1, _2, _3));
             m_Server.OnAccessLog(std::bind(&CStreamServer::DoAccessLog, this, _1));
@@ -79,14 +219,18 @@ namespace Apostol {
             m_Server.OnEventHandlerException(std::bind(&CStreamServer::DoServerEventHandlerException, this, _1, _2));
             m_Server.OnNoCommandHandler(std::bind(&CStreamServer::DoNoCommandHandler, this, _1, _2, _3));
 
-            m_Server.OnRead(std::bind(&CStreamServer::DoRead, this, _1, _2, _3));
-            m_Server.OnWrite(std::bind(&CStreamServer::DoWrite, this, _1, _2, _3));
+            for (const auto &pShard : m_Shards)
+                GetPQClient(pShard->Name.c_str()).OnNotify(std::bind(&CStreamServer::DoPostgresNotify, this, _1, _2));
 #endif
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CStreamServer::BeforeRun() {
-            Application()->Header(Application()->Name() + ": stream process");
+            if (m_Workers > 1) {
+                Application()->Header(CString().Format("%s: stream process #%d", Application()->Name().c_str(), m_Worker));
+            } else {
+                Application()->Header(Application()->Name() + ": stream process");
+            }
 
             Log()->Debug(APP_LOG_DEBUG_CORE, MSG_PROCESS_START, GetProcessName(), Application()->Header().c_str());
 
@@ -96,15 +240,21 @@ namespace Apostol {
 
             SetUser(Config()->User(), Config()->Group());
 
+            if (m_Workers > 1 && m_Affinity)
+                SetAffinity();
+
             InitializePQClients(Application()->Title(), 1, Config()->PostgresPollMin());
 
-            PQClientStart(PG_CONFIG_NAME);
+            for (const auto &pShard : m_Shards)
+                PQClientStart(pShard->Name.c_str());
 
             InitializeStreamServer(Application()->Title());
 
             SigProcMask(SIG_UNBLOCK);
 
-            SetTimerInterval(1000);
+            // The timer flushes partial batches, so it ticks every batch_window milliseconds. Everything else it
+            // drives (heartbeat, expiry, stats) compares time stamps and does not depend on the tick rate.
+            SetTimerInterval(m_BatchWindow > 0 ? m_BatchWindow : 1000);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -114,326 +264,2315 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::Run() {
-            try {
-                m_Server.ActiveLevel(alActive);
-
-                while (!sig_exiting) {
+        void CStreamServer::SetAffinity() {
+            const auto cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-                    Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stream server process cycle"));
-
-                    try {
-                        m_Server.Wait();
-                    } catch (std::exception &e) {
-                        Log()->Error(APP_LOG_ERR, 0, _T("%s"), e.what());
-                    }
+            if (cpus < 1)
+                return;
 
-                    if (sig_terminate || sig_quit) {
-                        if (sig_quit) {
-                            sig_quit = 0;
-                            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("gracefully shutting down"));
-                            Application()->Header(_T("stream server process is shutting down"));
-                        }
+            cpu_set_t set;
 
-                        if (!sig_exiting) {
-                            sig_exiting = 1;
-                            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("exiting stream server process"));
-                        }
-                    }
+            CPU_ZERO(&set);
+            CPU_SET(m_Worker % cpus, &set);
 
-                    if (sig_reopen) {
-                        sig_reopen = 0;
+            if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+                Log()->Error(APP_LOG_ERR, errno, _T("sched_setaffinity(%d) failed"), (int) (m_Worker % cpus));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                        Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stream server reconnect"));
+        CStreamServer::CReceive CStreamServer::FindProtocol(const CString &Name) {
+            // The protocol registry: a protocol is a reader specialization (framing and decoder policies) and a line
+            // here; the receive path of every entry is compiled for its reader.
+            static const struct {
+                const char *Name;
+                CReceive Receive;
+            } Protocols[] = {
+                { LPWAN::CProtocol::Name(), &CStreamServer::Receive<LPWAN::CProtocol> },
+            };
 
-                        m_Server.ActiveLevel(alBinding);
-                        m_Server.ActiveLevel(alActive);
-                    }
-                }
-            } catch (std::exception &e) {
-                Log()->Error(APP_LOG_ERR, 0, _T("%s"), e.what());
-                ExitSigAlarm(5 * 1000);
+            for (const auto &Protocol : Protocols) {
+                if (SameText(Name, Protocol.Name))
+                    return Protocol.Receive;
             }
 
-            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stop stream server process"));
+            return nullptr;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        bool CStreamServer::DoExecute(CTCPConnection *AConnection) {
-            return true;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+        void CStreamServer::ParseListeners(CListenerList &Listeners) {
+            const CString Value(Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "listeners", ""));
 
-        ushort CStreamServer::GetCRC16(void *buffer, size_t size) {
-            int crc = 0xFFFF;
+            if (Value.IsEmpty()) {
+                Listeners.emplace_back(Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "port", (ushort) Config()->Port()), LPWAN::CProtocol::Name());
+                return;
+            }
 
-            for (int i = 0; i < size; i++) {
-                crc = crc ^ ((BYTE *) buffer)[i];
+            // port[:protocol], separated by commas or spaces; the protocol is LPWAN by default.
+            for (auto p = Value.c_str(); *p != '\0';) {
+                char *end;
+                const auto value = strtol(p, &end, 10);
 
-                for (int j = 0; j < 8; ++j) {
-                    if ((crc & 0x01) == 1)
-                        crc = (crc >> 1 ^ 0xA001);
-                    else
-                        crc >>= 1;
+                if (end == p) {
+                    p++;
+                    continue;
                 }
-            }
 
-            return (ushort) crc;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+                p = end;
 
-        void CStreamServer::Reload() {
-            CServerProcess::Reload();
+                CString Protocol(LPWAN::CProtocol::Name());
+
+                if (*p == ':') {
+                    const auto name = ++p;
+
+                    while (*p != '\0' && *p != ',' && *p != ' ')
+                        p++;
+
+                    Protocol = CString(name, p - name);
+                }
+
+                if (value <= 0 || value > 0xFFFF) {
+                    Log()->Error(APP_LOG_ERR, 0, _T("[Stream] Invalid listener port: %ld"), value);
+                    continue;
+                }
 
-            m_AuthDate = Now();
+                Listeners.emplace_back((ushort) value, Protocol);
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::Authentication() {
+        void CStreamServer::OpenListeners() {
+            // The new sockets join the SO_REUSEPORT groups of the old ones before those are closed, so the kernel always
+            // has a socket to queue the datagrams of a port in; the old ones are drained before they are closed.
+            std::vector<CListenerPtr> Listeners;
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+            Listeners.swap(m_Listeners);
 
-                CPQueryResults pqResults;
-                CStringList SQL;
-
-                try {
-                    CApostolModule::QueryToResults(APollQuery, pqResults);
+            try {
+                CListenerList List;
 
-                    const auto &login = pqResults[0];
-                    const auto &sessions = pqResults[1];
+                ParseListeners(List);
 
-                    const auto &session = login.First()["session"];
+                for (const auto &Listener : List)
+                    AddListener(Listener.first, Listener.second);
+            } catch (Delphi::Exception::Exception &E) {
+                for (auto &pListener : m_Listeners)
+                    CloseListener(*pListener);
 
-                    m_Sessions.Clear();
-                    for (int i = 0; i < sessions.Count(); ++i) {
-                        m_Sessions.Add(sessions[i]["get_sessions"]);
-                    }
+                m_Listeners.swap(Listeners);
 
-                    m_AuthDate = Now() + (CDateTime) 24 / HoursPerDay;
+                if (m_Listeners.empty())
+                    throw;
 
-                    SignOut(session);
-                } catch (Delphi::Exception::Exception &E) {
-                    DoError(E);
-                }
-            };
+                Log()->Error(APP_LOG_ERR, 0, _T("[Stream] %s; the current listeners are kept"), E.what());
+                return;
+            }
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                DoError(E);
-            };
+            if (m_Listeners.empty() && !Listeners.empty()) {
+                Log()->Error(APP_LOG_ERR, 0, _T("[Stream] No listeners configured; the current listeners are kept"));
+                m_Listeners.swap(Listeners);
+                return;
+            }
 
-            const auto &caProviders = Server().Providers();
-            const auto &caProvider = caProviders.DefaultValue();
+            // A new socket may have got the descriptor number of a socket closed by an earlier rebind.
+            for (auto &pListener : m_Listeners)
+                m_Rebound.erase(pListener->Socket.Handle());
 
-            const auto &clientId = caProvider.ClientId(SERVICE_APPLICATION_NAME);
-            const auto &clientSecret = caProvider.Secret(SERVICE_APPLICATION_NAME);
+            // Packets received on an old socket are answered through the new socket of the same port.
+            for (auto &pOld : Listeners) {
+                const auto handle = pOld->Socket.Handle();
 
-            CStringList SQL;
+                int target = -1;
 
-            api::login(SQL, clientId, clientSecret, m_Agent, m_Host);
+                for (auto &pListener : m_Listeners) {
+                    if (pListener->Port == pOld->Port) {
+                        target = pListener->Socket.Handle();
+                        break;
+                    }
+                }
 
-            api::get_session(SQL, API_BOT_USERNAME, m_Agent, m_Host);
+                for (auto &Rebound : m_Rebound) {
+                    if (Rebound.second == handle)
+                        Rebound.second = target;
+                }
 
-            try {
-                ExecSQL(SQL, nullptr, OnExecuted, OnException);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(E);
+                m_Rebound[handle] = target;
             }
-        }
-        //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::SignOut(const CString &Session) {
-            CStringList SQL;
+            for (auto &pOld : Listeners) {
+                DrainListener(*pOld);
+                CloseListener(*pOld);
+            }
 
-            api::signout(SQL, Session);
+            SendReplies();
 
-            try {
-                ExecSQL(SQL);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(E);
-            }
+            m_LocalHandle = -1;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::Heartbeat(CDateTime Now) {
-            if ((Now >= m_AuthDate)) {
-                Authentication();
+        void CStreamServer::AddListener(ushort Port, const CString &Protocol) {
+            const auto Receive = FindProtocol(Protocol);
+
+            if (Receive == nullptr) {
+                Log()->Error(APP_LOG_ERR, 0, _T("[Stream] Unknown protocol \"%s\" on port %d"), Protocol.c_str(), (int) Port);
+                return;
             }
-        }
-        //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::Parse(CUDPAsyncServer *Server, CSocketHandle *Socket, const CString &Protocol, const CString &Data) {
+            m_Listeners.emplace_back(new CListener());
 
-            auto OnExecuted = [this, Server, Socket](CPQPollQuery *APollQuery) {
+            auto pListener = m_Listeners.back().get();
 
-                CPQResult *pResult;
-                CString Result;
+            pListener->Port = Port;
+            pListener->Protocol = Protocol;
+            pListener->Receive = Receive;
 
-                try {
-                    for (int I = 0; I < APollQuery->Count(); I++) {
-                        pResult = APollQuery->Results(I);
+            pListener->Socket.Open(Config()->Listen(), Port, true);
 
-                        if (pResult->ExecStatus() != PGRES_TUPLES_OK)
-                            throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+            if (!pListener->Socket.SetBufferSizes(m_ReceiveBuffer, m_SendBuffer))
+                Log()->Error(APP_LOG_WARN, errno, _T("[Stream] Could not set the buffer sizes of port %d"), (int) Port);
 
-                        if (I < 3)
-                            continue;
+            if (!pListener->Socket.EnableDropCounter())
+                Log()->Error(APP_LOG_WARN, errno, _T("[Stream] SO_RXQ_OVFL is not available on port %d"), (int) Port);
 
-                        if (!pResult->GetIsNull(0, 0)) {
-                            Result = base64_decode(pResult->GetValue(0, 0));
-                            Server->OutputBuffer().Write(Result.Data(), Result.Size());
-                            Server->Send(Socket);
-                        }
-                    }
-                } catch (Delphi::Exception::Exception &E) {
-                    DoError(E);
+            if (m_Steering && m_Workers > 1) {
+                const auto it = m_Group->Steering.find(Port);
+
+                if (it == m_Group->Steering.end() || !it->second.Attach(pListener->Socket.Handle(), m_Worker)) {
+                    // A port added after the start, or no eBPF: the socket is picked by its place in the group,
+                    // which changes when a socket of the port is closed.
+                    Log()->Error(APP_LOG_WARN, it == m_Group->Steering.end() ? 0 : errno,
+                                 _T("[Stream] Port %d is steered by socket order; devices may move between workers on a rebind"), (int) Port);
+                    pListener->Socket.AttachSteering(m_Workers);
                 }
-            };
+            }
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                DoError(E);
-            };
+            if (m_IoUring) {
+                if (pListener->Ring.Open(pListener->Socket.Handle(), m_IoUringBuffers, m_IoUringBufferSize)) {
+                    pListener->OnDatagram = [this, Receive](const CDatagramPeer &Peer, const BYTE *Data, size_t Size) {
+                        (this->*Receive)(Peer, Data, Size);
+                    };
+                } else {
+                    Log()->Error(APP_LOG_WARN, errno, _T("io_uring is not available, falling back to epoll"));
+                }
+            }
+
+            // With io_uring the ring descriptor is polled instead of the socket: it is readable while completions wait.
+            pListener->pHandler = m_Server.EventHandlers()->Add(pListener->Ring.Active() ? pListener->Ring.Handle() : pListener->Socket.Handle());
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+            if (pListener->Ring.Active()) {
+                pListener->pHandler->OnReadEvent([this, pListener](auto && AHandler) { DoRingRead(AHandler, pListener); });
+            } else {
+                pListener->pHandler->OnReadEvent([this, pListener](auto && AHandler) { DoSocketRead(AHandler, pListener); });
+            }
+#else
+            if (pListener->Ring.Active()) {
+                pListener->pHandler->OnReadEvent(std::bind(&CStreamServer::DoRingRead, this, _1, pListener));
+            } else {
+                pListener->pHandler->OnReadEvent(std::bind(&CStreamServer::DoSocketRead, this, _1, pListener));
+            }
+#endif
+            pListener->pHandler->Start(etIO);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            const auto &Base64 = base64_encode(Data);
+        void CStreamServer::DrainListener(CListener &Listener) {
+            if (Listener.Ring.Active()) {
+                if (Listener.Ring.Read(Listener.OnDatagram) == -1)
+                    Log()->Error(APP_LOG_ERR, errno, _T("io_uring recvmsg failed"));
 
-            for (int i = 0; i < m_Sessions.Count(); ++i) {
-                const auto &session = m_Sessions[i];
+                CountDrops(Listener, Listener.Ring.Drops());
 
-                CStringList SQL;
+                if (Listener.Ring.Pending() != 0)
+                    Listener.Ring.Submit();
 
-                api::authorize(SQL, session);
-                api::set_area(SQL);
+                // Without the ring the rest is read from the socket below.
+                Listener.Ring.Close();
+            }
 
-                SQL.Add(CString().MaxFormatSize(256 + Protocol.Size() + Base64.Size()).
-                        Format("SELECT * FROM stream.parse('%s', '%s:%d', '%s');",
-                               Protocol.c_str(),
-                               Socket->PeerIP(), Socket->PeerPort(),
-                               Base64.c_str()
-                ));
+            // The kernel keeps steering datagrams to the old socket until it is closed: only what arrives between the
+            // last read here and close() is lost.
+            for (size_t count = 0; count < LISTENER_DRAIN_MAX;) {
+                const auto read = ReadSocket(Listener);
 
-                try {
-                    ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                } catch (Delphi::Exception::Exception &E) {
-                    DoError(E);
-                }
+                if (read <= 0)
+                    break;
+
+                count += read;
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::DoTimer(CPollEventHandler *AHandler) {
-            uint64_t exp;
+        void CStreamServer::CloseListener(CListener &Listener) {
+            // The counters of the rings outlive them.
+            const auto &Ring = Listener.Ring.Counters();
 
-            auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
-            pTimer->Read(&exp, sizeof(uint64_t));
+            m_RingCounters.Received += Ring.Received;
+            m_RingCounters.Truncated += Ring.Truncated;
+            m_RingCounters.NoBuffers += Ring.NoBuffers;
+            m_RingCounters.Rearmed += Ring.Rearmed;
+            m_RingCounters.Sent += Ring.Sent;
+            m_RingCounters.SendErrors += Ring.SendErrors;
+            m_RingCounters.Submits += Ring.Submits;
 
-            try {
-                Heartbeat(AHandler->TimeStamp());
-            } catch (Delphi::Exception::Exception &E) {
-                DoServerEventHandlerException(AHandler, E);
+            uint32_t drops;
+
+            if (Listener.Socket.Drops(drops))
+                CountDrops(Listener, drops);
+
+            if (Listener.pHandler != nullptr) {
+                Listener.pHandler->Stop();
+                delete Listener.pHandler;
+                Listener.pHandler = nullptr;
             }
+
+            Listener.Ring.Close();
+            Listener.Socket.Close();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::DoError(const Delphi::Exception::Exception &E) {
-            m_AuthDate = Now() + (CDateTime) m_HeartbeatInterval / MSecsPerDay;
-            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+        void CStreamServer::CloseListeners() {
+            for (auto &pListener : m_Listeners)
+                CloseListener(*pListener);
+
+            m_Listeners.clear();
+            m_Rebound.clear();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::DoRead(CUDPAsyncServer *Sender, CSocketHandle *Socket, CManagedBuffer &Buffer) {
+        CStreamServer::CListener *CStreamServer::FindListener(int Handle) {
+            for (auto &pListener : m_Listeners) {
+                if (pListener->Socket.Handle() == Handle)
+                    return pListener.get();
+            }
 
-            BYTE byte;
-            size_t size, streamSize;
+            // A packet received before a rebind: its socket is closed, the descriptor number may already be reused.
+            const auto it = m_Rebound.find(Handle);
 
-            ushort length;
-            ushort crc, crcData;
+            if (it == m_Rebound.end() || it->second == -1)
+                return nullptr;
 
-            CString Stream;
-            CString Data;
+            for (auto &pListener : m_Listeners) {
+                if (pListener->Socket.Handle() == it->second)
+                    return pListener.get();
+            }
+
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            Stream.SetLength(Buffer.Size());
-            Buffer.Extract(Stream.Data(), Stream.Size());
+        CDatagramRingCounters CStreamServer::RingCounters() const {
+            CDatagramRingCounters Counters(m_RingCounters);
 
-            Log()->Stream("[%s:%d] DoRead:", Socket->PeerIP(), Socket->PeerPort());
-            Debug(Socket, Stream);
+            for (const auto &pListener : m_Listeners) {
+                const auto &Ring = pListener->Ring.Counters();
 
-            while (Stream.Position() < Stream.Size()) {
-                Data.Clear();
-                size = 0;
+                Counters.Received += Ring.Received;
+                Counters.Truncated += Ring.Truncated;
+                Counters.NoBuffers += Ring.NoBuffers;
+                Counters.Rearmed += Ring.Rearmed;
+                Counters.Sent += Ring.Sent;
+                Counters.SendErrors += Ring.SendErrors;
+                Counters.Submits += Ring.Submits;
+            }
 
-                Stream.ReadBuffer(&byte, sizeof(byte));
-                size++;
+            return Counters;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                // length – длина данных (1 или 2 байта).
-                // 1 байт: 0-6 бит – младшие биты длины, 7 бит – длина данных 2 байта).
-                // 2 байт: присутствует если установлен 7 бит первого байта, 0-7 бит – старшие биты длины.
-                length = byte;
-                if ((length & 0x80) == 0x80) {
-                    Stream.ReadBuffer(&byte, sizeof(byte));
-                    size++;
+        void CStreamServer::Run() {
+            try {
+                OpenCapture();
+                OpenSpool();
 
-                    length &= ~(1 << 7);
-                    length = (length << 8) | byte;
-                }
+                OpenListeners();
 
-                streamSize = Stream.Size() - Stream.Position();
+                while (!sig_exiting) {
 
-                if ((length == 0) || (length > streamSize)) {
-                    Data.SetLength(size + streamSize);
-                    Data.WriteBuffer(&length, size);
+                    Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stream server process cycle"));
 
-                    if (streamSize > 0) {
-                        Data.WriteBuffer(&length, size);
-                        Stream.ReadBuffer(Data.Data() + size, streamSize);
+                    try {
+                        m_Server.Wait();
+                    } catch (std::exception &e) {
+                        Log()->Error(APP_LOG_ERR, 0, _T("%s"), e.what());
                     }
 
-                    Log()->Stream("[%s:%d] Incorrect:", Socket->PeerIP(), Socket->PeerPort());
-                    Debug(Socket, Data);
+                    SendReplies();
 
-                    Log()->Stream("[%s:%d] [%d:%d:%d] [%d] Incorrect length.", Socket->PeerIP(), Socket->PeerPort(), Stream.Size(), Stream.Position(), streamSize, length);
-                    break;
-                }
+                    if (sig_terminate || sig_quit) {
+                        if (sig_quit) {
+                            sig_quit = 0;
+                            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("gracefully shutting down"));
+                            Application()->Header(_T("stream server process is shutting down"));
+                        }
+
+                        if (!sig_exiting) {
+                            sig_exiting = 1;
+                            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("exiting stream server process"));
+                        }
+                    }
 
-                Data.SetLength(size + length);
-                Data.WriteBuffer(&length, size);
-                Stream.ReadBuffer(Data.Data() + size, length);
+                    if (sig_reopen) {
+                        sig_reopen = 0;
 
-                Log()->Stream("[%s:%d] Data:", Socket->PeerIP(), Socket->PeerPort());
-                Debug(Socket, Data);
+                        Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stream server reconnect"));
 
-                crc = ((BYTE) Data[length] << 8) | (BYTE) Data[length - 1];
-                crcData = GetCRC16(Data.Data(), Data.Size() - 2);
+                        OpenCapture();
+                        OpenSpool();
 
-                if (crc != crcData) {
-                    Log()->Stream("[%s:%d] [%d] [%d] [%d] Invalid CRC.", Socket->PeerIP(), Socket->PeerPort(), crc, crcData);
-                    break;
+                        OpenListeners();
+                    }
                 }
-
-                Parse(Sender, Socket, PROTOCOL_NAME, Data);
+            } catch (std::exception &e) {
+                Log()->Error(APP_LOG_ERR, 0, _T("%s"), e.what());
+                ExitSigAlarm(5 * 1000);
             }
-        }
-        //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::DoWrite(CUDPAsyncServer *Server, CSocketHandle *Socket, CSimpleBuffer &Buffer) {
-            if (Buffer.Size() > 0) {
-                CString Stream;
+            CloseListeners();
 
-                Stream.SetLength(Buffer.Size());
-                Buffer.Extract(Stream.Data(), Stream.Size());
+            m_Capture.Close();
+            m_Spool.Close();
 
-                Log()->Stream("[%s:%d] DoWrite:", Socket->PeerIP(), Socket->PeerPort());
-                Debug(Socket, Stream);
-            }
+            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stop stream server process"));
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::DoException(CTCPConnection *AConnection, const Delphi::Exception::Exception &E) {
-            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
-            sig_reopen = 1;
+        bool CStreamServer::DoExecute(CTCPConnection *AConnection) {
+            return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
-            CPQResult *pResult;
+        void CStreamServer::Reload() {
+            CServerProcess::Reload();
+
+            m_BatchSize = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "batch_size", 100);
+            m_BatchWindow = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "batch_window", 50);
+
+            if (m_BatchSize < 1)
+                m_BatchSize = 1;
+
+            m_QueueHigh = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "queue_high", 100000);
+            m_QueueLow = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "queue_low", m_QueueHigh / 5 * 4);
+            m_InFlightMax = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "inflight_max", 1000);
+
+            if (m_QueueHigh < m_BatchSize)
+                m_QueueHigh = m_BatchSize;
+
+            if (m_QueueLow < 0 || m_QueueLow >= m_QueueHigh)
+                m_QueueLow = m_QueueHigh / 5 * 4;
+
+            if (m_InFlightMax < m_BatchSize)
+                m_InFlightMax = m_BatchSize;
+
+            const auto &policy = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "shed_policy", "superseded");
+
+            if (policy == "oldest") {
+                m_ShedPolicy = spOldest;
+            } else if (policy == "newest") {
+                m_ShedPolicy = spNewest;
+            } else {
+                m_ShedPolicy = spSuperseded;
+            }
+
+            m_SpoolDirectory = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "spool", "");
+            m_SpoolSegment = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "spool_segment", 16);
+            m_SpoolSize = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "spool_size", 1024);
+            m_SpoolRate = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "spool_rate", 1000);
+            m_SpoolSync = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "spool_sync", 1000);
+
+            if (m_SpoolSegment < 1)
+                m_SpoolSegment = 1;
+
+            if (m_SpoolRate < 1)
+                m_SpoolRate = 1;
+
+            m_mmsg = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "mmsg", true);
+            m_mmsgCount = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "mmsg_count", 64);
+
+            if (m_mmsgCount < 1)
+                m_mmsgCount = 1;
+
+            m_DatagramSize = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "datagram_size", 2048);
+
+            if (m_DatagramSize < 64 || m_DatagramSize > DATAGRAM_MAX_SIZE)
+                m_DatagramSize = DATAGRAM_MAX_SIZE;
+
+            m_IoUring = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "io_uring", false);
+            m_IoUringBuffers = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "io_uring_buffers", 1024);
+            m_IoUringBufferSize = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "io_uring_buffer", 2048);
+
+            if (m_IoUringBuffers < 1)
+                m_IoUringBuffers = 1;
+
+            m_ReceiveBuffer = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rcvbuf", 0);
+            m_SendBuffer = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "sndbuf", 0);
+
+            // Without mmsg a datagram is read with recvfrom() into a single buffer.
+            m_Reader.Allocate(m_mmsg ? m_mmsgCount : 0, m_DatagramSize);
+            m_Writer.Allocate(m_mmsg ? m_mmsgCount : 0);
+
+            m_Datagram.resize(m_mmsg ? 0 : m_DatagramSize);
+            m_Datagram.shrink_to_fit();
+
+            m_Affinity = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "cpu_affinity", true);
+            m_Steering = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "steering", true);
+
+            m_StreamLog = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "stream_log", false);
+
+            m_Decode = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "decode", false);
+            m_Prepared = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "prepared", true);
+
+            m_Reassembly = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "reassembly", true);
+
+            if (m_Reassembly) {
+                m_Assembler.Configure(
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "reassembly_max", 4096),
+                        (size_t) Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "reassembly_memory", 16) * 1024 * 1024,
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "reassembly_timeout", 10000));
+            } else {
+                m_Assembler.Clear();
+            }
+
+            m_DuplicateWindow = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "duplicate_window", 30000);
+
+            if (m_DuplicateWindow > 0) {
+                m_Duplicates.Configure(Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "duplicate_max", 65536), m_DuplicateWindow);
+            } else {
+                m_Duplicates.Clear();
+            }
+
+            m_DeviceCache = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "device_cache", 0);
+            m_Coalesce = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "coalesce", false);
+
+            if (m_DeviceCache > 0) {
+                m_Devices.Configure(m_DeviceCache,
+                        (double) Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "coalesce_accuracy", 100) / 100,
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "coalesce_battery", 1),
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "coalesce_keepalive", 300000));
+            } else {
+                m_Devices.Clear();
+            }
+
+            const auto &acknowledge = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "acknowledge", "");
+
+            m_Acknowledge.reset();
+
+            for (auto p = acknowledge.c_str(); *p != '\0';) {
+                char *end;
+                const auto type = strtol(p, &end, 0);
+
+                if (end == p) {
+                    p++;
+                    continue;
+                }
+
+                if (type >= 0 && type < 256)
+                    m_Acknowledge.set((size_t) type);
+
+                p = end;
+            }
+
+            const auto rate_limit = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rate_limit", 0);
+
+            m_RatePeer = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rate_peer", 100);
+            m_RateIoT = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rate_iot", 1);
+            m_RateAndroid = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rate_android", 5);
+            m_RateIOS = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rate_ios", 5);
+            m_RateBurst = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "rate_burst", 10);
+
+            if (m_RateBurst < 1)
+                m_RateBurst = 1;
+
+            if (rate_limit > 0) {
+                m_Limiter.Configure(rate_limit);
+            } else {
+                m_Limiter.Clear();
+            }
+
+            const auto &channel = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "downlink", "");
+
+            // Commands go to the address a device has last sent from, which only the device cache knows.
+            m_DownlinkChannel = m_DeviceCache > 0 ? channel : CString();
+            m_DownlinkHeartbeat = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "downlink_heartbeat", 10000);
+
+            if (!m_DownlinkChannel.IsEmpty()) {
+                m_Downlink.Configure(Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "downlink_packet", 512),
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "downlink_max", 10000),
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "downlink_timeout", 1000),
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "downlink_retries", 5),
+                        Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "downlink_ttl", 3600000));
+            } else {
+                m_Downlink.Clear();
+            }
+
+            m_CaptureFile = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "capture", "");
+            m_CaptureSize = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "capture_size", 64);
+            m_CaptureSnapLength = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "capture_snaplen", 512);
+
+            if (m_CaptureSnapLength < 16)
+                m_CaptureSnapLength = 16;
+
+            if (m_CaptureSnapLength > DATAGRAM_MAX_SIZE)
+                m_CaptureSnapLength = DATAGRAM_MAX_SIZE;
+
+            m_StatsFile = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "stats", "");
+            m_StatsInterval = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "stats_interval", 1000);
+
+            if (m_StatsInterval < 100)
+                m_StatsInterval = 100;
+
+            m_Metrics.Active(!m_StatsFile.IsEmpty());
+
+            if (m_Shards.empty())
+                InitializeShards();
+
+            for (auto &pShard : m_Shards)
+                pShard->AuthDate = Now();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::InitializeShards() {
+            // The shards are fixed for the life of the process: every one has a pool started with it, and a device
+            // keeps its shard only as long as the ring stays the same.
+            const auto &shards = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "shards", PG_CONFIG_NAME);
+            const auto &standby = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "shard_standby", "");
+
+            std::vector<CString> Names;
+
+            for (auto p = shards.c_str(); *p != '\0';) {
+                while (*p == ',' || *p == ' ')
+                    p++;
+
+                const auto name = p;
+
+                while (*p != '\0' && *p != ',' && *p != ' ')
+                    p++;
+
+                if (p == name)
+                    continue;
+
+                const CString Name(name, p - name);
+
+                if (std::find(Names.begin(), Names.end(), Name) == Names.end())
+                    Names.push_back(Name);
+            }
+
+            if (Names.empty())
+                Names.emplace_back(PG_CONFIG_NAME);
+
+            for (const auto &Name : Names) {
+                m_Shards.emplace_back(new CShard());
+                m_Shards.back()->Name = Name;
+            }
+
+            // The standby is not on the ring: it only takes the devices of shards that have failed.
+            if (!standby.IsEmpty() && std::find(Names.begin(), Names.end(), standby) == Names.end()) {
+                m_Standby = (int) m_Shards.size();
+                m_Shards.emplace_back(new CShard());
+                m_Shards.back()->Name = standby;
+            }
+
+            m_Ring.Build(Names);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Authentication(CShard &Shard) {
+
+            auto pShard = &Shard;
+
+            auto OnExecuted = [this, pShard](CPQPollQuery *APollQuery) {
+
+                CPQueryResults pqResults;
+                CStringList SQL;
+
+                try {
+                    CApostolModule::QueryToResults(APollQuery, pqResults);
+
+                    const auto &login = pqResults[0];
+                    const auto &sessions = pqResults[1];
+
+                    const auto &session = login.First()["session"];
+
+                    pShard->Sessions.Clear();
+                    for (int i = 0; i < sessions.Count(); ++i) {
+                        pShard->Sessions.Add(sessions[i]["get_sessions"]);
+                    }
+
+                    // New statement names make every pooled connection authorize again with the new sessions.
+                    pShard->Generation++;
+                    pShard->Pinned.clear();
+
+                    pShard->AuthDate = Now() + (CDateTime) 24 / HoursPerDay;
+
+                    if (!pShard->Healthy) {
+                        pShard->Healthy = true;
+                        Log()->Notice(_T("[Stream] Database \"%s\" is available again."), pShard->Name.c_str());
+                    }
+
+                    SignOut(*pShard, session);
+
+                    // The connection listening for commands may have been replaced since the last time.
+                    Listen(*pShard);
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(*pShard, E);
+                }
+            };
+
+            auto OnException = [this, pShard](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(*pShard, E);
+            };
+
+            const auto &caProviders = Server().Providers();
+            const auto &caProvider = caProviders.DefaultValue();
+
+            const auto &clientId = caProvider.ClientId(SERVICE_APPLICATION_NAME);
+            const auto &clientSecret = caProvider.Secret(SERVICE_APPLICATION_NAME);
+
+            CStringList SQL;
+
+            api::login(SQL, clientId, clientSecret, m_Agent, m_Host);
+
+            api::get_session(SQL, API_BOT_USERNAME, m_Agent, m_Host);
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException, Shard.Name);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(Shard, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::SignOut(CShard &Shard, const CString &Session) {
+            CStringList SQL;
+
+            api::signout(SQL, Session);
+
+            try {
+                ExecSQL(SQL, nullptr, nullptr, nullptr, Shard.Name);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(Shard, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Listen(CShard &Shard) {
+            if (m_DownlinkChannel.IsEmpty())
+                return;
+
+            CString Channel;
+
+            for (size_t i = 0; i < m_DownlinkChannel.Size(); ++i) {
+                if (m_DownlinkChannel[i] == '"')
+                    Channel.Append('"');
+                Channel.Append(m_DownlinkChannel[i]);
+            }
+
+            CStringList SQL;
+
+            SQL.Add(CString().Format("LISTEN \"%s\";", Channel.c_str()));
+
+            auto pShard = &Shard;
+
+            auto OnExecuted = [this, pShard](CPQPollQuery *APollQuery) {
+                // Notifications from any other connection, one this process has listened on before, are ignored.
+                pShard->Listener = APollQuery->Connection();
+                pShard->Heard = MonotonicTime();
+
+                Log()->Notice("[Stream] Listening for commands on channel \"%s\" (%s).", m_DownlinkChannel.c_str(), pShard->Name.c_str());
+            };
+
+            auto OnException = [this, pShard](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(*pShard, E);
+            };
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException, Shard.Name);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(Shard, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Ping(CShard &Shard) {
+            // An empty notification to our own channel: it comes back only while the LISTEN still holds.
+            CString Channel;
+
+            for (size_t i = 0; i < m_DownlinkChannel.Size(); ++i) {
+                if (m_DownlinkChannel[i] == '\'')
+                    Channel.Append('\'');
+                Channel.Append(m_DownlinkChannel[i]);
+            }
+
+            CStringList SQL;
+
+            SQL.Add(CString().Format("SELECT pg_notify('%s', '');", Channel.c_str()));
+
+            auto pShard = &Shard;
+
+            auto OnException = [this, pShard](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(*pShard, E);
+            };
+
+            try {
+                ExecSQL(SQL, nullptr, nullptr, OnException, Shard.Name);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(Shard, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Probe(CShard &Shard) {
+            // A failed shard gets no batches, so a trivial query tells when it is back.
+            CStringList SQL;
+
+            SQL.Add("SELECT 1;");
+
+            auto pShard = &Shard;
+
+            auto OnExecuted = [this, pShard](CPQPollQuery *APollQuery) {
+                pShard->Probing = false;
+
+                if (APollQuery->Count() == 0 || APollQuery->Results(0)->ExecStatus() != PGRES_TUPLES_OK)
+                    return;
+
+                pShard->Healthy = true;
+                Log()->Notice(_T("[Stream] Database \"%s\" is available again (%llu packets spooled)."),
+                              pShard->Name.c_str(), (unsigned long long) m_Spool.Count());
+
+                Flush();
+            };
+
+            auto OnException = [pShard](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                pShard->Probing = false;
+            };
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException, Shard.Name);
+                Shard.Probing = true;
+            } catch (Delphi::Exception::Exception &E) {
+                Shard.Probing = false;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Unavailable(CShard &Shard) {
+            if (!Shard.Healthy)
+                return;
+
+            Shard.Healthy = false;
+
+            if (m_Shards.size() == 1) {
+                Log()->Notice(_T("[Stream] Database is unavailable, batches are paused."));
+            } else {
+                Log()->Notice(_T("[Stream] Database \"%s\" is unavailable, its devices are moved to %s."),
+                              Shard.Name.c_str(), m_Standby == -1 ? "the next shards" : m_Shards[m_Standby]->Name.c_str());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStreamServer::Available() const {
+            for (const auto &pShard : m_Shards) {
+                if (Usable(*pShard))
+                    return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CStreamServer::Route(const std::string &Device) {
+            const auto hash = CShardRing::Hash(Device);
+            const auto primary = m_Ring.Primary(hash);
+
+            const auto &Primary = *m_Shards[primary];
+
+            if (Usable(Primary))
+                return (int) primary;
+
+            // Until its first login a shard keeps its devices waiting rather than sending them elsewhere.
+            if (Primary.Healthy)
+                return -1;
+
+            int index = -1;
+
+            if (m_Standby != -1 && Usable(*m_Shards[m_Standby])) {
+                index = m_Standby;
+            } else {
+                index = m_Ring.Find(hash, [this](size_t i) { return Usable(*m_Shards[i]); });
+            }
+
+            if (index != -1)
+                m_Shards[index]->Counters.Failovers++;
+
+            return index;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Heartbeat(CDateTime Now) {
+            for (auto &pShard : m_Shards) {
+                if (Now >= pShard->AuthDate) {
+                    Authentication(*pShard);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::ExportStats() {
+            CString FileName(m_StatsFile);
+
+            // One file per worker: stream.prom becomes stream-1.prom.
+            if (m_Workers > 1) {
+                CString Suffix;
+                Suffix.Format("-%d", m_Worker);
+
+                auto dot = CString::npos;
+
+                for (size_t i = FileName.Size(); i-- > 1 && FileName[i] != '/';) {
+                    if (FileName[i] == '.') {
+                        dot = i;
+                        break;
+                    }
+                }
+
+                if (dot == CString::npos) {
+                    FileName << Suffix;
+                } else {
+                    FileName = FileName.SubString(0, dot) + Suffix + FileName.SubString(dot);
+                }
+            }
+
+            CString Labels;
+            Labels.Format("worker=\"%d\"", m_Worker);
+
+            const auto &Ring = RingCounters();
+
+            // A datagram carries the drop counter only if it is queued after the drops: a burst is read off the sockets.
+            for (auto &pListener : m_Listeners) {
+                uint32_t drops;
+
+                if (pListener->Socket.Drops(drops))
+                    CountDrops(*pListener, drops);
+            }
+
+            const auto &Assembler = m_Assembler.Counters();
+            const auto &Duplicates = m_Duplicates.Counters();
+
+            CString Text;
+
+            CMetrics::Counter(Text, "stream_datagrams_total", Labels, m_Counters.Datagrams);
+            CMetrics::Counter(Text, "stream_truncated_total", Labels, m_Counters.Truncated + Ring.Truncated);
+            CMetrics::Counter(Text, "stream_kernel_drops_total", Labels, m_Counters.KernelDrops);
+            CMetrics::Counter(Text, "stream_queued_total", Labels, m_Counters.Queued);
+            CMetrics::Counter(Text, "stream_shed_total", Labels, m_Counters.Shed);
+            CMetrics::Counter(Text, "stream_superseded_total", Labels, m_Counters.Superseded);
+            CMetrics::Counter(Text, "stream_batches_total", Labels, m_Counters.Batches);
+            CMetrics::Counter(Text, "stream_batch_packets_total", Labels, m_Counters.BatchPackets);
+            CMetrics::Counter(Text, "stream_batch_retries_total", Labels, m_Counters.BatchRetries);
+            CMetrics::Counter(Text, "stream_prepares_total", Labels, m_Counters.Prepares);
+            CMetrics::Counter(Text, "stream_statements_total", Labels, m_Counters.Statements);
+            CMetrics::Counter(Text, "stream_replies_total", Labels, m_Counters.Replies);
+            CMetrics::Counter(Text, "stream_uring_no_buffers_total", Labels, Ring.NoBuffers);
+            CMetrics::Counter(Text, "stream_uring_rearmed_total", Labels, Ring.Rearmed);
+            CMetrics::Counter(Text, "stream_uring_submits_total", Labels, Ring.Submits);
+            CMetrics::Counter(Text, "stream_uring_send_errors_total", Labels, Ring.SendErrors);
+            CMetrics::Counter(Text, "stream_reply_drops_total", Labels, m_Counters.ReplyDrops);
+            CMetrics::Counter(Text, "stream_acknowledgements_total", Labels, m_Counters.Acknowledgements);
+            CMetrics::Counter(Text, "stream_spooled_total", Labels, m_Counters.Spooled);
+            CMetrics::Counter(Text, "stream_spool_drops_total", Labels, m_Counters.SpoolDrops);
+            CMetrics::Counter(Text, "stream_replayed_total", Labels, m_Counters.Replayed);
+            CMetrics::Counter(Text, "stream_duplicate_hits_total", Labels, Duplicates.Hits);
+            CMetrics::Counter(Text, "stream_duplicate_misses_total", Labels, Duplicates.Misses);
+            CMetrics::Counter(Text, "stream_duplicate_resent_total", Labels, Duplicates.Resent);
+            CMetrics::Counter(Text, "stream_reassembly_packets_total", Labels, Assembler.Packets);
+            CMetrics::Counter(Text, "stream_reassembly_completed_total", Labels, Assembler.Completed);
+            CMetrics::Counter(Text, "stream_reassembly_expired_total", Labels, Assembler.Expired);
+            CMetrics::Counter(Text, "stream_reassembly_evicted_total", Labels, Assembler.Evicted);
+
+            CMetrics::Counter(Text, "stream_device_hits_total", Labels, m_Devices.Counters().Hits);
+            CMetrics::Counter(Text, "stream_device_misses_total", Labels, m_Devices.Counters().Misses);
+            CMetrics::Counter(Text, "stream_device_evicted_total", Labels, m_Devices.Counters().Evicted);
+            CMetrics::Counter(Text, "stream_coalesced_total", Labels, m_Devices.Counters().Suppressed);
+            CMetrics::Counter(Text, "stream_coalesce_keepalives_total", Labels, m_Devices.Counters().KeepAlives);
+
+            CMetrics::Counter(Text, "stream_downlink_commands_total", Labels, m_Downlink.Counters().Commands);
+            CMetrics::Counter(Text, "stream_downlink_duplicates_total", Labels, m_Downlink.Counters().Duplicates);
+            CMetrics::Counter(Text, "stream_downlink_rejected_total", Labels, m_Downlink.Counters().Rejected);
+            CMetrics::Counter(Text, "stream_downlink_packets_total", Labels, m_Downlink.Counters().Packets);
+            CMetrics::Counter(Text, "stream_downlink_retries_total", Labels, m_Downlink.Counters().Retries);
+            CMetrics::Counter(Text, "stream_downlink_acknowledged_total", Labels, m_Downlink.Counters().Acknowledged);
+            CMetrics::Counter(Text, "stream_downlink_failed_total", Labels, m_Downlink.Counters().Failed);
+            CMetrics::Counter(Text, "stream_downlink_expired_total", Labels, m_Downlink.Counters().Expired);
+
+            CMetrics::Counter(Text, "stream_throttled_peers_total", Labels, m_Limiter.Counters().Peers);
+            CMetrics::Counter(Text, "stream_rate_evicted_total", Labels, m_Limiter.Counters().Evicted);
+
+            Text << "# TYPE stream_throttled_devices_total counter\n";
+
+            for (int type = 0; type < 256; ++type) {
+                const auto count = m_Limiter.Counters().Devices[type];
+
+                if (count != 0) {
+                    Text << CString().Format("stream_throttled_devices_total{%s,type=\"0x%02X\"} %llu\n", Labels.c_str(),
+                                             type, (unsigned long long) count);
+                }
+            }
+
+            // The datagrams the kernel dropped because a socket buffer was full, next to the sizes of the buffers.
+            Text << "# TYPE stream_port_kernel_drops_total counter\n";
+
+            for (const auto &Drops : m_PortDrops) {
+                Text << CString().Format("stream_port_kernel_drops_total{%s,port=\"%d\"} %llu\n", Labels.c_str(),
+                                         (int) Drops.first, (unsigned long long) Drops.second);
+            }
+
+            Text << "# TYPE stream_socket_buffer_bytes gauge\n";
+
+            for (const auto &pListener : m_Listeners) {
+                int receive, send;
+
+                if (pListener->Socket.GetBufferSizes(receive, send)) {
+                    Text << CString().Format("stream_socket_buffer_bytes{%s,port=\"%d\",direction=\"receive\"} %d\n"
+                                             "stream_socket_buffer_bytes{%s,port=\"%d\",direction=\"send\"} %d\n",
+                                             Labels.c_str(), (int) pListener->Port, receive,
+                                             Labels.c_str(), (int) pListener->Port, send);
+                }
+            }
+
+            CMetrics::Gauge(Text, "stream_queue_packets", Labels, m_Queue.size());
+            CMetrics::Gauge(Text, "stream_inflight_packets", Labels, m_Counters.InFlight);
+            CMetrics::Gauge(Text, "stream_spool_packets", Labels, m_Spool.Count());
+            CMetrics::Gauge(Text, "stream_spool_segments", Labels, m_Spool.Segments());
+            CMetrics::Gauge(Text, "stream_reassembly_commands", Labels, m_Assembler.Count());
+            CMetrics::Gauge(Text, "stream_reassembly_bytes", Labels, m_Assembler.Memory());
+            CMetrics::Gauge(Text, "stream_duplicate_entries", Labels, m_Duplicates.Count());
+            CMetrics::Gauge(Text, "stream_devices", Labels, m_Devices.Count());
+            CMetrics::Gauge(Text, "stream_downlink_commands", Labels, m_Downlink.Count());
+
+            // Per shard: batches and packets sent, failed batches, packets taken over for failed shards, health.
+            const struct {
+                const char *Name;
+                uint64_t CShardCounters::*Counter;
+            } ShardSeries[] = {
+                { "stream_shard_batches_total", &CShardCounters::Batches },
+                { "stream_shard_packets_total", &CShardCounters::Packets },
+                { "stream_shard_failures_total", &CShardCounters::Failures },
+                { "stream_shard_failovers_total", &CShardCounters::Failovers },
+            };
+
+            for (const auto &Series : ShardSeries) {
+                Text << CString().Format("# TYPE %s counter\n", Series.Name);
+
+                for (const auto &pShard : m_Shards) {
+                    Text << CString().Format("%s{%s,shard=\"%s\"} %llu\n", Series.Name, Labels.c_str(), pShard->Name.c_str(),
+                                             (unsigned long long) (pShard->Counters.*Series.Counter));
+                }
+            }
+
+            Text << "# TYPE stream_shard_inflight_packets gauge\n";
+
+            for (const auto &pShard : m_Shards) {
+                Text << CString().Format("stream_shard_inflight_packets{%s,shard=\"%s\"} %llu\n", Labels.c_str(),
+                                         pShard->Name.c_str(), (unsigned long long) pShard->InFlight);
+            }
+
+            Text << "# TYPE stream_database_healthy gauge\n";
+
+            for (const auto &pShard : m_Shards) {
+                Text << CString().Format("stream_database_healthy{%s,shard=\"%s\"} %d\n", Labels.c_str(),
+                                         pShard->Name.c_str(), Usable(*pShard) ? 1 : 0);
+            }
+
+            m_Metrics.Format(Text, Labels);
+
+            // Quantiles and maximums cover one interval.
+            m_Metrics.Reset();
+            m_Metrics.Export(FileName, Text);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CStreamServer::ParseArguments(const CDatagramPeer &Peer, const CString &Protocol, const LPWAN::CFrame &Frame) {
+            const auto &Base64 = base64_encode(CString((LPCSTR) Frame.Data, Frame.Size));
+
+            return CString().MaxFormatSize(256 + Protocol.Size() + Base64.Size()).
+                    Format("('%s', '%s', '%s')",
+                           Protocol.c_str(),
+                           Peer.ToString().c_str(),
+                           Base64.c_str()
+            );
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CStreamServer::DecodeArguments(const CDatagramPeer &Peer, const CString &Protocol, const LPWAN::CFrame &Frame) {
+            static const char Digits[] = "0123456789abcdef";
+
+            CString Data;
+
+            Data.SetLength(Frame.PayloadSize * 2);
+            for (size_t i = 0; i < Frame.PayloadSize; ++i) {
+                Data.Data()[i * 2] = Digits[Frame.Payload[i] >> 4];
+                Data.Data()[i * 2 + 1] = Digits[Frame.Payload[i] & 0x0F];
+            }
+
+            const auto &Serial = PQQuoteLiteral(CString(Frame.Serial, Frame.SerialSize));
+            const auto &Command = DecodeCommand(Frame);
+
+            return CString().MaxFormatSize(256 + Protocol.Size() + Serial.Size() + Data.Size() + Command.Size()).
+                    Format("('%s', '%s', %d, %d, %d, %s, %d, %d, '\\x%s'::bytea, %s)",
+                           Protocol.c_str(),
+                           Peer.ToString().c_str(),
+                           Frame.Version,
+                           Frame.Parameters,
+                           Frame.DeviceType,
+                           Serial.c_str(),
+                           Frame.Command,
+                           Frame.Packet,
+                           Data.c_str(),
+                           Command.IsEmpty() ? "null" : PQQuoteLiteral(Command).c_str()
+            );
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CStreamServer::DecodeCommand(const LPWAN::CFrame &Frame) {
+            // Only a command that fits into one packet can be decoded here.
+            const auto single = LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET;
+
+            if ((Frame.Parameters & (single | LPWAN_TO_DEVICE)) != single)
+                return {};
+
+            LPWAN::CCommand Command;
+
+            if (!LPWAN::ParseCommand(Frame.Payload, Frame.PayloadSize, Command))
+                return {};
+
+            CString Json;
+
+            Json.Format(R"({"time": %u, "type": %d, "error": %d)", Command.Time, Command.Type, Command.Error);
+
+            LPWAN::CDeviceState State;
+            std::vector<LPWAN::CValue> Values;
+
+            if (LPWAN::ParseState(Command, State)) {
+                Json << CString().Format(R"(, "state": %d, "tariff": %d, "config_time": %u, "sync_type": %d, "sync_time": %u)",
+                                         State.State, State.Tariff, State.ConfigTime, State.SyncType, State.SyncTime);
+            } else if (LPWAN::ParseValues(Command, Values)) {
+                Json << R"(, "values": {)";
+
+                for (size_t i = 0; i < Values.size(); ++i) {
+                    const auto &Value = Values[i];
+                    const auto Name = LPWAN::ValueName(Value.Type);
+
+                    if (i > 0)
+                        Json << ", ";
+
+                    if (Name == nullptr) {
+                        Json << CString().Format(R"("%d": )", Value.Type);
+                    } else {
+                        Json << CString().Format(R"("%s": )", Name);
+                    }
+
+                    Json << (std::isfinite(Value.Value) ? CString().Format("%.*g", Value.Size == 4 ? 9 : 17, Value.Value) : CString("null"));
+                }
+
+                Json << "}";
+            }
+
+            Json << "}";
+
+            return Json;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        double CStreamServer::DeviceRate(BYTE Type) const {
+            // Other device types are limited as IoT devices.
+            switch (Type) {
+                case 0xA1:
+                    return m_RateAndroid;
+                case 0xA2:
+                    return m_RateIOS;
+                default:
+                    return m_RateIoT;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        template <class TProtocol>
+        void CStreamServer::Assemble(const CDatagramPeer &Peer, const typename TProtocol::CFrame &Frame, const std::string &Key) {
+            CString Command;
+            std::vector<std::string> Keys;
+
+            if (!m_Assembler.Add(Frame, Key, Command, Keys))
+                return;
+
+            // A retransmission of any packet of the command gets the reply to the whole command.
+            if (!Key.empty())
+                m_Duplicates.Link(Key, Keys);
+
+            // The whole command is a single packet now: the database gets one call instead of one per packet.
+            typename TProtocol::CReader Reader(Command.Data(), Command.Size());
+            typename TProtocol::CFrame Assembled;
+
+            if (Reader.Next(Assembled) == TProtocol::Ok) {
+                Enqueue(Peer, TProtocol::Name(), Assembled, Key);
+            } else {
+                m_Duplicates.Remove(Key);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Enqueue(const CDatagramPeer &Peer, const CString &Protocol, const LPWAN::CFrame &Frame, const std::string &Key) {
+            CStreamPacket Packet;
+
+            Packet.Protocol = Protocol;
+            Packet.Peer = Peer;
+            Packet.Key = Key;
+
+            Packet.Device.reserve(1 + Frame.SerialSize);
+            Packet.Device.push_back((char) Frame.DeviceType);
+            Packet.Device.append(Frame.Serial, Frame.SerialSize);
+
+            Packet.Parameters = Frame.Parameters;
+
+            // The command type follows the timestamp in the initial packet of a command.
+            if ((Frame.Parameters & LPWAN_FIRST_PACKET) == LPWAN_FIRST_PACKET && Frame.PayloadSize > 4)
+                Packet.Command = Frame.Payload[4];
+
+            if (m_DeviceCache > 0) {
+                const auto now = MonotonicTime();
+                auto pDevice = m_Devices.Update(Packet.Device, Peer, now);
+
+                if (pDevice != nullptr)
+                    m_Group->Owners.Set(*pDevice, m_Worker);
+
+                // A reply of the device carries the number of the command it answers.
+                if (m_Downlink.Count() != 0) {
+                    if ((Frame.Parameters & LPWAN_REPLY) == LPWAN_REPLY)
+                        m_Downlink.Acknowledge(Packet.Device, Frame.Command);
+
+                    if (m_Downlink.Waiting())
+                        m_Downlink.Resume(Packet.Device, now, m_OnDownlink);
+                }
+
+                // Current values that have not changed enough since the last ones forwarded never reach the database.
+                if (pDevice != nullptr && m_Coalesce && Packet.Command == LPWAN_COMMAND_VALUES &&
+                        Frame.Parameters == (LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET) && m_Devices.Coalesce(*pDevice, Frame, now)) {
+                    // The database never answers it, so the device gets the acknowledgement whatever "acknowledge" says.
+                    if (!Acknowledge(Frame, Packet, true))
+                        m_Duplicates.Remove(Key);
+                    return;
+                }
+            }
+
+            Packet.Decoded = m_Decode;
+            Packet.Arguments = m_Decode ? DecodeArguments(Peer, Protocol, Frame) : ParseArguments(Peer, Protocol, Frame);
+
+            if (m_Spool.Active())
+                Packet.Time = RealTime();
+
+            Packet.Received = m_Metrics.Start();
+
+            if (m_Queue.size() >= (size_t) m_QueueHigh) {
+                // The spool takes the overflow before anything is shed; retransmissions stay suppressed as pending.
+                if (m_Spool.Active() && Spool(Packet)) {
+                    Acknowledge(Frame, Packet);
+                    return;
+                }
+
+                Shed();
+
+                if (m_Queue.size() >= (size_t) m_QueueHigh) {
+                    m_Counters.Shed++;
+                    m_Duplicates.Remove(Key);
+                    return;
+                }
+            }
+
+            Acknowledge(Frame, Packet);
+
+            m_Queue.push_back(std::move(Packet));
+            m_Counters.Queued++;
+
+            // While no shard can take packets they wait in the queue (and the spool).
+            if ((m_BatchWindow <= 0 || m_Queue.size() >= (size_t) m_BatchSize) && Available()) {
+                Flush();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStreamServer::Acknowledge(const LPWAN::CFrame &Frame, CStreamPacket &Packet, bool Always) {
+            // A packet the stream process has taken is acknowledged at once; the database still gets it, but its
+            // reply is not sent.
+            if ((!Always && !m_Acknowledge.test(Packet.Command)) || Frame.Parameters != (LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET))
+                return false;
+
+            const auto &Ack = LPWAN::Acknowledge(Frame, Packet.Command);
+
+            if (Ack.IsEmpty())
+                return false;
+
+            if (!Packet.Key.empty())
+                m_Duplicates.Store(Packet.Key, Ack);
+
+            Reply(Packet.Peer, Ack);
+
+            Packet.Acknowledged = true;
+            m_Counters.Acknowledgements++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Shed() {
+            // Brings the queue down to the low watermark. State packets (0x01), replies to our requests and packets
+            // already acknowledged (the device will not send them again) are kept.
+            if (!m_Shedding) {
+                m_Shedding = true;
+                Log()->Notice(_T("[Stream] Ingest queue is full (%d packets, %d in flight), shedding packets."),
+                              (int) m_Queue.size(), (int) m_Counters.InFlight);
+            }
+
+            if (m_ShedPolicy == spNewest)
+                return;
+
+            size_t excess = m_Queue.size() - m_QueueLow;
+            std::vector<bool> shed(m_Queue.size(), false);
+
+            if (m_ShedPolicy == spSuperseded) {
+                // Current values (0x04) are superseded by a newer 0x04 from the same device.
+                std::unordered_set<std::string> latest;
+
+                for (size_t i = m_Queue.size(); i-- > 0 && excess > 0;) {
+                    const auto &Packet = m_Queue[i];
+
+                    if (Packet.Command != LPWAN_COMMAND_VALUES)
+                        continue;
+
+                    if (!latest.insert(Packet.Device).second) {
+                        shed[i] = true;
+                        excess--;
+                        m_Counters.Superseded++;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < m_Queue.size() && excess > 0; ++i) {
+                const auto &Packet = m_Queue[i];
+
+                if (shed[i] || Packet.Command == LPWAN_COMMAND_STATE || (Packet.Parameters & LPWAN_REPLY) == LPWAN_REPLY || Packet.Acknowledged)
+                    continue;
+
+                shed[i] = true;
+                excess--;
+            }
+
+            CStreamQueue Queue;
+
+            for (size_t i = 0; i < m_Queue.size(); ++i) {
+                if (shed[i]) {
+                    m_Counters.Shed++;
+                    m_Duplicates.Remove(m_Queue[i].Key);
+                } else {
+                    Queue.push_back(std::move(m_Queue[i]));
+                }
+            }
+
+            m_Queue.swap(Queue);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Release(CShard &Shard, size_t Count) {
+            Shard.InFlight -= Count;
+            m_Counters.InFlight -= Count;
+
+            if (m_Shedding && m_Queue.size() <= (size_t) m_QueueLow) {
+                m_Shedding = false;
+                Log()->Notice(_T("[Stream] Ingest queue is below the low watermark (%d packets)."), (int) m_Queue.size());
+            }
+
+            if (m_Queue.size() >= (size_t) m_BatchSize && Available())
+                Flush();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::OpenSpool() {
+            m_Spool.Close();
+
+            if (m_SpoolDirectory.IsEmpty())
+                return;
+
+            CString Directory(m_SpoolDirectory);
+
+            if (Directory.front() != '/')
+                Directory = Config()->Prefix() + Directory;
+
+            // One set of segments per worker: each is written and replayed by a single process.
+            try {
+                m_Spool.Open(Directory, CString().Format("stream-%d", m_Worker), (size_t) m_SpoolSegment * 1024 * 1024,
+                             (size_t) m_SpoolSize * 1024 * 1024);
+                Log()->Debug(APP_LOG_DEBUG_CORE, _T("spool: %s"), Directory.c_str());
+            } catch (Delphi::Exception::Exception &E) {
+                Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStreamServer::Spool(const CStreamPacket &Packet) {
+            // Record: format, decoded, parameters, command, protocol size, protocol, device size, device, address,
+            // port, arguments. Records of the first format have no format and protocol and start with decoded (0 or 1).
+            CString Data;
+
+            Data.Append((char) SPOOL_RECORD_FORMAT);
+            Data.Append((char) Packet.Decoded);
+            Data.Append((char) Packet.Parameters);
+            Data.Append((char) Packet.Command);
+            Data.Append((char) Packet.Protocol.Size());
+            Data.Append(Packet.Protocol.Data(), Packet.Protocol.Size());
+            Data.Append((char) Packet.Device.size());
+            Data.Append(Packet.Device.data(), Packet.Device.size());
+            Data.Append((const char *) &Packet.Peer.Address.sin_addr, sizeof(in_addr));
+            Data.Append((const char *) &Packet.Peer.Address.sin_port, sizeof(in_port_t));
+            Data.Append(Packet.Arguments);
+
+            if (m_Spool.Empty()) {
+                Log()->Notice(_T("[Stream] Spooling packets (%d queued, %d in flight)."),
+                              (int) m_Queue.size(), (int) m_Counters.InFlight);
+            }
+
+            if (!m_Spool.Write(Data.Data(), Data.Size(), Packet.Time)) {
+                m_Counters.SpoolDrops++;
+                return false;
+            }
+
+            m_Counters.Spooled++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Fail(CShard &Shard, const CStreamBatch &Batch) {
+            // The shard gets no more batches until a probe gets through.
+            Shard.Counters.Failures++;
+
+            Unavailable(Shard);
+
+            for (const auto &Packet : Batch) {
+                // Without the spool the device retransmits the packet.
+                if (!m_Spool.Active() || !Spool(Packet))
+                    m_Duplicates.Remove(Packet.Key);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Replay(uint64_t Now) {
+            // Spooled packets return to the queue at spool_rate per second while the database keeps up with it.
+            const auto elapsed = Now - m_SpoolTime;
+
+            m_SpoolTime = Now;
+
+            if (!Available())
+                return;
+
+            m_SpoolCredit = std::min(m_SpoolCredit + (double) m_SpoolRate * elapsed / 1000, (double) m_SpoolRate);
+
+            CString Data;
+            uint64_t Time;
+
+            while (m_SpoolCredit >= 1 && !m_Spool.Empty() && m_Queue.size() < (size_t) m_QueueLow &&
+                    m_Counters.InFlight < (uint64_t) m_InFlightMax) {
+
+                if (!m_Spool.Read(Data, Time))
+                    continue;
+
+                m_SpoolCredit -= 1;
+
+                auto p = (const BYTE *) Data.Data();
+                const auto end = p + Data.Size();
+                const auto format = p < end && *p == SPOOL_RECORD_FORMAT;
+
+                const size_t address = sizeof(in_addr) + sizeof(in_port_t);
+
+                if (format)
+                    p++;
+
+                if (end - p < 4)
+                    continue;
+
+                CStreamPacket Packet;
+
+                // Records of the first format were all LPWAN.
+                Packet.Protocol = LPWAN::CProtocol::Name();
+                Packet.Decoded = p[0] != 0;
+                Packet.Parameters = p[1];
+                Packet.Command = p[2];
+                Packet.Time = Time;
+                Packet.Received = m_Metrics.Start();
+
+                p += 3;
+
+                if (format) {
+                    if (end - p < 2 + p[0])
+                        continue;
+
+                    Packet.Protocol = CString((const char *) p + 1, p[0]);
+                    p += 1 + p[0];
+                }
+
+                if ((size_t) (end - p) < 1 + p[0] + address)
+                    continue;
+
+                Packet.Device.assign((const char *) p + 1, p[0]);
+                p += 1 + p[0];
+
+                // The handle stays closed: the reply is of no use to the device this late.
+                Packet.Peer.Address.sin_family = AF_INET;
+                memcpy(&Packet.Peer.Address.sin_addr, p, sizeof(in_addr));
+                memcpy(&Packet.Peer.Address.sin_port, p + sizeof(in_addr), sizeof(in_port_t));
+
+                p += address;
+
+                Packet.Arguments = CString((const char *) p, end - p);
+
+                m_Queue.push_back(std::move(Packet));
+                m_Counters.Replayed++;
+            }
+
+            if (m_Spool.Empty()) {
+                Log()->Notice(_T("[Stream] Spool is drained (%llu packets replayed)."), (unsigned long long) m_Counters.Replayed);
+            }
+
+            Flush();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Flush() {
+            // Packets wait in the queue until a shard has a session and there is room in flight.
+            if (!Available())
+                return;
+
+            // The shard is chosen when the packet leaves the queue, so queued packets follow a failover too.
+            std::vector<CStreamBatchPtr> Batches(m_Shards.size());
+
+            // Packets of shards that have not logged in yet: they keep their place, the others go ahead of them.
+            CStreamQueue Waiting;
+
+            size_t pending = 0;
+            const auto now = m_Metrics.Start();
+
+            while (!m_Queue.empty() && m_Counters.InFlight + pending < (uint64_t) m_InFlightMax) {
+                auto &Packet = m_Queue.front();
+
+                const auto index = Route(Packet.Device);
+
+                if (index == -1) {
+                    Waiting.push_back(std::move(Packet));
+                    m_Queue.pop_front();
+                    continue;
+                }
+
+                auto &pBatch = Batches[index];
+
+                if (pBatch == nullptr) {
+                    pBatch = std::make_shared<CStreamBatch>();
+                    pBatch->reserve(std::min(m_Queue.size(), (size_t) m_BatchSize));
+                }
+
+                if (now != 0 && Packet.Received != 0)
+                    m_Metrics.Record(stQueue, now - Packet.Received);
+
+                pBatch->push_back(std::move(Packet));
+                m_Queue.pop_front();
+
+                pending++;
+
+                if (pBatch->size() >= (size_t) m_BatchSize) {
+                    pending -= pBatch->size();
+
+                    Dispatch(*m_Shards[index], pBatch);
+                    pBatch.reset();
+
+                    if (!Available())
+                        break;
+                }
+            }
+
+            for (size_t index = 0; index < Batches.size(); ++index) {
+                const auto &pBatch = Batches[index];
+
+                if (pBatch == nullptr)
+                    continue;
+
+                if (Usable(*m_Shards[index])) {
+                    Dispatch(*m_Shards[index], pBatch);
+                    continue;
+                }
+
+                // The shard has failed while the batch was collected: its packets go back to the queue in order.
+                for (auto it = pBatch->rbegin(); it != pBatch->rend(); ++it)
+                    m_Queue.push_front(std::move(*it));
+            }
+
+            for (auto it = Waiting.rbegin(); it != Waiting.rend(); ++it)
+                m_Queue.push_front(std::move(*it));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Dispatch(CShard &Shard, const CStreamBatchPtr &Batch) {
+            m_Counters.Batches++;
+            m_Counters.BatchPackets += Batch->size();
+
+            Shard.Counters.Batches++;
+            Shard.Counters.Packets += Batch->size();
+
+            Log()->Debug(APP_LOG_DEBUG_CORE, _T("stream batch: %d packet(s) to %s, average: %.2f, statements per packet: %.2f, queued: %d, in flight: %d"),
+                         (int) Batch->size(), Shard.Name.c_str(), (double) m_Counters.BatchPackets / m_Counters.Batches,
+                         (double) m_Counters.Statements / m_Counters.BatchPackets, (int) m_Queue.size(), (int) m_Counters.InFlight);
+
+            Parse(Shard, Batch);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CStreamServer::SelectSession(const CShard &Shard) {
+            // The session pinned to the fewest pooled connections.
+            int index = 0;
+            size_t min = SIZE_MAX;
+
+            for (int i = 0; i < Shard.Sessions.Count(); ++i) {
+                size_t count = 0;
+
+                for (const auto &pinned : Shard.Pinned) {
+                    if (pinned.second == Shard.Sessions[i])
+                        count++;
+                }
+
+                if (count < min) {
+                    min = count;
+                    index = i;
+                }
+            }
+
+            return Shard.Sessions[index];
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStreamServer::DataError(CPQResult *AResult) {
+            // Data exceptions, integrity violations and errors raised by stream.parse() itself belong to the packet.
+            const auto State = AResult->GetErrorField(PG_DIAG_SQLSTATE);
+
+            if (State == nullptr)
+                return false;
+
+            return strncmp(State, "22", 2) == 0 || strncmp(State, "23", 2) == 0 || strncmp(State, "P0", 2) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStreamServer::MissingStatement(CPQResult *AResult) {
+            // invalid_sql_statement_name: EXECUTE of a statement the connection has not prepared.
+            const auto State = AResult->GetErrorField(PG_DIAG_SQLSTATE);
+
+            return State != nullptr && strcmp(State, "26000") == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CStreamServer::Statement(const CShard &Shard, const CStreamPacket &Packet) const {
+            CString SQL;
+
+            if (m_Prepared) {
+                SQL.Format("EXECUTE %s_%d", Packet.Decoded ? DECODE_STATEMENT : PARSE_STATEMENT, Shard.Generation);
+            } else {
+                SQL = Packet.Decoded ? "SELECT * FROM stream.parse_lpwan" : "SELECT * FROM stream.parse";
+            }
+
+            SQL << Packet.Arguments << ";";
+
+            return SQL;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Prepare(CShard &Shard, const CStreamBatchPtr &Batch, int Attempt) {
+            // A query of its own: it commits, so the session it sets survives a batch that a bad packet aborts on the
+            // same connection. The batch is sent again once the connection is ready.
+            const auto &Session = SelectSession(Shard);
+
+            CStringList SQL;
+
+            api::authorize(SQL, Session);
+            api::set_area(SQL);
+
+            // Prepared statements live as long as the connection; the pool gives no way to choose it, so
+            // whichever connection runs this query gets every statement named like ours (stream_parse_<N>,
+            // stream_parse_lpwan_<N>) dropped, whoever prepared it. Other statements are left alone. Both
+            // statements are prepared, so raw and decoded batches do not take turns re-preparing.
+            SQL.Add("DO $$DECLARE n text; BEGIN "
+                    "FOR n IN SELECT name FROM pg_prepared_statements WHERE name ~ '^(" PARSE_STATEMENT "|" DECODE_STATEMENT ")_[0-9]+$' "
+                    "LOOP EXECUTE format('DEALLOCATE %I', n); END LOOP; END$$;");
+
+            SQL.Add(CString().Format("PREPARE %s_%d (text, text, integer, integer, integer, text, integer, integer, bytea, jsonb) AS "
+                                     "SELECT * FROM stream.parse_lpwan($1, $2, $3, $4, $5, $6, $7, $8, $9, $10);", DECODE_STATEMENT, Shard.Generation));
+
+            SQL.Add(CString().Format("PREPARE %s_%d (text, text, text) AS SELECT * FROM stream.parse($1, $2, $3);", PARSE_STATEMENT, Shard.Generation));
+
+            // The backend process identifies the connection for as long as it keeps the statements.
+            SQL.Add("SELECT pg_backend_pid();");
+
+            auto pShard = &Shard;
+
+            auto OnExecuted = [this, pShard, Session, Batch, Attempt](CPQPollQuery *APollQuery) {
+
+                CPQResult *pResult = nullptr;
+
+                Release(*pShard, Batch->size());
+
+                try {
+                    for (int I = 0; I < APollQuery->Count(); I++) {
+                        pResult = APollQuery->Results(I);
+
+                        if (pResult->ExecStatus() != PGRES_TUPLES_OK && pResult->ExecStatus() != PGRES_COMMAND_OK) {
+                            Fail(*pShard, *Batch);
+                            throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                        }
+                    }
+
+                    if (pResult != nullptr && pResult->nTuples() == 1)
+                        pShard->Pinned[(int) strtol(pResult->GetValue(0, 0), nullptr, 10)] = Session;
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(*pShard, E);
+                    return;
+                }
+
+                Parse(*pShard, Batch, Attempt);
+            };
+
+            auto OnException = [this, pShard, Batch](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                Fail(*pShard, *Batch);
+                Release(*pShard, Batch->size());
+                DoError(*pShard, E);
+            };
+
+            m_Counters.Prepares++;
+            m_Counters.Statements += SQL.Count();
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException, Shard.Name);
+                m_Counters.InFlight += Batch->size();
+                Shard.InFlight += Batch->size();
+            } catch (Delphi::Exception::Exception &E) {
+                Fail(Shard, *Batch);
+                DoError(Shard, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Parse(CShard &Shard, const CStreamBatchPtr &Batch, int Prepared) {
+
+            // With prepared statements a connection keeps the session it was authorized with by Prepare(); without
+            // them every batch authorizes in front of its packets.
+            const auto &Session = m_Prepared ? CString() : SelectSession(Shard);
+
+            // Pool wait and execution are one stage: the pool does not report when it hands the query to a connection.
+            const auto sent = m_Metrics.Start();
+
+            CStringList SQL;
+
+            if (!Session.IsEmpty()) {
+                api::authorize(SQL, Session);
+                api::set_area(SQL);
+            }
+
+            for (const auto &Packet : *Batch) {
+                SQL.Add(Statement(Shard, Packet));
+            }
+
+            // Results of the session statements come first, then one per packet in the batch.
+            const auto preamble = SQL.Count() - (int) Batch->size();
+
+            auto pShard = &Shard;
+
+            auto OnExecuted = [this, pShard, Batch, Prepared, preamble, sent](CPQPollQuery *APollQuery) {
+
+                CPQResult *pResult;
+                CString Result;
+
+                const auto now = m_Metrics.Start();
+
+                if (now != 0 && sent != 0) {
+                    m_Metrics.Record(stDatabase, now - sent);
+
+                    for (const auto &Packet : *Batch) {
+                        if (Packet.Received != 0)
+                            m_Metrics.Record(stTotal, now - Packet.Received);
+                    }
+                }
+
+                if (!pShard->Healthy) {
+                    pShard->Healthy = true;
+                    Log()->Notice(_T("[Stream] Database \"%s\" is available again (%llu packets spooled)."),
+                                  pShard->Name.c_str(), (unsigned long long) m_Spool.Count());
+                }
+
+                Release(*pShard, Batch->size());
+
+                try {
+                    for (int I = 0; I < APollQuery->Count(); I++) {
+                        pResult = APollQuery->Results(I);
+
+                        if (pResult->ExecStatus() != PGRES_TUPLES_OK && pResult->ExecStatus() != PGRES_COMMAND_OK) {
+                            // The pooled connection has not seen the statements yet: prepare them and try again. Every
+                            // round prepares one more connection of the pool, so it ends unless the pool keeps churning.
+                            if (m_Prepared && MissingStatement(pResult) && Prepared < PREPARE_ATTEMPTS) {
+                                Prepare(*pShard, Batch, Prepared + 1);
+                                return;
+                            }
+
+                            if (I < preamble || !DataError(pResult)) {
+                                // The session, the statements or the connection failed, not the packets.
+                                Fail(*pShard, *Batch);
+                                throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                            }
+
+                            if (Batch->size() > 1) {
+                                // One bad packet aborts the whole batch: resend them one by one.
+                                Log()->Error(APP_LOG_ERR, 0, "%s", pResult->GetErrorMessage());
+
+                                m_Counters.BatchRetries++;
+
+                                for (const auto &Packet : *Batch) {
+                                    Parse(*pShard, std::make_shared<CStreamBatch>(1, Packet));
+                                }
+
+                                return;
+                            }
+
+                            // Let the device retransmit the packet that failed.
+                            m_Duplicates.Remove(Batch->front().Key);
+
+                            throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                        }
+
+                        if (I < preamble)
+                            continue;
+
+                        const auto &Packet = Batch->at(I - preamble);
+
+                        if (!Packet.Acknowledged && !pResult->GetIsNull(0, 0)) {
+                            Result = base64_decode(pResult->GetValue(0, 0));
+
+                            if (!Packet.Key.empty())
+                                m_Duplicates.Store(Packet.Key, Result);
+
+                            if (Packet.Peer.Handle != -1)
+                                Reply(Packet.Peer, Result);
+                        }
+                    }
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(*pShard, E);
+                }
+            };
+
+            auto OnException = [this, pShard, Batch, sent](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                m_Metrics.Stop(stDatabase, sent);
+
+                Fail(*pShard, *Batch);
+                Release(*pShard, Batch->size());
+                DoError(*pShard, E);
+            };
+
+            m_Counters.Statements += SQL.Count();
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException, Shard.Name);
+                m_Counters.InFlight += Batch->size();
+                Shard.InFlight += Batch->size();
+            } catch (Delphi::Exception::Exception &E) {
+                Fail(Shard, *Batch);
+                DoError(Shard, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Reply(const CDatagramPeer &Source, const CString &Data) {
+            const auto pListener = FindListener(Source.Handle);
+
+            // The packet came in on a socket that has been closed since, and its port is no longer listened on.
+            if (pListener == nullptr) {
+                m_Counters.ReplyDrops++;
+                return;
+            }
+
+            const CDatagramPeer Peer(pListener->Socket.Handle(), Source.Address);
+
+            if (m_StreamLog) {
+                const auto &Address = Peer.ToString();
+                Log()->Stream("[%s] Reply:", Address.c_str());
+                Debug(Address, Data.Data(), Data.Size());
+            }
+
+            if (m_Capture.Active())
+                Capture(Peer, Data.Data(), Data.Size(), false);
+
+            m_Counters.Replies++;
+
+            if (pListener->Ring.Active()) {
+                if (!pListener->Ring.Send(Peer, Data))
+                    m_Counters.ReplyDrops++;
+                return;
+            }
+
+            if (m_mmsg) {
+                if (!m_Writer.Add(Peer, Data))
+                    m_Counters.ReplyDrops++;
+                return;
+            }
+
+            const auto start = m_Metrics.Start();
+
+            // The socket peer is overwritten by every datagram, so the reply goes to the address saved with the packet.
+            if (::sendto(Peer.Handle, Data.Data(), Data.Size(), 0, (sockaddr *) &Peer.Address, sizeof(sockaddr_in)) < 0) {
+                m_Counters.ReplyDrops++;
+                Log()->Error(APP_LOG_ERR, errno, _T("[%s] sendto failed"), Peer.ToString().c_str());
+            }
+
+            m_Metrics.Stop(stSend, start);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::SendReplies() {
+            for (auto &pListener : m_Listeners) {
+                if (pListener->Ring.Pending() == 0)
+                    continue;
+
+                const auto start = m_Metrics.Start();
+
+                if (pListener->Ring.Submit() == -1)
+                    Log()->Error(APP_LOG_ERR, errno, _T("io_uring_enter failed"));
+
+                m_Metrics.Stop(stSend, start);
+            }
+
+            if (m_Writer.Count() == 0)
+                return;
+
+            const auto start = m_Metrics.Start();
+            m_Writer.Flush();
+            m_Metrics.Stop(stSend, start);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Downlink(const CString &Payload) {
+            // id,device type,serial number,command data in hex; the serial number may hold commas itself.
+            const auto first = Payload.Find(',');
+            const auto second = first == CString::npos ? CString::npos : Payload.Find(',', first + 1);
+
+            size_t last = CString::npos;
+            for (size_t i = Payload.Size(); second != CString::npos && i-- > second + 1;) {
+                if (Payload[i] == ',') {
+                    last = i;
+                    break;
+                }
+            }
+
+            if (last == CString::npos) {
+                Log()->Error(APP_LOG_ERR, 0, "[Stream] Invalid command notification: %s", Payload.c_str());
+                return;
+            }
+
+            const auto &Type = Payload.SubString(first + 1, second - first - 1);
+
+            char *end;
+            const auto type = strtol(Type.c_str(), &end, 0);
+
+            const size_t length = Payload.Size() - last - 1;
+
+            if (end == Type.c_str() || type < 0 || type > 255 || length % 2 != 0) {
+                Log()->Error(APP_LOG_ERR, 0, "[Stream] Invalid command notification: %s", Payload.c_str());
+                return;
+            }
+
+            CString Data;
+            Data.SetLength(length / 2);
+
+            for (size_t i = 0; i < Data.Size(); ++i) {
+                const char hex[3] = { Payload[last + 1 + i * 2], Payload[last + 2 + i * 2], 0 };
+
+                Data.Data()[i] = (char) strtoul(hex, &end, 16);
+
+                if (end != hex + 2) {
+                    Log()->Error(APP_LOG_ERR, 0, "[Stream] Invalid command notification: %s", Payload.c_str());
+                    return;
+                }
+            }
+
+            const auto &Serial = Payload.SubString(second + 1, last - second - 1);
+
+            m_Downlink.Add(Payload.SubString(0, first), (BYTE) type, std::string(Serial.c_str(), Serial.Size()), Data,
+                           MonotonicTime(), m_OnDownlink);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStreamServer::SendCommand(const std::string &Device, const std::vector<CString> &Packets) {
+            const auto pDevice = m_Devices.Find(Device);
+
+            if (pDevice == nullptr || pDevice->Peer.Handle == -1)
+                return false;
+
+            for (const auto &Packet : Packets)
+                Reply(pDevice->Peer, Packet);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoTimer(CPollEventHandler *AHandler) {
+            uint64_t exp;
+
+            auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
+            pTimer->Read(&exp, sizeof(uint64_t));
+
+            try {
+                const auto now = MonotonicTime();
+
+                if (m_Reassembly)
+                    m_Assembler.Expire(now);
+
+                if (m_DuplicateWindow > 0)
+                    m_Duplicates.Expire(now);
+
+                if (!m_Spool.Empty())
+                    Replay(now);
+
+                // Bounds what a crash of the host can take from the spool to the last spool_sync milliseconds.
+                if (m_SpoolSync > 0 && m_Spool.Active() && now - m_SpoolSyncTime >= (uint64_t) m_SpoolSync) {
+                    m_SpoolSyncTime = now;
+                    m_Spool.Sync();
+                }
+
+                if (m_Downlink.Count() != 0) {
+                    m_Downlink.Expire(now, m_OnDownlink);
+                    SendReplies();
+                }
+
+                for (auto &pShard : m_Shards) {
+                    if (!pShard->Healthy && !pShard->Probing && pShard->Sessions.Count() > 0)
+                        Probe(*pShard);
+                }
+
+                if (!m_DownlinkChannel.IsEmpty() && m_DownlinkHeartbeat > 0)
+                    CheckListen(now);
+
+                Flush();
+
+                if (m_Metrics.Active() && now >= m_StatsTime) {
+                    m_StatsTime = now + m_StatsInterval;
+                    ExportStats();
+                }
+
+                Heartbeat(AHandler->TimeStamp());
+            } catch (Delphi::Exception::Exception &E) {
+                DoServerEventHandlerException(AHandler, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::CheckListen(uint64_t Now) {
+            // The LISTEN lives on a pooled connection, which the pool may close or replace at any time. A connection
+            // that has not heard its own ping for three intervals has lost it: listen again on whichever connection
+            // the pool gives.
+            for (auto &pShard : m_Shards) {
+                if (pShard->Heard == 0 || !pShard->Healthy)
+                    continue;
+
+                if (Now - pShard->Heard > (uint64_t) m_DownlinkHeartbeat * 3) {
+                    Log()->Error(APP_LOG_WARN, 0, _T("[Stream] Channel \"%s\" (%s) is silent, listening again."),
+                                 m_DownlinkChannel.c_str(), pShard->Name.c_str());
+
+                    pShard->Heard = Now;
+                    pShard->Pinged = Now;
+
+                    Listen(*pShard);
+                } else if (Now - pShard->Pinged >= (uint64_t) m_DownlinkHeartbeat) {
+                    pShard->Pinged = Now;
+                    Ping(*pShard);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoError(const Delphi::Exception::Exception &E) {
+            const auto retry = Now() + (CDateTime) m_HeartbeatInterval / MSecsPerDay;
+
+            for (auto &pShard : m_Shards)
+                pShard->AuthDate = retry;
+
+            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoError(CShard &Shard, const Delphi::Exception::Exception &E) {
+            Shard.AuthDate = Now() + (CDateTime) m_HeartbeatInterval / MSecsPerDay;
+
+            // A shard that has never logged in cannot take packets: its devices go to the others meanwhile.
+            if (Shard.Sessions.Count() == 0)
+                Unavailable(Shard);
+
+            Log()->Error(APP_LOG_ERR, 0, "[%s] %s", Shard.Name.c_str(), E.what());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoSocketRead(CPollEventHandler *AHandler, CListener *AListener) {
+            try {
+                // Level-triggered: whatever is left after a few rounds is read on the next event.
+                for (int round = 0; round < 4; ++round) {
+                    if (ReadSocket(*AListener) < (m_mmsg ? m_mmsgCount : 1))
+                        break;
+                }
+
+                SendReplies();
+            } catch (Delphi::Exception::Exception &E) {
+                DoServerEventHandlerException(AHandler, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoRingRead(CPollEventHandler *AHandler, CListener *AListener) {
+            try {
+                // The datagrams are already in the buffers of the ring: no system call per read.
+                if (AListener->Ring.Read(AListener->OnDatagram) == -1)
+                    Log()->Error(APP_LOG_ERR, errno, _T("io_uring recvmsg failed"));
+
+                CountDrops(*AListener, AListener->Ring.Drops());
+
+                SendReplies();
+            } catch (Delphi::Exception::Exception &E) {
+                DoServerEventHandlerException(AHandler, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CStreamServer::ReadSocket(CListener &Listener) {
+            const auto Handle = Listener.Socket.Handle();
+            const auto Receive = Listener.Receive;
+
+            const auto start = m_Metrics.Start();
+
+            if (!m_mmsg) {
+                CDatagramPeer Peer(Handle, {});
+
+                const auto size = Listener.Socket.ReadFrom(m_Datagram.data(), m_Datagram.size(), Peer.Address);
+
+                m_Metrics.Stop(stReceive, start);
+
+                if (size <= 0) {
+                    if (size < 0)
+                        Log()->Error(APP_LOG_ERR, errno, _T("recvfrom failed"));
+                    return 0;
+                }
+
+                if ((size_t) size > m_Datagram.size()) {
+                    m_Counters.Truncated++;
+                } else {
+                    (this->*Receive)(Peer, m_Datagram.data(), size);
+                }
+
+                return 1;
+            }
+
+            const auto count = m_Reader.Read(Handle);
+
+            m_Metrics.Stop(stReceive, start);
+
+            if (count < 0) {
+                Log()->Error(APP_LOG_ERR, errno, _T("recvmmsg failed"));
+            }
+
+            for (int i = 0; i < count; ++i) {
+                if (m_Reader.Truncated(i)) {
+                    m_Counters.Truncated++;
+                    continue;
+                }
+
+                (this->*Receive)(m_Reader.Peer(Handle, i), m_Reader.Data(i), m_Reader.Size(i));
+            }
+
+            uint32_t drops;
+
+            if (count > 0 && m_Reader.Drops(drops))
+                CountDrops(Listener, drops);
+
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::CountDrops(CListener &Listener, uint32_t Drops) {
+            // The kernel counter of the socket is a running 32-bit value: only its growth is added. A datagram carries
+            // the value from when it was queued, which may be older than one read with SO_MEMINFO.
+            const auto delta = (int32_t) (Drops - Listener.Drops);
+
+            if (delta <= 0)
+                return;
+
+            Listener.Drops = Drops;
+
+            m_Counters.KernelDrops += delta;
+            m_PortDrops[Listener.Port] += delta;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        template <class TProtocol>
+        void CStreamServer::Receive(const CDatagramPeer &Peer, const BYTE *Data, size_t Size) {
+            typename TProtocol::CReader Reader(Data, Size);
+            typename TProtocol::CFrame Frame;
+
+            std::string Key;
+            CString Cached;
+
+            m_Counters.Datagrams++;
+
+            if (m_Capture.Active())
+                Capture(Peer, Data, Size, true);
+
+            // Flooding peers and devices are cut off here, before any work is done for their packets.
+            const auto now = m_Limiter.Active() ? MonotonicTime() : 0;
+
+            if (now != 0 && m_RatePeer > 0 && !m_Limiter.Peer(CRateLimiter::Key(Peer.Address), m_RatePeer, m_RatePeer * m_RateBurst, now))
+                return;
+
+            // Without the stream log nothing is formatted: the peer string and dumps are built only when enabled.
+            const auto &Address = m_StreamLog ? Peer.ToString() : CString();
+
+            if (m_StreamLog) {
+                Log()->Stream("[%s] DoRead:", Address.c_str());
+                Debug(Address, Data, Size);
+            }
+
+            for (;;) {
+                const auto start = m_Metrics.Start();
+                const auto status = Reader.Next(Frame);
+
+                m_Metrics.Stop(stFraming, start);
+
+                switch (status) {
+                    case TProtocol::Ok:
+                        if (m_StreamLog) {
+                            Log()->Stream("[%s] Data:", Address.c_str());
+                            Debug(Address, Frame.Data, Frame.Size);
+                        }
+
+                        if (now != 0) {
+                            const auto type = TProtocol::DeviceType(Frame);
+                            const auto rate = DeviceRate(type);
+
+                            if (rate > 0 && !m_Limiter.Device(CRateLimiter::Key(Frame), type, rate, rate * m_RateBurst, now)) {
+                                if (m_StreamLog)
+                                    Log()->Stream("[%s] [%d] Throttled.", Address.c_str(), (int) Frame.Offset);
+                                continue;
+                            }
+                        }
+
+                        if (m_DuplicateWindow > 0) {
+                            Key = CDuplicateCache::Key(Frame);
+
+                            // A retransmission: resend the cached reply, if any, without touching the database.
+                            switch (m_Duplicates.Check(Key, MonotonicTime(), Cached)) {
+                                case dsNew:
+                                    break;
+                                case dsPending:
+                                    continue;
+                                case dsReplied:
+                                    Reply(Peer, Cached);
+                                    continue;
+                            }
+                        }
+
+                        if (m_Reassembly && !TProtocol::Single(Frame)) {
+                            Assemble<TProtocol>(Peer, Frame, Key);
+                            continue;
+                        }
+
+                        Enqueue(Peer, TProtocol::Name(), Frame, Key);
+                        continue;
+
+                    case TProtocol::End:
+                        return;
+
+                    case TProtocol::IncorrectLength:
+                        m_Metrics.Drop(drIncorrectLength, TProtocol::DeviceType(Frame));
+
+                        if (m_StreamLog) {
+                            Log()->Stream("[%s] Incorrect:", Address.c_str());
+                            Debug(Address, Frame.Data, Frame.Size);
+
+                            Log()->Stream("[%s] [%d:%d:%d] [%d] Incorrect length.", Address.c_str(), (int) Size, (int) Frame.Offset, (int) Frame.Size, (int) Frame.Length);
+                        }
+                        return;
+
+                    case TProtocol::InvalidCRC:
+                        m_Metrics.Drop(drInvalidCRC, TProtocol::DeviceType(Frame));
+
+                        if (m_StreamLog) {
+                            Log()->Stream("[%s] [%d] [%d] Invalid CRC.", Address.c_str(), (int) Frame.CRC, (int) TProtocol::Checksum(Frame));
+                        }
+                        return;
+
+                    case TProtocol::InvalidHeader:
+                        m_Metrics.Drop(drInvalidHeader, TProtocol::DeviceType(Frame));
+
+                        if (m_StreamLog) {
+                            Log()->Stream("[%s] [%d] Invalid header.", Address.c_str(), (int) Frame.Offset);
+                        }
+                        continue;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::OpenCapture() {
+            m_LocalHandle = -1;
+
+            if (m_CaptureFile.IsEmpty()) {
+                m_Capture.Close();
+                return;
+            }
+
+            CString FileName(m_CaptureFile);
+
+            if (FileName.front() != '/')
+                FileName = Config()->Prefix() + FileName;
+
+            // One ring per worker: the records are written without locks by a single process.
+            if (m_Workers > 1)
+                FileName << "." << m_Worker;
+
+            try {
+                m_Capture.Open(FileName, (size_t) m_CaptureSize * 1024 * 1024, m_CaptureSnapLength);
+                Log()->Debug(APP_LOG_DEBUG_CORE, _T("packet capture: %s"), FileName.c_str());
+            } catch (Delphi::Exception::Exception &E) {
+                Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Capture(const CDatagramPeer &Peer, const void *Data, size_t Size, bool Inbound) {
+            if (m_LocalHandle != Peer.Handle) {
+                socklen_t length = sizeof(m_LocalAddress);
+
+                m_LocalAddress = {};
+                if (::getsockname(Peer.Handle, (sockaddr *) &m_LocalAddress, &length) == 0)
+                    m_LocalHandle = Peer.Handle;
+            }
+
+            if (Inbound) {
+                m_Capture.Write(Peer.Address, m_LocalAddress, Data, Size);
+            } else {
+                m_Capture.Write(m_LocalAddress, Peer.Address, Data, Size);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoException(CTCPConnection *AConnection, const Delphi::Exception::Exception &E) {
+            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+            sig_reopen = 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
+            CPQResult *pResult;
 
             try {
                 for (int I = 0; I < APollQuery->Count(); I++) {
@@ -456,13 +2595,42 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CStreamServer::Debug(CSocketHandle *Socket, const CString &Stream) {
+        void CStreamServer::DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify) {
+            if (m_DownlinkChannel.IsEmpty() || m_DownlinkChannel != ANotify->relname)
+                return;
+
+            CShard *pShard = nullptr;
+
+            for (auto &Shard : m_Shards) {
+                if (Shard->Listener == AConnection)
+                    pShard = Shard.get();
+            }
+
+            if (pShard == nullptr)
+                return;
+
+            pShard->Heard = MonotonicTime();
+
+            // A ping.
+            if (ANotify->extra == nullptr || ANotify->extra[0] == '\0')
+                return;
+
+            try {
+                Downlink(ANotify->extra);
+                SendReplies();
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CStreamServer::Debug(const CString &Peer, const void *Data, size_t Size) {
             BYTE ch;
 
             CString Bin;
 
-            for (int i = 0; i < Stream.Size(); i++) {
-                ch = Stream[i];
+            for (size_t i = 0; i < Size; i++) {
+                ch = ((const BYTE *) Data)[i];
                 if (IsCtl(ch) || (ch >= 128)) {
                     Bin.Append('.');
                 } else {
@@ -471,11 +2639,11 @@ namespace Apostol {
             }
 
             CString Hex;
-            Hex.SetLength(Stream.Size() * 3);
-            ByteToHexStr((LPSTR) Hex.Data(), Hex.Size(), (LPCBYTE) Stream.Data(), Stream.Size(), ' ');
+            Hex.SetLength(Size * 3);
+            ByteToHexStr((LPSTR) Hex.Data(), Hex.Size(), (LPCBYTE) Data, Size, ' ');
 
-            Log()->Stream("[%s:%d] BIN: %d: %s", Socket->PeerIP(), Socket->PeerPort(), Stream.Size(), Bin.c_str());
-            Log()->Stream("[%s:%d] HEX: %s", Socket->PeerIP(), Socket->PeerPort(), Hex.c_str());
+            Log()->Stream("[%s] BIN: %d: %s", Peer.c_str(), (int) Size, Bin.c_str());
+            Log()->Stream("[%s] HEX: %s", Peer.c_str(), Hex.c_str());
         }
     }
 }
@@ -23,6 +23,19 @@ Author:
 
 #ifndef APOSTOL_STREAM_SERVER_HPP
 #define APOSTOL_STREAM_SERVER_HPP
+
+#include "LPWAN.hpp"
+#include "Datagram.hpp"
+#include "Uring.hpp"
+#include "PacketCapture.hpp"
+#include "Reassembly.hpp"
+#include "Duplicates.hpp"
+#include "Spool.hpp"
+#include "Metrics.hpp"
+#include "Devices.hpp"
+#include "RateLimit.hpp"
+#include "Downlink.hpp"
+#include "Shards.hpp"
 //----------------------------------------------------------------------------------------------------------------------
 
 extern "C++" {
@@ -33,48 +46,370 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CStreamPacket ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CStreamPacket {
+            CString Protocol;
+            CString Arguments;
+            bool Decoded = false;
+            bool Acknowledged = false;
+
+            std::string Key;
+            std::string Device;
+
+            BYTE Parameters = 0;
+            BYTE Command = 0;
+
+            uint64_t Time = 0;
+            uint64_t Received = 0;
+
+            CDatagramPeer Peer;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef std::vector<CStreamPacket> CStreamBatch;
+        typedef std::deque<CStreamPacket> CStreamQueue;
+        typedef std::shared_ptr<CStreamBatch> CStreamBatchPtr;
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CStreamCounters -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CStreamCounters {
+            uint64_t Batches = 0;
+            uint64_t BatchPackets = 0;
+            uint64_t BatchRetries = 0;
+            uint64_t Prepares = 0;
+            uint64_t Statements = 0;
+
+            uint64_t Queued = 0;
+            uint64_t Shed = 0;
+            uint64_t Superseded = 0;
+            uint64_t InFlight = 0;
+
+            uint64_t Spooled = 0;
+            uint64_t SpoolDrops = 0;
+            uint64_t Replayed = 0;
+
+            uint64_t Datagrams = 0;
+            uint64_t Truncated = 0;
+            uint64_t KernelDrops = 0;
+            uint64_t Replies = 0;
+            uint64_t ReplyDrops = 0;
+            uint64_t Acknowledgements = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CShardCounters --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CShardCounters {
+            uint64_t Batches = 0;
+            uint64_t Packets = 0;
+            uint64_t Failures = 0;
+            uint64_t Failovers = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CStreamGroup ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // What the workers of the stream process share; the master creates it before they are forked.
+        struct CStreamGroup {
+            int Workers = 1;
+
+            std::map<ushort, CDatagramSteering> Steering;
+
+            // The worker each device last sent to, so that a command goes out from one worker only.
+            CDeviceOwners Owners;
+        };
+
+        typedef std::shared_ptr<CStreamGroup> CStreamGroupPtr;
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CStreamServer ---------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
 
+        enum CShedPolicy { spSuperseded = 0, spOldest, spNewest };
+        //--------------------------------------------------------------------------------------------------------------
+
         class CStreamServer: public CProcessCustom {
             typedef CProcessCustom inherited;
 
-        private:
+            typedef void (CStreamServer::*CReceive)(const CDatagramPeer &Peer, const BYTE *Data, size_t Size);
+
+            // A UDP port of the stream process and the protocol of its packets.
+            struct CListener {
+                ushort Port = 0;
+                CString Protocol;
+                CReceive Receive = nullptr;
+
+                CDatagramSocket Socket;
+                CDatagramRing Ring;
+                CDatagramRing::COnDatagram OnDatagram;
+
+                CPollEventHandler *pHandler = nullptr;
+
+                // The last SO_RXQ_OVFL value seen on the socket.
+                uint32_t Drops = 0;
+            };
+
+            typedef std::unique_ptr<CListener> CListenerPtr;
+
+            // Ports and their protocols from the configuration.
+            typedef std::vector<std::pair<ushort, CString>> CListenerList;
+
+            // A PostgreSQL configuration ([postgres/<Name>]) with its own pool, sessions and health.
+            struct CShard {
+                CString Name;
 
-            CStringList m_Sessions;
+                CStringList Sessions;
+
+                // Sessions by the backend process of the pooled connection that was authorized with them. A backend
+                // that exits keeps its entry until the next login; a new one with the same PID replaces it.
+                std::map<int, CString> Pinned;
+                int Generation = 1;
+
+                CDateTime AuthDate = 0;
+
+                bool Healthy = true;
+                bool Probing = false;
+
+                // The pooled connection that holds the LISTEN, and when the channel was last heard from.
+                CPQConnection *Listener = nullptr;
+                uint64_t Heard = 0;
+                uint64_t Pinged = 0;
+
+                uint64_t InFlight = 0;
+
+                CShardCounters Counters;
+            };
+
+            typedef std::unique_ptr<CShard> CShardPtr;
+
+        private:
 
             CString m_Agent;
             CString m_Host;
 
-            CDateTime m_AuthDate;
-
             int m_HeartbeatInterval;
 
+            int m_BatchSize;
+            int m_BatchWindow;
+
+            int m_QueueHigh;
+            int m_QueueLow;
+            int m_InFlightMax;
+
+            CShedPolicy m_ShedPolicy;
+            bool m_Shedding;
+
+            std::vector<CShardPtr> m_Shards;
+            int m_Standby;
+
+            CShardRing m_Ring;
+
+            CString m_SpoolDirectory;
+            int m_SpoolSegment;
+            int m_SpoolSize;
+            int m_SpoolRate;
+            int m_SpoolSync;
+
+            double m_SpoolCredit;
+            uint64_t m_SpoolTime;
+            uint64_t m_SpoolSyncTime;
+
+            bool m_mmsg;
+            int m_mmsgCount;
+
+            int m_DatagramSize;
+
+            bool m_IoUring;
+            int m_IoUringBuffers;
+            int m_IoUringBufferSize;
+
+            int m_ReceiveBuffer;
+            int m_SendBuffer;
+
+            CStreamGroupPtr m_Group;
+
+            int m_Workers;
+            int m_Worker;
+
+            bool m_Affinity;
+            bool m_Steering;
+
+            bool m_StreamLog;
+
+            bool m_Decode;
+            bool m_Prepared;
+
+            bool m_Reassembly;
+
+            int m_DuplicateWindow;
+
+            int m_DeviceCache;
+            bool m_Coalesce;
+
+            std::bitset<256> m_Acknowledge;
+
+            int m_RatePeer;
+            int m_RateIoT;
+            int m_RateAndroid;
+            int m_RateIOS;
+            int m_RateBurst;
+
+            CString m_DownlinkChannel;
+            int m_DownlinkHeartbeat;
+
+            CString m_CaptureFile;
+            int m_CaptureSize;
+            int m_CaptureSnapLength;
+
+            CString m_StatsFile;
+            int m_StatsInterval;
+            uint64_t m_StatsTime;
+
+            sockaddr_in m_LocalAddress;
+            int m_LocalHandle;
+
+            std::vector<CListenerPtr> m_Listeners;
+
+            std::map<int, int> m_Rebound;
+            std::map<ushort, uint64_t> m_PortDrops;
+
+            CStreamQueue m_Queue;
+            CStreamCounters m_Counters;
+
+            CDatagramReader m_Reader;
+            CDatagramWriter m_Writer;
+
+            std::vector<BYTE> m_Datagram;
+
+            CDatagramRingCounters m_RingCounters;
+
+            CPacketCapture m_Capture;
+
+            CCommandAssembler m_Assembler;
+
+            CDuplicateCache m_Duplicates;
+
+            CSpool m_Spool;
+
+            CDeviceCache m_Devices;
+
+            CRateLimiter m_Limiter;
+
+            CDownlink m_Downlink;
+            CDownlink::COnSend m_OnDownlink;
+
+            CMetrics m_Metrics;
+
             CUDPAsyncServer m_Server;
 
             void BeforeRun() override;
             void AfterRun() override;
 
-            static ushort GetCRC16(void *buffer, size_t size);
+            void InitializeShards();
+
+            void Authentication(CShard &Shard);
+            void SignOut(CShard &Shard, const CString &Session);
+
+            void Probe(CShard &Shard);
+            void Unavailable(CShard &Shard);
 
-            void Authentication();
-            void SignOut(const CString &Session);
+            static bool Usable(const CShard &Shard) { return Shard.Healthy && Shard.Sessions.Count() > 0; }
+
+            bool Available() const;
+            int Route(const std::string &Device);
 
             void InitializeStreamServer(const CString &Title);
 
+            void SetAffinity();
+
+            static CReceive FindProtocol(const CString &Name);
+
+            static void ParseListeners(CListenerList &Listeners);
+
+            void OpenListeners();
+            void AddListener(ushort Port, const CString &Protocol);
+            void DrainListener(CListener &Listener);
+            void CloseListener(CListener &Listener);
+            void CloseListeners();
+
+            CListener *FindListener(int Handle);
+
+            int ReadSocket(CListener &Listener);
+            void CountDrops(CListener &Listener, uint32_t Drops);
+
+            CDatagramRingCounters RingCounters() const;
+
+            void OpenCapture();
+            void Capture(const CDatagramPeer &Peer, const void *Data, size_t Size, bool Inbound);
+
             void Heartbeat(CDateTime Now);
 
-            void Parse(CUDPAsyncServer *Server, CSocketHandle *Socket, const CString &Protocol, const CString &Data);
+            void ExportStats();
+
+            template <class TProtocol>
+            void Receive(const CDatagramPeer &Peer, const BYTE *Data, size_t Size);
+
+            static CString ParseArguments(const CDatagramPeer &Peer, const CString &Protocol, const LPWAN::CFrame &Frame);
+            static CString DecodeArguments(const CDatagramPeer &Peer, const CString &Protocol, const LPWAN::CFrame &Frame);
+            static CString DecodeCommand(const LPWAN::CFrame &Frame);
+
+            double DeviceRate(BYTE Type) const;
+
+            // Receive() and Assemble() are generic over the protocol policy; what is done with a frame it accepted is
+            // an overload of Enqueue() for its frame type.
+            template <class TProtocol>
+            void Assemble(const CDatagramPeer &Peer, const typename TProtocol::CFrame &Frame, const std::string &Key);
+
+            void Enqueue(const CDatagramPeer &Peer, const CString &Protocol, const LPWAN::CFrame &Frame, const std::string &Key);
+            void Flush();
+            void Dispatch(CShard &Shard, const CStreamBatchPtr &Batch);
+
+            bool Acknowledge(const LPWAN::CFrame &Frame, CStreamPacket &Packet, bool Always = false);
+
+            void Shed();
+            void Release(CShard &Shard, size_t Count);
+
+            void OpenSpool();
+            bool Spool(const CStreamPacket &Packet);
+            void Fail(CShard &Shard, const CStreamBatch &Batch);
+            void Replay(uint64_t Now);
+
+            static CString SelectSession(const CShard &Shard);
+            static bool DataError(CPQResult *AResult);
+            static bool MissingStatement(CPQResult *AResult);
+            CString Statement(const CShard &Shard, const CStreamPacket &Packet) const;
+
+            void Prepare(CShard &Shard, const CStreamBatchPtr &Batch, int Attempt);
+            void Parse(CShard &Shard, const CStreamBatchPtr &Batch, int Prepared = 0);
+            void Reply(const CDatagramPeer &Source, const CString &Data);
+            void SendReplies();
+
+            void Listen(CShard &Shard);
+            void Ping(CShard &Shard);
+            void CheckListen(uint64_t Now);
+            void Downlink(const CString &Payload);
+            bool SendCommand(const std::string &Device, const std::vector<CString> &Packets);
 
         protected:
 
             void DoTimer(CPollEventHandler *AHandler) override;
 
             void DoError(const Delphi::Exception::Exception &E);
+            void DoError(CShard &Shard, const Delphi::Exception::Exception &E);
 
-            void DoRead(CUDPAsyncServer *Server, CSocketHandle *Socket, CManagedBuffer &Buffer);
-            void DoWrite(CUDPAsyncServer *Server, CSocketHandle *Socket, CSimpleBuffer &Buffer);
+            void DoSocketRead(CPollEventHandler *AHandler, CListener *AListener);
+            void DoRingRead(CPollEventHandler *AHandler, CListener *AListener);
 
             void DoException(CTCPConnection *AConnection, const Delphi::Exception::Exception &E);
             bool DoExecute(CTCPConnection *AConnection) override;
@@ -82,17 +417,17 @@ namespace Apostol {
             void DoPostgresQueryExecuted(CPQPollQuery *APollQuery);
             void DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E);
 
+            void DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify);
+
         public:
 
-            explicit CStreamServer(CCustomProcess* AParent, CApplication *AApplication);
+            CStreamServer(CCustomProcess* AParent, CApplication *AApplication, int AWorker, CStreamGroupPtr AGroup);
 
             ~CStreamServer() override = default;
 
-            static class CStreamServer *CreateProcess(CCustomProcess *AParent, CApplication *AApplication) {
-                return new CStreamServer(AParent, AApplication);
-            }
+            static class CStreamServer *CreateProcess(CCustomProcess *AParent, CApplication *AApplication);
 
-            static void Debug(CSocketHandle *Socket, const CString &Stream);
+            static void Debug(const CString &Peer, const void *Data, size_t Size);
 
             void Run() override;
             void Reload() override;
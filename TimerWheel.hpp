@@ -0,0 +1,180 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  TimerWheel.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Hierarchical timer wheel
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_TIMER_WHEEL_HPP
+#define APOSTOL_STREAM_TIMER_WHEEL_HPP
+
+#include <time.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Monotonic clock in milliseconds.
+        inline uint64_t MonotonicTime() {
+            timespec ts {};
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Monotonic clock in nanoseconds, for latency measurements.
+        inline uint64_t MonotonicNanoTime() {
+            timespec ts {};
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Wall clock in milliseconds since the epoch (coarse: one clock tick of precision).
+        inline uint64_t RealTime() {
+            timespec ts {};
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTimerWheel -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Timers are never cancelled: the owner checks on expiry whether the value is still current.
+        // Four levels of 64 slots cover 2^24 ticks; later deadlines wait in the last slot of the top level.
+        template <typename T>
+        class CTimerWheel {
+        private:
+
+            struct CTimer {
+                uint64_t Deadline;
+                T Value;
+            };
+
+            std::vector<CTimer> m_Slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+            uint64_t m_Resolution;
+            uint64_t m_Tick;
+            size_t m_Count;
+
+            // First is the earliest tick the timer may go to: the next one when scheduled, the current one when
+            // cascaded, as its slot of the first level is expired right after the cascade.
+            void Insert(CTimer &&Timer, uint64_t First) {
+                uint64_t tick = (Timer.Deadline + m_Resolution - 1) / m_Resolution;
+
+                if (tick < First)
+                    tick = First;
+
+                const uint64_t delta = tick - m_Tick;
+
+                for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+                    if (delta < ((uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+                        m_Slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)].push_back(std::move(Timer));
+                        return;
+                    }
+                }
+
+                const int level = TIMER_WHEEL_LEVELS - 1;
+                m_Slots[level][((m_Tick >> (TIMER_WHEEL_BITS * level)) - 1) & (TIMER_WHEEL_SLOTS - 1)].push_back(std::move(Timer));
+            }
+
+            void Cascade(int Level) {
+                auto &slot = m_Slots[Level][(m_Tick >> (TIMER_WHEEL_BITS * Level)) & (TIMER_WHEEL_SLOTS - 1)];
+
+                std::vector<CTimer> timers;
+                timers.swap(slot);
+
+                for (auto &timer : timers)
+                    Insert(std::move(timer), m_Tick);
+            }
+
+        public:
+
+            explicit CTimerWheel(uint64_t Resolution = 10): m_Resolution(Resolution ? Resolution : 1), m_Tick(MonotonicTime() / m_Resolution), m_Count(0) {
+
+            }
+
+            void Schedule(uint64_t Deadline, const T &Value) {
+                Insert(CTimer{Deadline, Value}, m_Tick + 1);
+                m_Count++;
+            }
+
+            // Calls Expired(Value) for every timer with a deadline before Time (see MonotonicTime()).
+            template <class F>
+            void Advance(uint64_t Time, F &&Expired) {
+                const uint64_t tick = Time / m_Resolution;
+
+                if (m_Count == 0) {
+                    if (tick > m_Tick)
+                        m_Tick = tick;
+                    return;
+                }
+
+                while (m_Tick < tick) {
+                    m_Tick++;
+
+                    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+                        if ((m_Tick & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+                            break;
+                        Cascade(level);
+                    }
+
+                    auto &slot = m_Slots[0][m_Tick & (TIMER_WHEEL_SLOTS - 1)];
+
+                    if (slot.empty())
+                        continue;
+
+                    std::vector<CTimer> timers;
+                    timers.swap(slot);
+
+                    for (auto &timer : timers) {
+                        m_Count--;
+                        Expired(timer.Value);
+                    }
+
+                    if (m_Count == 0) {
+                        m_Tick = tick;
+                        break;
+                    }
+                }
+            }
+
+            size_t Count() const { return m_Count; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_TIMER_WHEEL_HPP
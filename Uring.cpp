@@ -0,0 +1,621 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Uring.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  io_uring datagram I/O
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "Uring.hpp"
+
+#ifdef WITH_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+
+#define URING_RECEIVE 0
+#define URING_CANCEL UINT64_MAX
+#define URING_SENDS (URING_ENTRIES * 4)
+#define URING_MAX_BUFFERS 32768
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramRing ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+#ifdef WITH_IO_URING
+        struct CDatagramRing::CRing {
+            int Handle = -1;
+            int Socket = -1;
+
+            void *SQRing = MAP_FAILED;
+            size_t SQRingSize = 0;
+            void *CQRing = MAP_FAILED;
+            size_t CQRingSize = 0;
+
+            io_uring_sqe *SQEs = (io_uring_sqe *) MAP_FAILED;
+            size_t SQEsSize = 0;
+
+            unsigned *SQHead = nullptr;
+            unsigned *SQTail = nullptr;
+            unsigned *SQArray = nullptr;
+            unsigned SQMask = 0;
+            unsigned SQEntries = 0;
+
+            unsigned *CQHead = nullptr;
+            unsigned *CQTail = nullptr;
+            unsigned CQMask = 0;
+            io_uring_cqe *CQEs = nullptr;
+
+            unsigned Queued = 0;
+            bool Armed = false;
+
+            uint32_t Drops = 0;
+
+            io_uring_buf_ring *Buffers = (io_uring_buf_ring *) MAP_FAILED;
+            size_t BuffersSize = 0;
+            BYTE *Data = (BYTE *) MAP_FAILED;
+            size_t DataSize = 0;
+
+            unsigned Count = 0;
+            unsigned Size = 0;
+            unsigned short Tail = 0;
+
+            msghdr Header {};
+
+            struct CSend {
+                CString Data;
+                sockaddr_in Address {};
+                iovec Vector {};
+                msghdr Header {};
+            };
+
+            std::vector<CSend> Sends;
+            std::vector<unsigned> Free;
+
+            ~CRing() {
+                if (Handle != -1)
+                    ::close(Handle);
+                if (CQRing != MAP_FAILED && CQRing != SQRing)
+                    ::munmap(CQRing, CQRingSize);
+                if (SQRing != MAP_FAILED)
+                    ::munmap(SQRing, SQRingSize);
+                if (SQEs != MAP_FAILED)
+                    ::munmap(SQEs, SQEsSize);
+                if (Buffers != MAP_FAILED)
+                    ::munmap(Buffers, BuffersSize);
+                if (Data != MAP_FAILED)
+                    ::munmap(Data, DataSize);
+            }
+
+            io_uring_sqe *Entry() {
+                const unsigned tail = *SQTail;
+
+                if (tail - __atomic_load_n(SQHead, __ATOMIC_ACQUIRE) >= SQEntries)
+                    return nullptr;
+
+                auto sqe = &SQEs[tail & SQMask];
+                ::memset(sqe, 0, sizeof(io_uring_sqe));
+
+                SQArray[tail & SQMask] = tail & SQMask;
+
+                return sqe;
+            }
+
+            void Push() {
+                __atomic_store_n(SQTail, *SQTail + 1, __ATOMIC_RELEASE);
+                Queued++;
+            }
+
+            void Recycle(unsigned short Id) {
+                // Not Buffers->bufs: in C++ the empty struct in front of the flexible array takes a byte and shifts it.
+                auto &buf = ((io_uring_buf *) Buffers)[Tail & (Count - 1)];
+
+                buf.addr = (uint64_t) (Data + (size_t) Id * Size);
+                buf.len = Size;
+                buf.bid = Id;
+
+                Tail++;
+            }
+        };
+#else
+        struct CDatagramRing::CRing {
+            int Handle = -1;
+            unsigned Queued = 0;
+            uint32_t Drops = 0;
+        };
+#endif
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramRing::CDatagramRing() = default;
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDatagramRing::~CDatagramRing() = default;
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramRing::Handle() const {
+            return m_pRing == nullptr ? -1 : m_pRing->Handle;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CDatagramRing::Pending() const {
+            return m_pRing == nullptr ? 0 : m_pRing->Queued;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint32_t CDatagramRing::Drops() const {
+            return m_pRing == nullptr ? 0 : m_pRing->Drops;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDatagramRing::Close() {
+            if (m_pRing != nullptr && !Cancel()) {
+                // Requests still in flight may write to the buffers: the descriptor is closed, the memory kept.
+                ::close(m_pRing->Handle);
+                m_pRing.release();
+                return;
+            }
+
+            m_pRing.reset();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+#ifdef WITH_IO_URING
+        bool CDatagramRing::Open(int Socket, unsigned Buffers, unsigned BufferSize) {
+            Close();
+
+            std::unique_ptr<CRing> pRing(new CRing());
+            auto &Ring = *pRing;
+
+            unsigned count = 1;
+            while (count < Buffers && count < URING_MAX_BUFFERS)
+                count <<= 1;
+
+            io_uring_params params {};
+
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = std::max(count, (unsigned) URING_SENDS) * 2;
+
+            Ring.Handle = (int) ::syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+            if (Ring.Handle == -1)
+                return false;
+
+            Ring.SQRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            Ring.CQRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+            if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+                Ring.SQRingSize = Ring.CQRingSize = std::max(Ring.SQRingSize, Ring.CQRingSize);
+
+            Ring.SQRing = ::mmap(nullptr, Ring.SQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring.Handle, IORING_OFF_SQ_RING);
+            if (Ring.SQRing == MAP_FAILED)
+                return false;
+
+            if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+                Ring.CQRing = Ring.SQRing;
+            } else {
+                Ring.CQRing = ::mmap(nullptr, Ring.CQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring.Handle, IORING_OFF_CQ_RING);
+                if (Ring.CQRing == MAP_FAILED)
+                    return false;
+            }
+
+            Ring.SQEsSize = params.sq_entries * sizeof(io_uring_sqe);
+            Ring.SQEs = (io_uring_sqe *) ::mmap(nullptr, Ring.SQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring.Handle, IORING_OFF_SQES);
+            if (Ring.SQEs == MAP_FAILED)
+                return false;
+
+            auto sq = (BYTE *) Ring.SQRing;
+            auto cq = (BYTE *) Ring.CQRing;
+
+            Ring.SQHead = (unsigned *) (sq + params.sq_off.head);
+            Ring.SQTail = (unsigned *) (sq + params.sq_off.tail);
+            Ring.SQArray = (unsigned *) (sq + params.sq_off.array);
+            Ring.SQMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+            Ring.SQEntries = params.sq_entries;
+
+            Ring.CQHead = (unsigned *) (cq + params.cq_off.head);
+            Ring.CQTail = (unsigned *) (cq + params.cq_off.tail);
+            Ring.CQMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+            Ring.CQEs = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+            // The provided buffers: the kernel picks one for every datagram; each starts with io_uring_recvmsg_out
+            // and the source address, followed by the payload.
+            Ring.Count = count;
+            Ring.Size = std::max(BufferSize, (unsigned) (sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + CMSG_SPACE(sizeof(uint32_t)) + 64));
+
+            Ring.BuffersSize = count * sizeof(io_uring_buf);
+            Ring.Buffers = (io_uring_buf_ring *) ::mmap(nullptr, Ring.BuffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+            if (Ring.Buffers == MAP_FAILED)
+                return false;
+
+            Ring.DataSize = (size_t) count * Ring.Size;
+            Ring.Data = (BYTE *) ::mmap(nullptr, Ring.DataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+            if (Ring.Data == MAP_FAILED)
+                return false;
+
+            io_uring_buf_reg reg {};
+
+            reg.ring_addr = (uint64_t) Ring.Buffers;
+            reg.ring_entries = count;
+            reg.bgid = 0;
+
+            if (::syscall(__NR_io_uring_register, Ring.Handle, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+                return false;
+
+            for (unsigned i = 0; i < count; ++i)
+                Ring.Recycle((unsigned short) i);
+
+            __atomic_store_n(&Ring.Buffers->tail, Ring.Tail, __ATOMIC_RELEASE);
+
+            Ring.Socket = Socket;
+            Ring.Header.msg_namelen = sizeof(sockaddr_in);
+            Ring.Header.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+
+            Ring.Sends.resize(URING_SENDS);
+            Ring.Free.reserve(URING_SENDS);
+
+            for (unsigned i = URING_SENDS; i-- > 0;)
+                Ring.Free.push_back(i);
+
+            m_pRing = std::move(pRing);
+
+            if (!Arm() || Submit() == -1) {
+                const auto error = errno;
+                Close();
+                errno = error;
+                return false;
+            }
+
+            // Kernels without multishot recvmsg() reject the request at once.
+            const unsigned tail = __atomic_load_n(Ring.CQTail, __ATOMIC_ACQUIRE);
+
+            for (unsigned head = *Ring.CQHead; head != tail; ++head) {
+                const auto &cqe = Ring.CQEs[head & Ring.CQMask];
+
+                if (cqe.user_data == URING_RECEIVE && cqe.res < 0 && cqe.res != -ENOBUFS) {
+                    Close();
+                    errno = -cqe.res;
+                    return false;
+                }
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        // The kernel may still read the reply buffers and the receive header: everything in flight is cancelled and
+        // its completion reaped before the ring and the buffers are unmapped.
+        bool CDatagramRing::Cancel() {
+            auto &Ring = *m_pRing;
+
+            if (Ring.Handle == -1)
+                return true;
+
+            if (Ring.Queued != 0 && Submit() == -1)
+                Ring.Queued = 0;
+
+            auto Busy = [&Ring]() {
+                return Ring.Armed || Ring.Free.size() != Ring.Sends.size();
+            };
+
+            if (!Busy())
+                return true;
+
+            auto sqe = Ring.Entry();
+
+            if (sqe == nullptr)
+                return false;
+
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = URING_CANCEL;
+
+            Ring.Push();
+
+            if (Submit() == -1)
+                return false;
+
+            io_uring_getevents_arg arg {};
+            __kernel_timespec ts {0, 100 * 1000000};
+
+            arg.ts = (uint64_t) &ts;
+
+            // A send already handed to the socket completes on its own; a few waits bound a stuck one.
+            for (int i = 0; i < 10 && Busy(); ++i) {
+                unsigned head = *Ring.CQHead;
+                const unsigned tail = __atomic_load_n(Ring.CQTail, __ATOMIC_ACQUIRE);
+
+                for (; head != tail; ++head) {
+                    const auto &cqe = Ring.CQEs[head & Ring.CQMask];
+
+                    if (cqe.user_data == URING_CANCEL)
+                        continue;
+
+                    if (cqe.user_data == URING_RECEIVE) {
+                        if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+                            Ring.Armed = false;
+                        continue;
+                    }
+
+                    const auto slot = (unsigned) (cqe.user_data - 1);
+
+                    if (cqe.res < 0) {
+                        m_Counters.SendErrors++;
+                    } else {
+                        m_Counters.Sent++;
+                    }
+
+                    Ring.Sends[slot].Data.Clear();
+                    Ring.Free.push_back(slot);
+                }
+
+                __atomic_store_n(Ring.CQHead, head, __ATOMIC_RELEASE);
+
+                if (!Busy())
+                    break;
+
+                if (::syscall(__NR_io_uring_enter, Ring.Handle, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1 && errno != ETIME && errno != EINTR)
+                    break;
+            }
+
+            return !Busy();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramRing::Arm() {
+            auto &Ring = *m_pRing;
+
+            auto sqe = Ring.Entry();
+
+            if (sqe == nullptr) {
+                if (Submit() == -1)
+                    return false;
+
+                sqe = Ring.Entry();
+
+                if (sqe == nullptr) {
+                    errno = EBUSY;
+                    return false;
+                }
+            }
+
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = Ring.Socket;
+            sqe->addr = (uint64_t) &Ring.Header;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->user_data = URING_RECEIVE;
+
+            Ring.Push();
+            Ring.Armed = true;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramRing::Read(const COnDatagram &OnDatagram) {
+            auto &Ring = *m_pRing;
+
+            unsigned head = *Ring.CQHead;
+            const unsigned tail = __atomic_load_n(Ring.CQTail, __ATOMIC_ACQUIRE);
+
+            int count = 0;
+            int error = 0;
+
+            const unsigned short buffers = Ring.Tail;
+
+            for (; head != tail; ++head) {
+                const auto &cqe = Ring.CQEs[head & Ring.CQMask];
+
+                if (cqe.user_data != URING_RECEIVE) {
+                    const auto slot = (unsigned) (cqe.user_data - 1);
+
+                    if (cqe.res < 0) {
+                        m_Counters.SendErrors++;
+                    } else {
+                        m_Counters.Sent++;
+                    }
+
+                    Ring.Sends[slot].Data.Clear();
+                    Ring.Free.push_back(slot);
+                    continue;
+                }
+
+                if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+                    Ring.Armed = false;
+
+                if (cqe.res < 0) {
+                    // Out of buffers: the datagrams wait in the socket until the request is made again.
+                    if (cqe.res == -ENOBUFS) {
+                        m_Counters.NoBuffers++;
+                    } else {
+                        error = -cqe.res;
+                    }
+                    continue;
+                }
+
+                if ((cqe.flags & IORING_CQE_F_BUFFER) == 0)
+                    continue;
+
+                const auto id = (unsigned short) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                const BYTE *buffer = Ring.Data + (size_t) id * Ring.Size;
+
+                const auto out = (const io_uring_recvmsg_out *) buffer;
+                const BYTE *name = buffer + sizeof(io_uring_recvmsg_out);
+                const BYTE *payload = name + Ring.Header.msg_namelen + Ring.Header.msg_controllen;
+
+                if (out->controllen != 0) {
+                    msghdr hdr {};
+
+                    hdr.msg_control = (void *) (name + Ring.Header.msg_namelen);
+                    hdr.msg_controllen = out->controllen;
+
+                    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+                            ::memcpy(&Ring.Drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+                    }
+                }
+
+                if ((out->flags & MSG_TRUNC) != 0) {
+                    m_Counters.Truncated++;
+                } else {
+                    CDatagramPeer Peer;
+
+                    Peer.Handle = Ring.Socket;
+                    ::memcpy(&Peer.Address, name, std::min((size_t) out->namelen, sizeof(sockaddr_in)));
+
+                    m_Counters.Received++;
+                    count++;
+
+                    OnDatagram(Peer, payload, out->payloadlen);
+                }
+
+                Ring.Recycle(id);
+            }
+
+            __atomic_store_n(Ring.CQHead, head, __ATOMIC_RELEASE);
+
+            if (Ring.Tail != buffers)
+                __atomic_store_n(&Ring.Buffers->tail, Ring.Tail, __ATOMIC_RELEASE);
+
+            if (!Ring.Armed) {
+                m_Counters.Rearmed++;
+
+                if (!Arm() || Submit() == -1)
+                    return -1;
+            }
+
+            if (error != 0) {
+                errno = error;
+                return -1;
+            }
+
+            return count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramRing::Send(const CDatagramPeer &Peer, const CString &Data) {
+            auto &Ring = *m_pRing;
+
+            if (Ring.Free.empty())
+                return false;
+
+            auto sqe = Ring.Entry();
+
+            if (sqe == nullptr) {
+                if (Submit() == -1)
+                    return false;
+
+                sqe = Ring.Entry();
+
+                if (sqe == nullptr)
+                    return false;
+            }
+
+            const auto slot = Ring.Free.back();
+            Ring.Free.pop_back();
+
+            auto &Item = Ring.Sends[slot];
+
+            Item.Data = Data;
+            Item.Address = Peer.Address;
+
+            Item.Vector.iov_base = Item.Data.Data();
+            Item.Vector.iov_len = Item.Data.Size();
+
+            Item.Header = {};
+            Item.Header.msg_name = &Item.Address;
+            Item.Header.msg_namelen = sizeof(sockaddr_in);
+            Item.Header.msg_iov = &Item.Vector;
+            Item.Header.msg_iovlen = 1;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = Peer.Handle;
+            sqe->addr = (uint64_t) &Item.Header;
+            sqe->len = 1;
+            sqe->user_data = (uint64_t) slot + 1;
+
+            Ring.Push();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramRing::Submit() {
+            auto &Ring = *m_pRing;
+
+            if (Ring.Queued == 0)
+                return 0;
+
+            const auto submitted = (int) ::syscall(__NR_io_uring_enter, Ring.Handle, Ring.Queued, 0, 0, nullptr, 0);
+
+            if (submitted == -1)
+                return -1;
+
+            Ring.Queued -= submitted;
+            m_Counters.Submits++;
+
+            return submitted;
+        }
+#else
+        bool CDatagramRing::Open(int Socket, unsigned Buffers, unsigned BufferSize) {
+            errno = ENOSYS;
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramRing::Cancel() {
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramRing::Arm() {
+            errno = ENOSYS;
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramRing::Read(const COnDatagram &OnDatagram) {
+            errno = ENOSYS;
+            return -1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDatagramRing::Send(const CDatagramPeer &Peer, const CString &Data) {
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CDatagramRing::Submit() {
+            return 0;
+        }
+#endif
+    }
+}
+}
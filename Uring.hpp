@@ -0,0 +1,119 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Uring.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  io_uring datagram I/O
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_URING_HPP
+#define APOSTOL_STREAM_URING_HPP
+
+#include "Datagram.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define URING_ENTRIES 256
+
+extern "C++" {
+
+namespace Apostol {
+
+    namespace Stream {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramRingCounters -------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CDatagramRingCounters {
+            uint64_t Received = 0;
+            uint64_t Truncated = 0;
+            uint64_t NoBuffers = 0;
+            uint64_t Rearmed = 0;
+
+            uint64_t Sent = 0;
+            uint64_t SendErrors = 0;
+            uint64_t Submits = 0;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDatagramRing ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // One multishot recvmsg() on the socket fills buffers of a ring provided to the kernel, so datagrams are
+        // received without a system call each and parsed in place. Replies are queued as sendmsg() entries and
+        // submitted together. The ring descriptor becomes readable when completions are waiting, so it is polled
+        // by the event loop like a socket. Built with WITH_IO_URING only; otherwise Open() fails with ENOSYS.
+        class CDatagramRing {
+        public:
+
+            // Called for every datagram; the data is valid until the callback returns.
+            typedef std::function<void (const CDatagramPeer &Peer, const BYTE *Data, size_t Size)> COnDatagram;
+
+        private:
+
+            struct CRing;
+
+            std::unique_ptr<CRing> m_pRing;
+
+            CDatagramRingCounters m_Counters;
+
+            bool Arm();
+            bool Cancel();
+
+        public:
+
+            CDatagramRing();
+
+            ~CDatagramRing();
+
+            CDatagramRing(const CDatagramRing &) = delete;
+            CDatagramRing &operator=(const CDatagramRing &) = delete;
+
+            // Returns false with errno set if the kernel lacks io_uring, provided buffer rings or multishot recvmsg().
+            bool Open(int Socket, unsigned Buffers, unsigned BufferSize);
+            void Close();
+
+            // Handles waiting completions; returns the number of datagrams or -1 with errno set.
+            int Read(const COnDatagram &OnDatagram);
+
+            bool Send(const CDatagramPeer &Peer, const CString &Data);
+            int Submit();
+
+            int Handle() const;
+            size_t Pending() const;
+
+            // The last SO_RXQ_OVFL counter received with a datagram (0 until the socket drops anything).
+            uint32_t Drops() const;
+
+            bool Active() const { return m_pRing != nullptr; }
+
+            const CDatagramRingCounters &Counters() const { return m_Counters; }
+
+        };
+
+    }
+}
+
+using namespace Apostol::Stream;
+}
+#endif //APOSTOL_STREAM_URING_HPP
@@ -0,0 +1,86 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Core.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  The framework header for the sources of the stream process that the tests build as they are: the standard
+  headers they expect from it, the stand-ins of Test.hpp and a log that prints errors to stderr.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_TEST_CORE_HPP
+#define APOSTOL_STREAM_TEST_CORE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#include <unistd.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "Test.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define APP_LOG_ERR 3
+#define _T(Text) Text
+//----------------------------------------------------------------------------------------------------------------------
+
+class CLog {
+public:
+
+    void Error(int, int ErrorCode, const char *Format, ...) {
+        va_list args;
+        va_start(args, Format);
+        std::vfprintf(stderr, Format, args);
+        va_end(args);
+
+        if (ErrorCode != 0)
+            std::fprintf(stderr, ": %s", strerror(ErrorCode));
+
+        std::fprintf(stderr, "\n");
+    }
+
+    void Notice(const char *, ...) {
+
+    }
+
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+inline CLog *Log() {
+    static CLog Log;
+    return &Log;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+inline std::runtime_error ExceptionFrm(const char *Format, ...) {
+    char buffer[1024];
+
+    va_list args;
+    va_start(args, Format);
+    vsnprintf(buffer, sizeof(buffer), Format, args);
+    va_end(args);
+
+    return std::runtime_error(buffer);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+#endif //APOSTOL_STREAM_TEST_CORE_HPP
@@ -0,0 +1,108 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  Test.hpp
+
+Notices:
+
+  Process: Stream Server
+
+  Stand-ins for the framework types used by LPWAN.hpp and a minimal check macro, so the protocol code builds
+  and runs without the framework.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#ifndef APOSTOL_STREAM_TEST_HPP
+#define APOSTOL_STREAM_TEST_HPP
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef unsigned char BYTE;
+typedef unsigned short ushort;
+typedef const char *LPCSTR;
+//----------------------------------------------------------------------------------------------------------------------
+
+class CString: public std::string {
+public:
+
+    using std::string::string;
+
+    CString() = default;
+
+    void SetLength(size_t Length) { resize(Length); }
+    void Clear() { clear(); }
+
+    bool IsEmpty() const { return empty(); }
+
+    CString &Format(const char *Format, ...) {
+        char buffer[1024];
+
+        va_list args;
+        va_start(args, Format);
+        vsnprintf(buffer, sizeof(buffer), Format, args);
+        va_end(args);
+
+        assign(buffer);
+        return *this;
+    }
+
+    char *Data() { return &front(); }
+    const char *Data() const { return data(); }
+
+    size_t Size() const { return size(); }
+
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "../LPWAN.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+static int GFailures __attribute__((unused)) = 0;
+
+#define CHECK(Condition) do { \
+        if (!(Condition)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #Condition); \
+            GFailures++; \
+        } \
+    } while (0)
+//----------------------------------------------------------------------------------------------------------------------
+
+inline double Seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Packet examples from README: command 0x01 of device 1234 and command 0x04 of device ABCD1234.
+static const BYTE GStatePacket[] = {
+    0x1E, 0x01, 0x03, 0x06, 0x04, 0x31, 0x32, 0x33, 0x34, 0xF0, 0x00, 0xA6, 0x53, 0x0C, 0x5E, 0x01,
+    0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x02, 0x9C, 0x53, 0x0C, 0x5E, 0x3E, 0xC7
+};
+
+static const BYTE GValuesPacket[] = {
+    0x2F, 0x01, 0x03, 0xA1, 0x08, 0x41, 0x42, 0x43, 0x44, 0x31, 0x32, 0x33, 0x34, 0x01, 0x00, 0x58,
+    0x17, 0x9E, 0x5F, 0x04, 0x00, 0x03, 0x00, 0x02, 0xFC, 0x21, 0x01, 0x08, 0x1F, 0x5B, 0x2F, 0x3E,
+    0x88, 0xE0, 0x4B, 0x40, 0x02, 0x08, 0x50, 0x28, 0x7C, 0x30, 0x66, 0xCF, 0x42, 0x40, 0x14, 0x49
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+#endif //APOSTOL_STREAM_TEST_HPP
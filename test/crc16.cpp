@@ -0,0 +1,149 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  crc16.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CRC16 (Modbus): equivalence of CCRC16 with the bitwise GetCRC16() it replaced, and a benchmark.
+
+  Usage: crc16 [bench]
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Test.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+using namespace Apostol::LPWAN;
+//----------------------------------------------------------------------------------------------------------------------
+
+// CStreamServer::GetCRC16() as it was before the table-driven version.
+static ushort GetCRC16(void *buffer, size_t size) {
+    int crc = 0xFFFF;
+
+    for (size_t i = 0; i < size; i++) {
+        crc = crc ^ ((BYTE *) buffer)[i];
+
+        for (int j = 0; j < 8; ++j) {
+            if ((crc & 0x01) == 1)
+                crc = (crc >> 1 ^ 0xA001);
+            else
+                crc >>= 1;
+        }
+    }
+
+    return (ushort) crc;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Golden(const BYTE *Packet, size_t Size, ushort Expected) {
+    const auto Data = (void *) Packet;
+    const auto Length = Size - sizeof(ushort);
+
+    CHECK((ushort) (Packet[Size - 1] << 8 | Packet[Size - 2]) == Expected);
+
+    CHECK(GetCRC16(Data, Length) == Expected);
+    CHECK(CCRC16<1>::Calculate(Packet, Length) == Expected);
+    CHECK(CCRC16<4>::Calculate(Packet, Length) == Expected);
+    CHECK(CCRC16<8>::Calculate(Packet, Length) == Expected);
+    CHECK(CRC16(Packet, Length) == Expected);
+
+    // A CRC over the whole packet, its own CRC included, is zero.
+    CHECK(CRC16(Packet, Size) == 0);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Equivalence() {
+    std::vector<BYTE> Buffer(2048 + 8);
+
+    srand(1);
+
+    for (auto &b : Buffer)
+        b = (BYTE) rand();
+
+    // Every length up to 2048 at every alignment of the slices.
+    for (size_t Offset = 0; Offset < 8; ++Offset) {
+        for (size_t Length = 0; Length <= 2048; ++Length) {
+            const auto p = Buffer.data() + Offset;
+            const auto Expected = GetCRC16(p, Length);
+
+            CHECK(CCRC16<1>::Calculate(p, Length) == Expected);
+            CHECK(CCRC16<4>::Calculate(p, Length) == Expected);
+            CHECK(CCRC16<8>::Calculate(p, Length) == Expected);
+        }
+    }
+
+    // Chained: the CRC of a prefix is the initial value for the rest.
+    for (size_t Split = 0; Split <= 100; ++Split) {
+        CHECK(CCRC16<8>::Calculate(Buffer.data() + Split, 100 - Split, CCRC16<8>::Calculate(Buffer.data(), Split)) == GetCRC16(Buffer.data(), 100));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+template <class TFunction>
+static void Measure(const char *Name, size_t Size, TFunction &&Function) {
+    std::vector<BYTE> Buffer(Size);
+
+    for (auto &b : Buffer)
+        b = (BYTE) rand();
+
+    const size_t Rounds = std::max<size_t>(1, (size_t) 256 * 1024 * 1024 / Size);
+
+    unsigned Sink = 0;
+
+    const auto Start = Seconds();
+
+    for (size_t i = 0; i < Rounds; ++i) {
+        Buffer[i % Size] = (BYTE) i;
+        Sink += Function(Buffer.data(), Size);
+    }
+
+    const auto Elapsed = Seconds() - Start;
+
+    std::printf("%-10s %5zu bytes: %8.1f ns per buffer, %8.1f MB/s (%u)\n", Name, Size, Elapsed * 1e9 / Rounds,
+                (double) Rounds * Size / Elapsed / 1e6, Sink & 1);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Bench() {
+    for (const size_t Size : {29, 46, 256, 1400}) {
+        Measure("bitwise", Size, [](BYTE *p, size_t n) { return GetCRC16(p, n); });
+        Measure("table", Size, [](BYTE *p, size_t n) { return CCRC16<1>::Calculate(p, n); });
+        Measure("slice-4", Size, [](BYTE *p, size_t n) { return CCRC16<4>::Calculate(p, n); });
+        Measure("slice-8", Size, [](BYTE *p, size_t n) { return CCRC16<8>::Calculate(p, n); });
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    Golden(GStatePacket, sizeof(GStatePacket), 0xC73E);
+    Golden(GValuesPacket, sizeof(GValuesPacket), 0x4914);
+
+    Equivalence();
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Bench();
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "crc16: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("crc16: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,290 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  devices.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CDeviceCache: eviction from a full table whose keys share their home slots, the backward shift of Erase() and
+  the thresholds of Coalesce().
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "../Devices.hpp"
+
+#include <cmath>
+#include <map>
+#include <set>
+//----------------------------------------------------------------------------------------------------------------------
+
+using namespace Apostol::LPWAN;
+//----------------------------------------------------------------------------------------------------------------------
+
+#define MAX_DEVICES 64
+#define TABLE_MASK 127          // CDeviceCache takes the power of two at least twice MAX_DEVICES
+#define METERS_PER_DEGREE 111320.0
+//----------------------------------------------------------------------------------------------------------------------
+
+static int GSerial = 10000000;
+//----------------------------------------------------------------------------------------------------------------------
+
+// A device key whose home slot in the table is one of Slots: the keys collide at their home slot.
+static std::string Colliding(const std::set<size_t> &Slots) {
+    CString Serial;
+
+    for (;;) {
+        Serial.Format("%08d", GSerial++);
+
+        const auto Key = std::string(1, (char) 0xA0) + Serial;
+
+        if (Slots.count(std::hash<std::string>()(Key) & TABLE_MASK) != 0)
+            return Key;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Every key in Live is found with the time it was last seen, and the cache holds nothing else.
+static void Verify(const CDeviceCache &Cache, const std::map<std::string, uint64_t> &Live) {
+    CHECK(Cache.Count() == Live.size());
+
+    for (const auto &Device : Live) {
+        const auto pDevice = Cache.Find(Device.first);
+
+        CHECK(pDevice != nullptr);
+
+        if (pDevice != nullptr) {
+            CHECK(std::string(pDevice->Key, pDevice->Size) == Device.first);
+            CHECK(pDevice->Seen == Device.second);
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Updates Key and drops from Live the one device that made room for it, if the table was full.
+static void Update(CDeviceCache &Cache, std::map<std::string, uint64_t> &Live, const std::string &Key, uint64_t Now,
+        std::string *pEvicted = nullptr) {
+
+    const auto known = Live.count(Key) != 0;
+
+    CHECK(Cache.Update(Key, CDatagramPeer(), Now) != nullptr);
+
+    if (!known && Live.size() == MAX_DEVICES) {
+        std::vector<std::string> Evicted;
+
+        for (const auto &Device : Live) {
+            if (Cache.Find(Device.first) == nullptr)
+                Evicted.push_back(Device.first);
+        }
+
+        CHECK(Evicted.size() == 1);
+
+        if (!Evicted.empty()) {
+            Live.erase(Evicted.front());
+
+            if (pEvicted != nullptr)
+                *pEvicted = Evicted.front();
+        }
+    }
+
+    Live[Key] = Now;
+
+    Verify(Cache, Live);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Cluster() {
+    // One home slot near the end of the table, so the cluster wraps around to the start.
+    CDeviceCache Cache;
+    Cache.Configure(MAX_DEVICES, 1, 1, 300000);
+
+    std::map<std::string, uint64_t> Live;
+    std::vector<std::string> Order;
+    uint64_t now = 1;
+
+    for (int i = 0; i < MAX_DEVICES; ++i) {
+        Order.push_back(Colliding({TABLE_MASK - 2}));
+        Update(Cache, Live, Order.back(), now++);
+    }
+
+    CHECK(Cache.Counters().Evicted == 0);
+
+    // The cluster keeps the order of insertion, so the oldest device is always at the home slot.
+    for (int i = 0; i < MAX_DEVICES * 2; ++i) {
+        std::string Evicted;
+
+        Order.push_back(Colliding({TABLE_MASK - 2}));
+        Update(Cache, Live, Order.back(), now++, &Evicted);
+
+        CHECK(Evicted == Order[i]);
+    }
+
+    CHECK(Cache.Counters().Evicted == MAX_DEVICES * 2);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Mixed() {
+    // Neighbouring home slots: the backward shift must not move a device before its own home slot.
+    const std::set<size_t> Slots {TABLE_MASK - 1, TABLE_MASK, 0, 1, 40};
+
+    CDeviceCache Cache;
+    Cache.Configure(MAX_DEVICES, 1, 1, 300000);
+
+    std::map<std::string, uint64_t> Live;
+    std::vector<std::string> Keys;
+
+    srand(1);
+
+    for (int i = 0; i < MAX_DEVICES * 4; ++i)
+        Keys.push_back(Colliding(Slots));
+
+    for (uint64_t now = 1; now <= 5000; ++now)
+        Update(Cache, Live, Keys[(size_t) rand() % Keys.size()], now);
+
+    CHECK(Cache.Count() == MAX_DEVICES);
+    CHECK(Cache.Counters().Hits + Cache.Counters().Misses == 5000);
+    CHECK(Cache.Counters().Misses - Cache.Counters().Evicted == MAX_DEVICES);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void FreeHome() {
+    // A full table and a new key whose first slots are all free: some device still makes room.
+    CDeviceCache Cache;
+    Cache.Configure(MAX_DEVICES, 1, 1, 300000);
+
+    std::map<std::string, uint64_t> Live;
+    uint64_t now = 1;
+
+    for (int i = 0; i < MAX_DEVICES; ++i)
+        Update(Cache, Live, Colliding({10}), now++);
+
+    Update(Cache, Live, Colliding({100}), now++);
+
+    CHECK(Cache.Count() == MAX_DEVICES);
+    CHECK(Cache.Counters().Evicted == 1);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// The payload of command 0x04 with the values that are not NAN, each as an ieee754 double.
+static std::string Values(double Battery, double Latitude, double Longitude, double Accuracy) {
+    const double Value[] = {Battery, Latitude, Longitude, Accuracy};
+    const BYTE Type[] = {vtBattery, vtLatitude, vtLongitude, vtAccuracy};
+
+    std::string Result(6, '\0');
+    Result[4] = LPWAN_COMMAND_VALUES;
+    Result += '\0';
+
+    for (size_t i = 0; i < 4; ++i) {
+        if (std::isnan(Value[i]))
+            continue;
+
+        uint64_t bits;
+        memcpy(&bits, &Value[i], sizeof(bits));
+        bits = htole64(bits);
+
+        Result += (char) Type[i];
+        Result += (char) 8;
+        Result.append((const char *) &bits, sizeof(bits));
+        Result[6]++;
+    }
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool Coalesce(CDeviceCache &Cache, CDevice &Device, const std::string &Payload, uint64_t Now) {
+    CFrame Frame;
+
+    Frame.Payload = (const BYTE *) Payload.data();
+    Frame.PayloadSize = Payload.size();
+
+    return Cache.Coalesce(Device, Frame, Now);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Thresholds() {
+    CDeviceCache Cache;
+    Cache.Configure(MAX_DEVICES, 1, 1, 300000);
+
+    auto pDevice = Cache.Update(Colliding({0}), CDatagramPeer(), 1);
+    CHECK(pDevice != nullptr);
+
+    if (pDevice == nullptr)
+        return;
+
+    auto &Device = *pDevice;
+
+    // The values of a device seen for the first time are always forwarded.
+    CHECK(!Coalesce(Cache, Device, Values(80, 60, 30, 10), 1000));
+    CHECK(Device.Forwarded == 1000 && Device.Battery == 80 && Device.Accuracy == 10);
+
+    // Battery: within 1 percent of the value forwarded.
+    CHECK(Coalesce(Cache, Device, Values(80.5, NAN, NAN, NAN), 2000));
+    CHECK(!Coalesce(Cache, Device, Values(81.5, NAN, NAN, NAN), 3000));
+    CHECK(Device.Battery == 81.5 && Device.Forwarded == 3000);
+
+    // Position: within the accuracy of the fix, east-west distances shrinking with the latitude.
+    const auto north = 1 / METERS_PER_DEGREE;
+    const auto east = 1 / (METERS_PER_DEGREE * std::cos(60 * M_PI / 180));
+
+    CHECK(Coalesce(Cache, Device, Values(NAN, 60 + 5 * north, 30, 10), 4000));
+    CHECK(Coalesce(Cache, Device, Values(NAN, 60, 30 + 9 * east, 10), 5000));
+    CHECK(!Coalesce(Cache, Device, Values(NAN, 60, 30 + 11 * east, 10), 6000));
+    CHECK(Device.Longitude == 30 + 11 * east && Device.Forwarded == 6000);
+
+    // Small steps are measured from the position forwarded, so they do not add up unseen.
+    CHECK(Coalesce(Cache, Device, Values(NAN, 60 + 4 * north, 30 + 11 * east, 10), 7000));
+    CHECK(Coalesce(Cache, Device, Values(NAN, 60 + 8 * north, 30 + 11 * east, 10), 8000));
+    CHECK(!Coalesce(Cache, Device, Values(NAN, 60 + 12 * north, 30 + 11 * east, 10), 9000));
+
+    // The larger of the two accuracies is the limit.
+    CHECK(Coalesce(Cache, Device, Values(NAN, 60 + 27 * north, 30 + 11 * east, 20), 10000));
+
+    // Both values must be within their thresholds.
+    CHECK(!Coalesce(Cache, Device, Values(90, 60 + 12 * north, 30 + 11 * east, 10), 11000));
+
+    // Values that are not compared are always forwarded.
+    CHECK(!Coalesce(Cache, Device, Values(NAN, NAN, NAN, 10), 12000));
+
+    // The keep-alive interval forwards values that have not changed.
+    const auto suppressed = Cache.Counters().Suppressed;
+
+    CHECK(Coalesce(Cache, Device, Values(90, NAN, NAN, NAN), 12000 + 299999));
+    CHECK(!Coalesce(Cache, Device, Values(90, NAN, NAN, NAN), 12000 + 300000));
+    CHECK(Cache.Counters().KeepAlives == 1);
+    CHECK(Cache.Counters().Suppressed == suppressed + 1);
+
+    // Not a values command.
+    CHECK(!Coalesce(Cache, Device, std::string((const char *) GStatePacket + 11, 18), 400000));
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main() {
+    Cluster();
+    Mixed();
+    FreeHome();
+    Thresholds();
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "devices: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("devices: ok\n");
+
+    return 0;
+}
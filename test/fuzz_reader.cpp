@@ -0,0 +1,157 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  fuzz_reader.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  libFuzzer target of CFrameReader::Next(). Without libFuzzer (FUZZ_STANDALONE) it runs the files given on the
+  command line, or mutations of the README packets for the given number of rounds.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Test.hpp"
+
+#include <fstream>
+#include <iterator>
+//----------------------------------------------------------------------------------------------------------------------
+
+using namespace Apostol::LPWAN;
+//----------------------------------------------------------------------------------------------------------------------
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
+    CFrameReader Reader(Data, Size);
+    CFrame Frame;
+
+    size_t Position = 0;
+    size_t Frames = 0;
+
+    for (;;) {
+        const auto Status = Reader.Next(Frame);
+
+        if (Status == fsEnd)
+            break;
+
+        // Every call consumes input, so the loop ends.
+        if (Reader.Position() <= Position || ++Frames > Size)
+            abort();
+
+        if (Status != fsIncorrectLength) {
+            // The frame lies within the datagram, right where the previous one ended.
+            if (Frame.Offset != Position || Frame.Data != Data + Position || Frame.Offset + Frame.Size > Size)
+                abort();
+
+            // The length field takes one or two bytes.
+            if (Frame.Size - Frame.Length != 1 && Frame.Size - Frame.Length != 2)
+                abort();
+        }
+
+        if (Status == fsOk) {
+            // Whatever the header says, payload and serial number stay inside the frame.
+            const auto End = Frame.Data + Frame.Size - sizeof(ushort);
+
+            if ((const BYTE *) Frame.Serial + Frame.SerialSize > End || Frame.Payload + Frame.PayloadSize != End)
+                abort();
+
+            if (CRC16(Frame.Data, Frame.Size) != 0)
+                abort();
+
+            CCommand Command;
+
+            if (ParseCommand(Frame.Payload, Frame.PayloadSize, Command)) {
+                CDeviceState State;
+                std::vector<CValue> Values;
+
+                ParseState(Command, State);
+                ParseValues(Command, Values);
+            }
+        }
+
+        Position = Reader.Position();
+    }
+
+    return 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifdef FUZZ_STANDALONE
+
+static void Mutate(std::string &Data) {
+    switch (rand() % 4) {
+        case 0:
+            if (!Data.empty())
+                Data[rand() % Data.size()] ^= (char) (1 << (rand() % 8));
+            break;
+        case 1:
+            if (!Data.empty())
+                Data.resize(rand() % Data.size());
+            break;
+        case 2:
+            Data.insert(Data.begin() + (Data.empty() ? 0 : rand() % Data.size()), (char) rand());
+            break;
+        default:
+            if (!Data.empty())
+                Data[rand() % Data.size()] = (char) rand();
+            break;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    long Rounds = 1000000;
+
+    if (argc > 1 && argv[1][0] >= '0' && argv[1][0] <= '9') {
+        Rounds = atol(argv[1]);
+    } else if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            std::ifstream File(argv[i], std::ios::binary);
+            std::string Data((std::istreambuf_iterator<char>(File)), std::istreambuf_iterator<char>());
+            LLVMFuzzerTestOneInput((const uint8_t *) Data.data(), Data.size());
+        }
+        return 0;
+    }
+
+    const std::string Seeds[] = {
+        std::string((const char *) GStatePacket, sizeof(GStatePacket)),
+        std::string((const char *) GValuesPacket, sizeof(GValuesPacket)),
+        std::string((const char *) GStatePacket, sizeof(GStatePacket)) + std::string((const char *) GValuesPacket, sizeof(GValuesPacket))
+    };
+
+    srand(1);
+
+    for (long i = 0; i < Rounds; ++i) {
+        auto Data = Seeds[i % 3];
+
+        for (int m = rand() % 8; m >= 0; --m)
+            Mutate(Data);
+
+        // A mutated packet seldom keeps a valid CRC: fix it now and then, so the header checks are reached too.
+        if (i % 2 == 0 && Data.size() > 3) {
+            const auto crc = CRC16(Data.data(), Data.size() - 2);
+            Data[Data.size() - 2] = (char) (crc & 0xFF);
+            Data[Data.size() - 1] = (char) (crc >> 8);
+        }
+
+        LLVMFuzzerTestOneInput((const uint8_t *) Data.data(), Data.size());
+    }
+
+    std::printf("fuzz_reader: %ld inputs\n", Rounds);
+
+    return 0;
+}
+
+#endif
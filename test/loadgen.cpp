@@ -0,0 +1,402 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  loadgen.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Load generator: a synthetic fleet of LPWAN devices that sends commands 0x01 (current state) and 0x04 (current
+  values) to the stream process over UDP at a fixed rate of commands, and measures the replies.
+
+  Packets are built with Encode(), so their CRCs are real. A share of the commands is split into two packets, padded
+  past 127 bytes (a 2-byte length) or sent with a broken CRC. The device time in every command is a running number,
+  so no two commands of a device look alike to the duplicate cache.
+
+  A reply is matched to its command by serial and command number, and the time between the last packet of the command
+  and the reply is its latency. Replies come from the database (see standin.sql, which echoes every packet) or, for
+  the types in "acknowledge", from the stream process itself. Corrupt packets expect no reply; a command without a
+  reply when the run ends is lost.
+
+  Usage: loadgen [-a address] [-p port] [-r commands per second] [-t seconds] [-n devices] [-s sockets]
+                 [-m multi-packet %] [-l long %] [-c corrupt %] [-w wait ms]
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Test.hpp"
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+using namespace Apostol::LPWAN;
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CLoadOptions {
+    const char *Address = "127.0.0.1";
+    int Port = 4977;
+    int Rate = 1000;
+    int Seconds = 10;
+    int Devices = 1000;
+    int Sockets = 8;
+    int Multi = 10;
+    int Long = 5;
+    int Corrupt = 1;
+    int Wait = 2000;
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CLoadCounters {
+    uint64_t Packets = 0;
+    uint64_t Commands = 0;
+    uint64_t Multi = 0;
+    uint64_t Long = 0;
+    uint64_t Corrupt = 0;
+    uint64_t SendErrors = 0;
+
+    uint64_t Replies = 0;
+    uint64_t Unmatched = 0;
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CDevice {
+    std::string Serial;
+    BYTE Command = 0;
+    uint32_t Time = 0;
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+class CLoadGenerator {
+private:
+
+    CLoadOptions m_Options;
+    CLoadCounters m_Counters;
+
+    std::vector<CDevice> m_Devices;
+    std::vector<int> m_Sockets;
+
+    // Serial and command number of every command waiting for its reply, with the time its last packet was sent.
+    std::unordered_map<std::string, double> m_Pending;
+    std::vector<double> m_Latency;
+
+    std::string m_State;
+    std::string m_Values;
+
+    std::mt19937 m_Random;
+
+    static std::string Payload(const BYTE *Packet, size_t Size) {
+        CFrameReader Reader(Packet, Size);
+        CFrame Frame;
+
+        if (Reader.Next(Frame) != fsOk)
+            return {};
+
+        return std::string((const char *) Frame.Payload, Frame.PayloadSize);
+    }
+
+    static std::string Key(const char *Serial, size_t SerialSize, BYTE Command) {
+        std::string Key(Serial, SerialSize);
+        Key.push_back((char) Command);
+        return Key;
+    }
+
+    void Send(int Socket, const std::string &Packet) {
+        if (::send(Socket, Packet.data(), Packet.size(), MSG_DONTWAIT) == -1) {
+            m_Counters.SendErrors++;
+            return;
+        }
+
+        m_Counters.Packets++;
+    }
+
+    void Command(size_t Index) {
+        auto &Device = m_Devices[Index];
+        const auto Socket = m_Sockets[Index % m_Sockets.size()];
+
+        const int roll = (int) (m_Random() % 100);
+        const bool corrupt = roll < m_Options.Corrupt;
+        const bool multi = !corrupt && roll < m_Options.Corrupt + m_Options.Multi;
+        const bool padded = !corrupt && !multi && roll < m_Options.Corrupt + m_Options.Multi + m_Options.Long;
+
+        // Multi-packet and padded commands are current values: the larger of the two.
+        std::string Data(multi || padded || (m_Random() & 1) ? m_Values : m_State);
+
+        // The device time: a running number keeps the CRC, and so the duplicate key, of every command unique.
+        const auto time = ++Device.Time;
+        ::memcpy(&Data[0], &time, sizeof(time));
+
+        if (padded)
+            Data.resize(160, '\0');
+
+        CFrame Frame;
+
+        Frame.Version = 1;
+        Frame.DeviceType = 0x06;
+        Frame.SerialSize = (BYTE) Device.Serial.size();
+        Frame.Serial = Device.Serial.data();
+        Frame.Command = ++Device.Command;
+
+        if (multi) {
+            const auto half = Data.size() / 2;
+
+            Frame.Parameters = LPWAN_FIRST_PACKET;
+            Frame.Packet = 0;
+            Send(Socket, Encode(Frame, Data.data(), half));
+
+            Frame.Parameters = LPWAN_LAST_PACKET;
+            Frame.Packet = 1;
+            Send(Socket, Encode(Frame, Data.data() + half, Data.size() - half));
+
+            m_Counters.Multi++;
+        } else {
+            Frame.Parameters = LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET;
+
+            std::string Packet(Encode(Frame, Data.data(), Data.size()));
+
+            if (corrupt) {
+                Packet.back() ^= 0x5A;
+                Send(Socket, Packet);
+                m_Counters.Corrupt++;
+                return;
+            }
+
+            Send(Socket, Packet);
+
+            if (padded)
+                m_Counters.Long++;
+        }
+
+        m_Counters.Commands++;
+        m_Pending[Key(Device.Serial.data(), Device.Serial.size(), Frame.Command)] = Seconds();
+    }
+
+    void Receive(int Socket) {
+        BYTE Buffer[4096];
+
+        for (;;) {
+            const auto size = ::recv(Socket, Buffer, sizeof(Buffer), MSG_DONTWAIT);
+
+            if (size <= 0)
+                return;
+
+            const auto now = Seconds();
+
+            CFrameReader Reader(Buffer, (size_t) size);
+            CFrame Frame;
+
+            CFrameStatus status;
+
+            while ((status = Reader.Next(Frame)) != fsEnd) {
+                if (status != fsOk)
+                    continue;
+
+                const auto it = m_Pending.find(Key(Frame.Serial, Frame.SerialSize, Frame.Command));
+
+                if (it == m_Pending.end()) {
+                    m_Counters.Unmatched++;
+                    continue;
+                }
+
+                m_Latency.push_back(now - it->second);
+                m_Pending.erase(it);
+                m_Counters.Replies++;
+            }
+        }
+    }
+
+    void Poll(int Timeout) {
+        std::vector<pollfd> fds;
+
+        for (auto Socket : m_Sockets)
+            fds.push_back({Socket, POLLIN, 0});
+
+        if (::poll(fds.data(), fds.size(), Timeout) <= 0)
+            return;
+
+        for (const auto &fd : fds) {
+            if ((fd.revents & POLLIN) != 0)
+                Receive(fd.fd);
+        }
+    }
+
+    double Percentile(double Rank) const {
+        if (m_Latency.empty())
+            return 0;
+
+        return m_Latency[std::min((size_t) (Rank * (double) m_Latency.size()), m_Latency.size() - 1)] * 1000;
+    }
+
+public:
+
+    explicit CLoadGenerator(const CLoadOptions &Options): m_Options(Options), m_Random(12227) {
+        m_State = Payload(GStatePacket, sizeof(GStatePacket));
+        m_Values = Payload(GValuesPacket, sizeof(GValuesPacket));
+
+        m_Devices.resize(m_Options.Devices);
+
+        char serial[16];
+
+        for (int i = 0; i < m_Options.Devices; ++i) {
+            snprintf(serial, sizeof(serial), "LG%06d", i);
+            m_Devices[i].Serial = serial;
+        }
+    }
+
+    ~CLoadGenerator() {
+        for (auto Socket : m_Sockets)
+            ::close(Socket);
+    }
+
+    bool Open() {
+        sockaddr_in Address {};
+
+        Address.sin_family = AF_INET;
+        Address.sin_port = htons((uint16_t) m_Options.Port);
+
+        if (::inet_pton(AF_INET, m_Options.Address, &Address.sin_addr) != 1) {
+            std::fprintf(stderr, "loadgen: invalid address \"%s\"\n", m_Options.Address);
+            return false;
+        }
+
+        // Several source ports, so that the listener steering spreads the fleet over the workers.
+        for (int i = 0; i < m_Options.Sockets; ++i) {
+            const auto Socket = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+            if (Socket == -1 || ::connect(Socket, (sockaddr *) &Address, sizeof(Address)) == -1) {
+                std::fprintf(stderr, "loadgen: %s\n", strerror(errno));
+                if (Socket != -1)
+                    ::close(Socket);
+                return false;
+            }
+
+            const int buffer = 4 * 1024 * 1024;
+
+            ::setsockopt(Socket, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+            ::setsockopt(Socket, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+            m_Sockets.push_back(Socket);
+        }
+
+        return true;
+    }
+
+    void Run() {
+        const auto start = Seconds();
+        const auto stop = start + m_Options.Seconds;
+
+        double report = start + 1;
+        uint64_t commands = 0;
+        uint64_t replies = 0;
+
+        size_t device = 0;
+
+        for (auto now = start; now < stop; now = Seconds()) {
+            // Commands due by now at the given rate; a late loop catches up in bursts of up to 1024.
+            const auto due = (uint64_t) ((now - start) * m_Options.Rate);
+            const auto sent = m_Counters.Commands + m_Counters.Corrupt;
+
+            for (uint64_t i = sent; i < due && i < sent + 1024; ++i) {
+                Command(device);
+                device = (device + 1) % m_Devices.size();
+            }
+
+            Poll(due > sent + 1024 ? 0 : 1);
+
+            if (now >= report) {
+                std::printf("loadgen: %6.0f s: %8llu commands/s, %8llu replies/s, %8zu pending\n", now - start,
+                            (unsigned long long) (m_Counters.Commands - commands),
+                            (unsigned long long) (m_Counters.Replies - replies), m_Pending.size());
+
+                commands = m_Counters.Commands;
+                replies = m_Counters.Replies;
+                report += 1;
+            }
+        }
+
+        const auto elapsed = Seconds() - start;
+
+        // Late replies.
+        const auto wait = Seconds() + m_Options.Wait / 1000.0;
+
+        while (!m_Pending.empty() && Seconds() < wait)
+            Poll(10);
+
+        std::sort(m_Latency.begin(), m_Latency.end());
+
+        std::printf("\n");
+        std::printf("packets sent:      %llu (%.0f/s), send errors %llu\n", (unsigned long long) m_Counters.Packets,
+                    (double) m_Counters.Packets / elapsed, (unsigned long long) m_Counters.SendErrors);
+        std::printf("commands:          %llu (multi-packet %llu, 2-byte length %llu), corrupt packets %llu\n",
+                    (unsigned long long) m_Counters.Commands, (unsigned long long) m_Counters.Multi,
+                    (unsigned long long) m_Counters.Long, (unsigned long long) m_Counters.Corrupt);
+        std::printf("replies:           %llu (%.0f/s), unmatched %llu\n", (unsigned long long) m_Counters.Replies,
+                    (double) m_Counters.Replies / elapsed, (unsigned long long) m_Counters.Unmatched);
+        std::printf("lost:              %zu (%.3f%%)\n", m_Pending.size(),
+                    m_Counters.Commands ? 100.0 * (double) m_Pending.size() / (double) m_Counters.Commands : 0.0);
+        std::printf("latency, ms:       p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+                    Percentile(0.5), Percentile(0.9), Percentile(0.99), Percentile(0.999), Percentile(1));
+    }
+
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    CLoadOptions Options;
+
+    int option;
+
+    while ((option = getopt(argc, argv, "a:p:r:t:n:s:m:l:c:w:")) != -1) {
+        switch (option) {
+            case 'a': Options.Address = optarg; break;
+            case 'p': Options.Port = atoi(optarg); break;
+            case 'r': Options.Rate = atoi(optarg); break;
+            case 't': Options.Seconds = atoi(optarg); break;
+            case 'n': Options.Devices = atoi(optarg); break;
+            case 's': Options.Sockets = atoi(optarg); break;
+            case 'm': Options.Multi = atoi(optarg); break;
+            case 'l': Options.Long = atoi(optarg); break;
+            case 'c': Options.Corrupt = atoi(optarg); break;
+            case 'w': Options.Wait = atoi(optarg); break;
+            default:
+                std::fprintf(stderr, "Usage: loadgen [-a address] [-p port] [-r commands per second] [-t seconds] [-n devices] "
+                                     "[-s sockets] [-m multi-packet %%] [-l long %%] [-c corrupt %%] [-w wait ms]\n");
+                return 2;
+        }
+    }
+
+    if (Options.Rate < 1 || Options.Seconds < 1 || Options.Devices < 1 || Options.Sockets < 1) {
+        std::fprintf(stderr, "loadgen: rate, time, devices and sockets must be positive\n");
+        return 2;
+    }
+
+    CLoadGenerator Generator(Options);
+
+    if (!Generator.Open())
+        return 1;
+
+    Generator.Run();
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  ratelimit.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CRateLimiter: the burst and refill of a token bucket, and the eviction of the least recently used way of a full
+  set in the set-associative table.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "../RateLimit.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+using namespace Apostol::LPWAN;
+//----------------------------------------------------------------------------------------------------------------------
+
+#define TABLE_SIZE 16                           // 4 sets of RATE_LIMIT_WAYS buckets
+#define TABLE_SETS (TABLE_SIZE / RATE_LIMIT_WAYS)
+//----------------------------------------------------------------------------------------------------------------------
+
+// The Index-th key of a set: the set is selected by the low bits of the key.
+static uint64_t SetKey(uint64_t Set, uint64_t Index) {
+    return ((Index + 1) * TABLE_SETS) | Set;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Burst() {
+    CRateLimiter Limiter;
+    Limiter.Configure(TABLE_SIZE);
+
+    CHECK(Limiter.Active());
+
+    const auto key = SetKey(0, 0);
+
+    // A new bucket is full: Burst packets pass at once, the next one is throttled.
+    for (int i = 0; i < 5; ++i)
+        CHECK(Limiter.Peer(key, 10, 5, 1000));
+
+    CHECK(!Limiter.Peer(key, 10, 5, 1000));
+    CHECK(Limiter.Counters().Peers == 1);
+
+    // A device bucket counts the packets throttled by device type.
+    CHECK(Limiter.Device(SetKey(1, 0), 0xA0, 10, 1, 1000));
+    CHECK(!Limiter.Device(SetKey(1, 0), 0xA0, 10, 1, 1000));
+    CHECK(Limiter.Counters().Devices[0xA0] == 1);
+    CHECK(Limiter.Counters().Peers == 1);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Refill() {
+    CRateLimiter Limiter;
+    Limiter.Configure(TABLE_SIZE);
+
+    const auto key = SetKey(2, 0);
+
+    for (int i = 0; i < 5; ++i)
+        CHECK(Limiter.Peer(key, 10, 5, 1000));
+
+    // 10 tokens per second: one every 100 ms.
+    CHECK(!Limiter.Peer(key, 10, 5, 1050));
+    CHECK(Limiter.Peer(key, 10, 5, 1100));
+    CHECK(!Limiter.Peer(key, 10, 5, 1100));
+
+    // The fraction gained before a throttled packet is kept.
+    CHECK(!Limiter.Peer(key, 10, 5, 1150));
+    CHECK(Limiter.Peer(key, 10, 5, 1200));
+
+    // A long pause fills the bucket up to Burst, not beyond.
+    for (int i = 0; i < 5; ++i)
+        CHECK(Limiter.Peer(key, 10, 5, 60000));
+
+    CHECK(!Limiter.Peer(key, 10, 5, 60000));
+    CHECK(Limiter.Counters().Peers == 4);
+    CHECK(Limiter.Counters().Evicted == 0);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Eviction() {
+    // Rate 0 and Burst 1: the first packet of a key passes and takes the last token, so a key passes again only when
+    // its bucket has been evicted.
+    CRateLimiter Limiter;
+    Limiter.Configure(TABLE_SIZE);
+
+    const auto Take = [&Limiter](uint64_t Key, uint64_t Now) { return Limiter.Peer(Key, 0, 1, Now); };
+
+    const auto other = SetKey(2, 0);
+    CHECK(Take(other, 1));
+
+    uint64_t Key[6];
+    for (uint64_t i = 0; i < 6; ++i)
+        Key[i] = SetKey(1, i);
+
+    for (int i = 0; i < RATE_LIMIT_WAYS; ++i)
+        CHECK(Take(Key[i], 10 + i));
+
+    CHECK(Limiter.Counters().Evicted == 0);
+
+    // A throttled packet also counts as a use: key 0 is no longer the least recently used.
+    CHECK(!Take(Key[0], 20));
+
+    CHECK(Take(Key[4], 21));
+    CHECK(Limiter.Counters().Evicted == 1);
+
+    // Key 1 made room; the others are still in the set.
+    CHECK(!Take(Key[0], 22));
+    CHECK(!Take(Key[2], 23));
+    CHECK(!Take(Key[3], 24));
+    CHECK(!Take(Key[4], 25));
+
+    CHECK(Take(Key[1], 26));
+    CHECK(Limiter.Counters().Evicted == 2);
+
+    // Key 1 took the place of key 0; key 0 and key 5 then take those of keys 2 and 3.
+    CHECK(Take(Key[0], 27));
+    CHECK(Take(Key[5], 28));
+    CHECK(Limiter.Counters().Evicted == 4);
+
+    CHECK(!Take(Key[4], 29));
+    CHECK(!Take(Key[1], 30));
+    CHECK(!Take(Key[0], 31));
+    CHECK(!Take(Key[5], 32));
+
+    // Another set is not touched by any of it.
+    CHECK(!Take(other, 33));
+    CHECK(Limiter.Counters().Evicted == 4);
+
+    // The same size keeps the buckets; Clear() drops them.
+    Limiter.Configure(TABLE_SIZE);
+    CHECK(!Take(other, 34));
+
+    Limiter.Clear();
+    CHECK(!Limiter.Active());
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Keys() {
+    sockaddr_in first {};
+    sockaddr_in second {};
+
+    first.sin_addr.s_addr = htonl(0x0A000001);
+    first.sin_port = htons(1000);
+
+    second = first;
+    second.sin_port = htons(2000);
+
+    // One bucket per host, whatever the source port.
+    CHECK(CRateLimiter::Key(first) == CRateLimiter::Key(second));
+    CHECK(CRateLimiter::Key(first) != 0);
+
+    second.sin_addr.s_addr = htonl(0x0A000002);
+    CHECK(CRateLimiter::Key(first) != CRateLimiter::Key(second));
+
+    CFrame Frame;
+
+    Frame.DeviceType = 0xA0;
+    Frame.Serial = "1234";
+    Frame.SerialSize = 4;
+
+    CHECK(CRateLimiter::Key(Frame) == CRateLimiter::Key(0xA0, "1234", 4));
+    CHECK(CRateLimiter::Key(Frame) != CRateLimiter::Key(0xA1, "1234", 4));
+    CHECK(CRateLimiter::Key(Frame) != CRateLimiter::Key(0xA0, "1235", 4));
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main() {
+    Burst();
+    Refill();
+    Eviction();
+    Keys();
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "ratelimit: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("ratelimit: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  reader.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CFrameReader: length framing, CRC and header checks.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Test.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+using namespace Apostol::LPWAN;
+//----------------------------------------------------------------------------------------------------------------------
+
+static std::string Datagram(std::initializer_list<std::string> Packets) {
+    std::string Result;
+
+    for (const auto &Packet : Packets)
+        Result += Packet;
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static std::string Bytes(const BYTE *Data, size_t Size) {
+    return std::string((const char *) Data, Size);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// A packet of device 1234 with Size bytes of data, encoded as the stream process encodes its replies.
+static std::string Packet(size_t Size, BYTE Command = 1) {
+    CFrame Frame;
+
+    Frame.Version = 1;
+    Frame.Parameters = LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET;
+    Frame.DeviceType = 0xA0;
+    Frame.SerialSize = 4;
+    Frame.Serial = "1234";
+    Frame.Command = Command;
+
+    std::string Data(Size, '\0');
+
+    for (size_t i = 0; i < Size; ++i)
+        Data[i] = (char) i;
+
+    return Encode(Frame, Data.data(), Data.size());
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void OneByteLength() {
+    const auto Data = Bytes(GStatePacket, sizeof(GStatePacket));
+
+    CFrameReader Reader(Data.data(), Data.size());
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsOk);
+    CHECK(Frame.Offset == 0);
+    CHECK(Frame.Size == sizeof(GStatePacket));
+    CHECK(Frame.Length == 0x1E);
+    CHECK(Frame.Version == 1);
+    CHECK(Frame.Parameters == (LPWAN_FIRST_PACKET | LPWAN_LAST_PACKET));
+    CHECK(Frame.DeviceType == 0x06);
+    CHECK(std::string(Frame.Serial, Frame.SerialSize) == "1234");
+    CHECK(Frame.Command == 0xF0);
+    CHECK(Frame.Packet == 0);
+    CHECK(Frame.PayloadSize == 18);
+    CHECK(Frame.CRC == 0xC73E);
+
+    CCommand Command;
+    CDeviceState State;
+
+    CHECK(ParseCommand(Frame.Payload, Frame.PayloadSize, Command));
+    CHECK(Command.Time == 1577866150);
+    CHECK(ParseState(Command, State));
+    CHECK(State.Tariff == 4);
+    CHECK(State.SyncType == 2);
+    CHECK(State.SyncTime == 1577866140);
+
+    CHECK(Reader.Next(Frame) == fsEnd);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void SeveralPackets() {
+    const auto Data = Datagram({Bytes(GStatePacket, sizeof(GStatePacket)), Bytes(GValuesPacket, sizeof(GValuesPacket))});
+
+    CFrameReader Reader(Data.data(), Data.size());
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsOk);
+    CHECK(Reader.Next(Frame) == fsOk);
+    CHECK(Frame.Offset == sizeof(GStatePacket));
+    CHECK(std::string(Frame.Serial, Frame.SerialSize) == "ABCD1234");
+
+    CCommand Command;
+    std::vector<CValue> Values;
+
+    CHECK(ParseCommand(Frame.Payload, Frame.PayloadSize, Command));
+    CHECK(ParseValues(Command, Values));
+    CHECK(Values.size() == 3);
+
+    if (Values.size() == 3) {
+        CHECK(Values[0].Value == 87);
+        CHECK(Values[1].Value == 55.754157803652780);
+        CHECK(Values[2].Value == 37.620306072829976);
+    }
+
+    CHECK(Reader.Next(Frame) == fsEnd);
+    CHECK(Reader.Remaining() == 0);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void TwoByteLength() {
+    // 4 + 4 + 2 + 200 + 2 = 212 bytes: the length needs the second byte.
+    const auto Data = Packet(200);
+
+    CHECK((BYTE) Data[0] == (0x80 | (212 >> 8)));
+    CHECK((BYTE) Data[1] == (212 & 0xFF));
+
+    CFrameReader Reader(Data.data(), Data.size());
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsOk);
+    CHECK(Frame.Length == 212);
+    CHECK(Frame.Size == 214);
+    CHECK(Frame.PayloadSize == 200);
+    CHECK(Frame.Payload[199] == 199);
+    CHECK(Reader.Next(Frame) == fsEnd);
+
+    // A short length may also be sent in two bytes.
+    auto Long = std::string("\x80", 1) + Bytes(GStatePacket, sizeof(GStatePacket));
+    const auto crc = CRC16(Long.data(), Long.size() - 2);
+
+    Long[Long.size() - 2] = (char) (crc & 0xFF);
+    Long[Long.size() - 1] = (char) (crc >> 8);
+
+    CFrameReader Reader2(Long.data(), Long.size());
+
+    CHECK(Reader2.Next(Frame) == fsOk);
+    CHECK(Frame.Length == 0x1E);
+    CHECK(Frame.Command == 0xF0);
+
+    // The largest length the field can hold.
+    const auto Largest = Packet(LPWAN_MAX_LENGTH - 12);
+
+    CFrameReader Reader3(Largest.data(), Largest.size());
+
+    CHECK(Largest.size() == LPWAN_MAX_LENGTH + 2);
+    CHECK(Reader3.Next(Frame) == fsOk);
+    CHECK(Frame.Length == LPWAN_MAX_LENGTH);
+
+    CHECK(Packet(LPWAN_MAX_LENGTH - 11).empty());
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void TruncatedPrefix() {
+    // The first byte announces a second length byte that is not there.
+    const BYTE Data[] = {0x80};
+
+    CFrameReader Reader(Data, sizeof(Data));
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsIncorrectLength);
+    CHECK(Reader.Next(Frame) == fsEnd);
+
+    // After a valid packet.
+    const auto Tail = Bytes(GStatePacket, sizeof(GStatePacket)) + std::string("\x81", 1);
+
+    CFrameReader Reader2(Tail.data(), Tail.size());
+
+    CHECK(Reader2.Next(Frame) == fsOk);
+    CHECK(Reader2.Next(Frame) == fsIncorrectLength);
+    CHECK(Reader2.Next(Frame) == fsEnd);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void LengthPastEnd() {
+    const auto Data = Bytes(GStatePacket, sizeof(GStatePacket) - 1);
+
+    CFrameReader Reader(Data.data(), Data.size());
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsIncorrectLength);
+    CHECK(Reader.Next(Frame) == fsEnd);
+
+    // Two-byte length beyond the datagram.
+    const auto Long = Packet(200);
+
+    CFrameReader Reader2(Long.data(), Long.size() - 1);
+
+    CHECK(Reader2.Next(Frame) == fsIncorrectLength);
+
+    // A length that leaves no room for the CRC.
+    const BYTE Short[] = {0x01, 0x00};
+
+    CFrameReader Reader3(Short, sizeof(Short));
+
+    CHECK(Reader3.Next(Frame) == fsIncorrectLength);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void BadCRC() {
+    auto Data = Datagram({Bytes(GStatePacket, sizeof(GStatePacket)), Bytes(GValuesPacket, sizeof(GValuesPacket))});
+
+    Data[10] ^= 0x01;
+
+    CFrameReader Reader(Data.data(), Data.size());
+    CFrame Frame;
+
+    // The bad packet is skipped by its length: the next one is still read.
+    CHECK(Reader.Next(Frame) == fsInvalidCRC);
+    CHECK(Frame.CRC == 0xC73E);
+    CHECK(Reader.Next(Frame) == fsOk);
+    CHECK(Frame.Command == 0x01);
+    CHECK(Reader.Next(Frame) == fsEnd);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void BadHeader() {
+    // Length 6: version, parameters, device type, serial size 10 and the CRC, no serial number.
+    BYTE Data[] = {0x06, 0x01, 0x03, 0xA0, 0x0A, 0x00, 0x00};
+
+    const auto crc = CRC16(Data, sizeof(Data) - 2);
+
+    Data[5] = (BYTE) (crc & 0xFF);
+    Data[6] = (BYTE) (crc >> 8);
+
+    CFrameReader Reader(Data, sizeof(Data));
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsInvalidHeader);
+    CHECK(Reader.Next(Frame) == fsEnd);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void UnknownVersion() {
+    // The state packet as version 2 with a valid CRC, then the state packet itself.
+    auto Data = Datagram({Bytes(GStatePacket, sizeof(GStatePacket)), Bytes(GStatePacket, sizeof(GStatePacket))});
+
+    Data[1] = 0x02;
+
+    const auto crc = CRC16((const BYTE *) Data.data(), sizeof(GStatePacket) - 2);
+
+    Data[sizeof(GStatePacket) - 2] = (char) (crc & 0xFF);
+    Data[sizeof(GStatePacket) - 1] = (char) (crc >> 8);
+
+    CFrameReader Reader(Data.data(), Data.size());
+    CFrame Frame;
+
+    // No decoder accepts it: skipped by its length, the next packet is still read.
+    CHECK(Reader.Next(Frame) == fsInvalidHeader);
+    CHECK(Frame.Size == sizeof(GStatePacket));
+    CHECK(Reader.Next(Frame) == fsOk);
+    CHECK(Frame.Version == 1);
+    CHECK(Reader.Next(Frame) == fsEnd);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Empty() {
+    CFrameReader Reader(nullptr, 0);
+    CFrame Frame;
+
+    CHECK(Reader.Next(Frame) == fsEnd);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main() {
+    OneByteLength();
+    SeveralPackets();
+    TwoByteLength();
+    TruncatedPrefix();
+    LengthPastEnd();
+    BadCRC();
+    BadHeader();
+    UnknownVersion();
+    Empty();
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "reader: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("reader: ok\n");
+
+    return 0;
+}
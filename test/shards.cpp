@@ -0,0 +1,194 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  shards.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CShardRing: balance of the devices over the shards, stability when a shard is added or removed, and failover.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "../Shards.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define DEVICES 100000
+//----------------------------------------------------------------------------------------------------------------------
+
+// Device keys as CStreamServer::Enqueue() builds them: the device type and the serial number.
+static std::vector<std::string> Devices() {
+    std::vector<std::string> Result;
+    CString Serial;
+
+    Result.reserve(DEVICES);
+
+    for (int i = 0; i < DEVICES; ++i) {
+        Serial.Format("%08d", 10000000 + i);
+        Result.push_back(std::string(1, (char) (0xA0 + i % 4)) + Serial);
+    }
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static std::vector<CString> Names(size_t Count) {
+    std::vector<CString> Result;
+    CString Name;
+
+    for (size_t i = 0; i < Count; ++i)
+        Result.push_back(Name.Format("shard%d", (int) i + 1));
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static std::vector<size_t> Assign(const CShardRing &Ring, const std::vector<std::string> &Keys) {
+    std::vector<size_t> Result;
+
+    Result.reserve(Keys.size());
+
+    for (const auto &Key : Keys)
+        Result.push_back(Ring.Primary(CShardRing::Hash(Key)));
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Balance(const std::vector<std::string> &Keys) {
+    for (size_t count = 2; count <= 8; ++count) {
+        CShardRing Ring;
+        Ring.Build(Names(count));
+
+        std::vector<size_t> Load(count, 0);
+
+        for (const auto Shard : Assign(Ring, Keys))
+            Load[Shard]++;
+
+        const double mean = (double) Keys.size() / count;
+
+        // 128 points per shard keep every share within a quarter of the mean.
+        for (const auto Value : Load) {
+            CHECK(Value > mean * 0.75);
+            CHECK(Value < mean * 1.25);
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Add(const std::vector<std::string> &Keys) {
+    for (size_t count = 1; count < 8; ++count) {
+        CShardRing Before;
+        CShardRing After;
+
+        Before.Build(Names(count));
+        After.Build(Names(count + 1));
+
+        const auto Old = Assign(Before, Keys);
+        const auto New = Assign(After, Keys);
+
+        size_t moved = 0;
+
+        // A device either stays where it was or moves to the new shard.
+        for (size_t i = 0; i < Keys.size(); ++i) {
+            if (Old[i] == New[i])
+                continue;
+
+            CHECK(New[i] == count);
+            moved++;
+        }
+
+        // About its share of the devices moves.
+        const double share = 1.0 / (count + 1);
+
+        CHECK(moved > Keys.size() * share * 0.75);
+        CHECK(moved < Keys.size() * share * 1.25);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Order(const std::vector<std::string> &Keys) {
+    // The order of the names in the configuration does not move devices.
+    auto Reversed = Names(5);
+    std::reverse(Reversed.begin(), Reversed.end());
+
+    CShardRing Ring;
+    CShardRing Other;
+
+    Ring.Build(Names(5));
+    Other.Build(Reversed);
+
+    const auto A = Assign(Ring, Keys);
+    const auto B = Assign(Other, Keys);
+
+    for (size_t i = 0; i < Keys.size(); ++i)
+        CHECK(A[i] == 4 - B[i]);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static void Failover(const std::vector<std::string> &Keys) {
+    CShardRing Ring;
+    Ring.Build(Names(4));
+
+    CShardRing Three;
+    Three.Build(Names(3));
+
+    std::vector<size_t> Load(4, 0);
+
+    for (const auto &Key : Keys) {
+        const auto hash = CShardRing::Hash(Key);
+        const auto primary = Ring.Primary(hash);
+
+        // Every shard usable: the primary.
+        CHECK(Ring.Find(hash, [](size_t) { return true; }) == (int) primary);
+
+        // The last shard down: its devices go where a ring without it would put them, the others stay.
+        const auto index = Ring.Find(hash, [](size_t i) { return i != 3; });
+
+        CHECK(index != -1 && index != 3);
+        CHECK(primary == 3 || index == (int) primary);
+        CHECK(index == (int) Three.Primary(hash));
+
+        if (primary == 3)
+            Load[index]++;
+
+        CHECK(Ring.Find(hash, [](size_t) { return false; }) == -1);
+    }
+
+    // The devices of the failed shard spread over the rest instead of falling on one neighbour.
+    for (size_t i = 0; i < 3; ++i)
+        CHECK(Load[i] > 0);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main() {
+    const auto Keys = Devices();
+
+    Balance(Keys);
+    Add(Keys);
+    Order(Keys);
+    Failover(Keys);
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "shards: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("shards: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  spool.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CSpool: records written over several segments, partly read, the spool closed and a record torn (bad magic or
+  CRC); on reopen the count, the replay order and the deletion of the segments read.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "../Spool.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define SEGMENT_SIZE (64 * 1024)
+#define RECORDS 200
+#define RECORD_SIZE 1000
+
+// The layout of Spool.cpp: a 16-byte segment header, then records of a 24-byte header and the data, 8-byte aligned.
+#define HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 24
+#define RECORD_MAGIC 0x44524352
+
+#define PER_SEGMENT ((SEGMENT_SIZE - HEADER_SIZE) / ((RECORD_HEADER_SIZE + RECORD_SIZE + 7) & ~7))
+//----------------------------------------------------------------------------------------------------------------------
+
+enum CTear { tNone = 0, tMagic, tCRC };
+//----------------------------------------------------------------------------------------------------------------------
+
+static std::string Record(int Index) {
+    std::string Result(RECORD_SIZE, '\0');
+
+    for (size_t i = 0; i < Result.size(); ++i)
+        Result[i] = (char) (Index * 31 + i);
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// The segment files of the spool, oldest first.
+static std::vector<std::string> Segments(const std::string &Directory) {
+    std::vector<std::string> Result;
+
+    auto pDir = opendir(Directory.c_str());
+    if (pDir == nullptr)
+        return Result;
+
+    dirent *pEntry;
+    while ((pEntry = readdir(pDir)) != nullptr) {
+        if (strncmp(pEntry->d_name, "test-", 5) == 0)
+            Result.push_back(Directory + "/" + pEntry->d_name);
+    }
+
+    closedir(pDir);
+
+    std::sort(Result.begin(), Result.end());
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Damages the last record of the segment file: its magic, or a byte of its data so the CRC no longer matches.
+static bool Tear(const std::string &FileName, CTear Tear) {
+    const auto handle = open(FileName.c_str(), O_RDWR);
+    if (handle == -1)
+        return false;
+
+    std::vector<BYTE> Data(SEGMENT_SIZE);
+    const auto size = pread(handle, Data.data(), Data.size(), 0);
+
+    size_t last = 0;
+    size_t offset = HEADER_SIZE;
+
+    while (size == SEGMENT_SIZE && offset + RECORD_HEADER_SIZE <= Data.size()) {
+        uint32_t magic;
+        uint32_t length;
+
+        memcpy(&magic, &Data[offset], sizeof(magic));
+        memcpy(&length, &Data[offset + 4], sizeof(length));
+
+        if (magic != RECORD_MAGIC)
+            break;
+
+        last = offset;
+        offset += (RECORD_HEADER_SIZE + length + 7) & ~(size_t) 7;
+    }
+
+    bool result = last != 0;
+
+    if (result) {
+        const auto at = Tear == tMagic ? last : last + RECORD_HEADER_SIZE + 1;
+        const BYTE value = Data[at] ^ 0xFF;
+
+        result = pwrite(handle, &value, 1, (off_t) at) == 1;
+    }
+
+    close(handle);
+
+    return result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Writes RECORDS records, reads Read of them, closes the spool, tears the last record of segment Segment (counted from
+// the first one written) and checks what the spool replays once reopened.
+static void Replay(const char *Name, CTear Torn, size_t Segment, int Read) {
+    const auto failures = GFailures;
+
+    char Template[] = "/tmp/spool.XXXXXX";
+    const std::string Directory(mkdtemp(Template));
+
+    CSpool Spool;
+    CString Data;
+    uint64_t Time;
+
+    Spool.Open(Directory.c_str(), "test", SEGMENT_SIZE, 1024 * 1024);
+
+    CHECK(Spool.Active() && Spool.Empty());
+    CHECK(!Spool.Read(Data, Time));
+
+    for (int i = 0; i < RECORDS; ++i) {
+        const auto Packet = Record(i);
+        CHECK(Spool.Write(Packet.data(), Packet.size(), (uint64_t) i));
+    }
+
+    const auto written = Segments(Directory);
+
+    CHECK(Spool.Count() == RECORDS);
+    CHECK(written.size() == Spool.Segments() && written.size() == (RECORDS + PER_SEGMENT - 1) / PER_SEGMENT);
+
+    // Each record read moves the read position; a segment read to the end is deleted at once.
+    for (int i = 0; i < Read; ++i) {
+        CHECK(Spool.Read(Data, Time));
+        CHECK(Time == (uint64_t) i && Data == Record(i));
+    }
+
+    const auto remaining = Segments(Directory);
+
+    CHECK(Spool.Count() == (uint64_t) (RECORDS - Read));
+    CHECK(remaining.size() == Spool.Segments() && remaining.size() < written.size());
+    CHECK(!remaining.empty() && remaining.front() != written.front());
+
+    Spool.Close();
+
+    CHECK(!Spool.Active());
+
+    // The record torn is the last one of its segment, so no valid record follows it there.
+    const auto torn = Torn == tNone ? -1 : (int) std::min((Segment + 1) * PER_SEGMENT, (size_t) RECORDS) - 1;
+
+    if (Torn != tNone) {
+        CHECK(Segment < written.size() && Tear(written[Segment], Torn));
+    }
+
+    Spool.Open(Directory.c_str(), "test", SEGMENT_SIZE, 1024 * 1024);
+
+    CHECK(Spool.Count() == (uint64_t) (RECORDS - Read - (Torn == tNone ? 0 : 1)));
+    CHECK(Spool.Segments() == remaining.size());
+
+    // The records replay in the order they were written, from where the reading stopped, without the torn one.
+    int expected = Read;
+    int replayed = 0;
+
+    while (Spool.Read(Data, Time)) {
+        if (expected == torn)
+            expected++;
+
+        CHECK(Time == (uint64_t) expected && Data == Record(expected));
+
+        expected++;
+        replayed++;
+    }
+
+    CHECK(replayed == RECORDS - Read - (Torn == tNone ? 0 : 1));
+    CHECK(Spool.Empty() && Spool.Segments() == 0);
+    CHECK(Segments(Directory).empty());
+
+    // Appending after the replay starts a new segment after the ones deleted.
+    CHECK(Spool.Write("x", 1, 1));
+
+    const auto appended = Segments(Directory);
+
+    CHECK(appended.size() == 1 && appended.front() > written.back());
+
+    Spool.Close();
+
+    for (const auto &FileName : Segments(Directory))
+        unlink(FileName.c_str());
+
+    rmdir(Directory.c_str());
+
+    if (GFailures != failures)
+        std::fprintf(stderr, "spool: %s failed\n", Name);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main() {
+    Replay("clean", tNone, 0, 70);
+    Replay("magic", tMagic, 3, 70);
+    Replay("crc", tCRC, 3, 70);
+    Replay("middle", tCRC, 2, 70);
+    Replay("read", tMagic, 1, 100);
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "spool: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("spool: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+--
+-- Stand-in for stream.parse() for load tests with test/loadgen. Load it into a test copy of the database only: it
+-- replaces the real function.
+--
+-- Every call waits for the configured latency and returns the packet itself, so the stream process sends each packet
+-- back to its device and loadgen can measure the reply latency. The latency in milliseconds is read from the
+-- stream_standin.latency setting (2 ms by default), for example:
+--
+--   ALTER ROLE <stream process user> SET stream_standin.latency = '5';
+--
+-- Run the stream process with decode off, or with the command types in "acknowledge".
+--
+
+CREATE OR REPLACE FUNCTION stream.parse (
+  pProtocol     text,
+  pAddress      text,
+  pBase64       text
+) RETURNS       text
+AS $$
+DECLARE
+  vLatency      double precision;
+BEGIN
+  vLatency := coalesce(nullif(current_setting('stream_standin.latency', true), ''), '2')::double precision;
+
+  IF vLatency > 0 THEN
+    PERFORM pg_sleep(vLatency / 1000);
+  END IF;
+
+  RETURN pBase64;
+END;
+$$ LANGUAGE plpgsql;
@@ -0,0 +1,128 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  statements.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Statements per packet sent to PostgreSQL: the per-session fan-out that CStreamServer::Parse() used to do against
+  the connection-pinned sessions that replaced it.
+
+  The program replays the rules of both versions over a simulated pool and counts statements the way the Statements
+  counter of the stream process does (every statement of every query sent, a query that fails included). It does
+  not talk to a database; the counter in the batch debug line gives the same figure on a live server.
+
+  Usage: statements [packets]
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Test.hpp"
+
+#include <random>
+#include <vector>
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CRun {
+    int Sessions;       // Sessions returned by Authentication
+    int Connections;    // Pooled connections
+    int Batch;          // Packets per batch
+    bool Prepared;      // The prepared option
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+// Before: every batch went out once per session, each copy with api.authorize() and api.set_area() in front.
+static double Before(const CRun &Run, uint64_t Packets) {
+    const uint64_t batches = Packets / Run.Batch;
+
+    return (double) (batches * Run.Sessions * (Run.Batch + 2)) / (double) (batches * Run.Batch);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// After: one copy of the batch. With prepared statements a connection authorizes in a query of its own that prepares
+// them and keeps that session until Authentication refreshes the sessions; the pool picks any connection for each
+// query, so the batch sent again after it may miss once more.
+static double After(const CRun &Run, uint64_t Packets, int Refreshes) {
+    const uint64_t batches = Packets / Run.Batch;
+    const uint64_t refresh = batches / (Refreshes + 1);
+
+    std::mt19937 random(Run.Sessions * 1000 + Run.Connections * 10 + Run.Batch);
+    std::uniform_int_distribution<int> pick(0, Run.Connections - 1);
+
+    std::vector<int> prepared(Run.Connections, 0);
+    int generation = 1;
+
+    uint64_t statements = 0;
+
+    for (uint64_t i = 0; i < batches; ++i) {
+        if (refresh != 0 && i != 0 && i % refresh == 0)
+            generation++;
+
+        if (!Run.Prepared) {
+            statements += 2 + Run.Batch;    // authorize, set_area and the packets
+            continue;
+        }
+
+        for (;;) {
+            statements += Run.Batch;        // EXECUTE of every packet
+
+            if (prepared[pick(random)] == generation)
+                break;
+
+            // SQLSTATE 26000: authorize, set_area, the DEALLOCATE block, both PREPAREs and pg_backend_pid() on
+            // whichever connection the pool hands that query to, then the batch again.
+            statements += 6;
+            prepared[pick(random)] = generation;
+        }
+    }
+
+    return (double) statements / (double) (batches * Run.Batch);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    const uint64_t packets = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+
+    const int sessions[] = {1, 2, 4, 8};
+    const int connections[] = {4, 16};
+    const int batches[] = {1, 16, 64};
+
+    std::printf("%8s %11s %5s %8s %8s %8s\n", "sessions", "connections", "batch", "before", "after", "no-prep");
+
+    for (auto s : sessions) {
+        for (auto c : connections) {
+            for (auto b : batches) {
+                const CRun Run = {s, c, b, true};
+                const CRun Plain = {s, c, b, false};
+
+                const auto before = Before(Run, packets);
+                const auto after = After(Run, packets, 1);
+                const auto plain = After(Plain, packets, 1);
+
+                std::printf("%8d %11d %5d %8.3f %8.3f %8.3f\n", s, c, b, before, after, plain);
+
+                CHECK(after <= before);
+            }
+        }
+    }
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "statements: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  timerwheel.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  CTimerWheel: deadlines on every level and past the 2^24 ticks the levels cover, scheduled at start and while the
+  wheel turns. Each timer must fire once, on the first tick at or after its deadline: never early and less than one
+  tick late.
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "../TimerWheel.hpp"
+//----------------------------------------------------------------------------------------------------------------------
+
+#define TICKS_COVERED ((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CTimer {
+    uint64_t Scheduled = 0;
+    uint64_t Deadline = 0;
+    uint64_t Fired = 0;
+    int Count = 0;
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+// Offsets around the boundary of every level and past the last one, in ticks.
+static std::vector<uint64_t> Offsets() {
+    std::vector<uint64_t> Result {0, 1, 2};
+
+    for (int level = 1; level <= TIMER_WHEEL_LEVELS; ++level) {
+        const auto boundary = (uint64_t) 1 << (TIMER_WHEEL_BITS * level);
+
+        for (uint64_t delta : {boundary - 2, boundary - 1, boundary, boundary + 1, boundary + boundary / 3})
+            Result.push_back(delta);
+    }
+
+    srand(1);
+
+    for (int i = 0; i < 2000; ++i)
+        Result.push_back((uint64_t) rand() % (TICKS_COVERED + TICKS_COVERED / 2));
+
+    return Result;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Every timer fired once, on the first tick at or after its deadline. The tick it was scheduled in has been expired
+// already, so a deadline within it or in the past is due with the next one.
+static void Verify(const std::vector<CTimer> &Timers, uint64_t Start, uint64_t Resolution) {
+    for (const auto &Timer : Timers) {
+        const auto due = std::max(Timer.Deadline, (Timer.Scheduled / Resolution + 1) * Resolution);
+
+        CHECK(Timer.Count == 1);
+        CHECK(Timer.Fired >= due && Timer.Fired < due + Resolution);
+
+        if (Timer.Count != 1 || Timer.Fired < due || Timer.Fired >= due + Resolution) {
+            std::fprintf(stderr, "deadline %llu fired %d time(s), last at %llu\n", (unsigned long long) (Timer.Deadline - Start),
+                         Timer.Count, (unsigned long long) (Timer.Fired - Start));
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// Turns the wheel a millisecond at a time: some timers are scheduled at start, the others half way through.
+static void Turn(uint64_t Resolution, uint64_t Ticks) {
+    std::unique_ptr<CTimerWheel<size_t>> Wheel;
+    uint64_t start;
+
+    // The wheel starts at the tick of the clock: the one of start.
+    do {
+        start = MonotonicTime();
+        Wheel.reset(new CTimerWheel<size_t>(Resolution));
+    } while (MonotonicTime() / Resolution != start / Resolution);
+
+    const auto offsets = Offsets();
+
+    std::vector<CTimer> Timers;
+
+    const auto Schedule = [&](uint64_t Now, uint64_t Deadline) {
+        Timers.emplace_back();
+        Timers.back().Scheduled = Now;
+        Timers.back().Deadline = Deadline;
+        Wheel->Schedule(Deadline, Timers.size() - 1);
+    };
+
+    for (auto offset : offsets) {
+        if (offset < Ticks)
+            Schedule(start, start + offset * Resolution);
+    }
+
+    Schedule(start, start - 5 * Resolution);
+
+    const auto middle = start + Ticks / 2 * Resolution + Resolution / 2;
+    const auto end = start + (Ticks + 2) * Resolution * 3 / 2;
+
+    for (auto now = start; now <= end; ++now) {
+        if (now == middle) {
+            for (auto offset : offsets) {
+                if (offset < Ticks)
+                    Schedule(now, now + offset * Resolution + 1);
+            }
+        }
+
+        Wheel->Advance(now, [&](size_t Index) {
+            Timers[Index].Count++;
+            Timers[Index].Fired = now;
+        });
+    }
+
+    CHECK(Wheel->Count() == 0);
+
+    Verify(Timers, start, Resolution);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+// One Advance() far past every deadline fires all of them once.
+static void Jump() {
+    CTimerWheel<size_t> Wheel(10);
+
+    const auto start = MonotonicTime();
+    std::vector<int> Count(1000, 0);
+
+    for (size_t i = 0; i < Count.size(); ++i)
+        Wheel.Schedule(start + (uint64_t) rand() % (TICKS_COVERED * 10), i);
+
+    Wheel.Advance(start + TICKS_COVERED * 10 * 2, [&](size_t Index) { Count[Index]++; });
+
+    CHECK(Wheel.Count() == 0);
+
+    for (auto count : Count)
+        CHECK(count == 1);
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main() {
+    // Whole milliseconds past 2^24 ticks, then ticks of 10 ms over the first three levels.
+    Turn(1, TICKS_COVERED + TICKS_COVERED / 2);
+    Turn(10, (uint64_t) 1 << (TIMER_WHEEL_BITS * 3));
+    Jump();
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "timerwheel: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    std::printf("timerwheel: ok\n");
+
+    return 0;
+}
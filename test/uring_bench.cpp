@@ -0,0 +1,412 @@
+/*++
+
+Program name:
+
+  Apostol CRM
+
+Module Name:
+
+  uring_bench.cpp
+
+Notices:
+
+  Process: Stream Server
+
+  Datagrams per second and CPU time per datagram of the receive paths of the stream process over loopback: epoll
+  with recvfrom()/sendto() (mmsg = false), epoll with recvmmsg()/sendmmsg() (the default) and CDatagramRing
+  (io_uring = true), which is built from Uring.cpp as it is.
+
+  A client thread keeps a window of datagrams in flight to a server thread that replies to each one, the way a
+  listener acknowledges a packet. CPU time is that of the server thread (RUSAGE_THREAD), user and system. After
+  the run the ring is closed with replies still queued and in flight: every one of them must be completed or
+  cancelled by Close().
+
+  Usage: uring_bench [-m epoll|mmsg|uring] [-n datagrams] [-s size] [-w window] [-b batch]
+
+Author:
+
+  Copyright (c) Prepodobny Alen
+
+  mailto: alienufo@inbox.ru
+  mailto: ufocomp@gmail.com
+
+--*/
+
+#include "Core.hpp"
+#include "../Uring.hpp"
+
+#include <atomic>
+#include <thread>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+enum CMode { bmEpoll = 0, bmMmsg, bmUring };
+
+static const char *GModes[] = {"epoll", "mmsg", "uring"};
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CBench {
+    CMode Mode = bmEpoll;
+    size_t Datagrams = 1000000;
+    size_t Size = 64;
+    size_t Window = 256;
+    size_t Batch = 64;
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+struct CResult {
+    size_t Replies = 0;
+    double Seconds = 0;
+    double CPU = 0;
+    uint64_t Calls = 0;
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+static double ThreadCPU() {
+    rusage usage {};
+    getrusage(RUSAGE_THREAD, &usage);
+    return (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+static int Bind(sockaddr_in &Address) {
+    const int handle = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+    if (handle == -1)
+        return -1;
+
+    const int size = 8 * 1024 * 1024;
+    setsockopt(handle, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(handle, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    Address = {};
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t length = sizeof(Address);
+
+    if (bind(handle, (sockaddr *) &Address, sizeof(Address)) == -1 || getsockname(handle, (sockaddr *) &Address, &length) == -1) {
+        close(handle);
+        return -1;
+    }
+
+    return handle;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+class CServer {
+private:
+
+    const CBench &m_Bench;
+
+    int m_Handle;
+    int m_Poll;
+
+    CDatagramRing m_Ring;
+
+    std::vector<BYTE> m_Slab;
+    std::vector<mmsghdr> m_Headers;
+    std::vector<iovec> m_Vectors;
+    std::vector<sockaddr_in> m_Addresses;
+
+    std::atomic<bool> m_Stop;
+
+    size_t m_Replies;
+    uint64_t m_Calls;
+    double m_CPU;
+
+    void Epoll() {
+        for (;;) {
+            sockaddr_in address {};
+            socklen_t length = sizeof(address);
+
+            const auto size = recvfrom(m_Handle, m_Slab.data(), DATAGRAM_MAX_SIZE, MSG_DONTWAIT, (sockaddr *) &address, &length);
+            m_Calls++;
+
+            if (size < 0)
+                break;
+
+            sendto(m_Handle, m_Slab.data(), size, MSG_DONTWAIT, (sockaddr *) &address, length);
+            m_Calls++;
+            m_Replies++;
+        }
+    }
+
+    void Mmsg() {
+        const auto count = m_Bench.Batch;
+
+        for (;;) {
+            for (size_t i = 0; i < count; ++i) {
+                m_Vectors[i] = {m_Slab.data() + i * DATAGRAM_MAX_SIZE, DATAGRAM_MAX_SIZE};
+                m_Headers[i] = {};
+                m_Headers[i].msg_hdr.msg_name = &m_Addresses[i];
+                m_Headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+                m_Headers[i].msg_hdr.msg_iov = &m_Vectors[i];
+                m_Headers[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            const auto received = recvmmsg(m_Handle, m_Headers.data(), count, MSG_DONTWAIT, nullptr);
+            m_Calls++;
+
+            if (received <= 0)
+                break;
+
+            for (int i = 0; i < received; ++i)
+                m_Vectors[i].iov_len = m_Headers[i].msg_len;
+
+            sendmmsg(m_Handle, m_Headers.data(), received, MSG_DONTWAIT);
+            m_Calls++;
+            m_Replies += received;
+        }
+    }
+
+    void Uring() {
+        m_Ring.Read([this](const CDatagramPeer &Peer, const BYTE *Data, size_t Size) {
+            m_Ring.Send(Peer, CString((const char *) Data, Size));
+            m_Replies++;
+        });
+
+        m_Ring.Submit();
+        m_Calls = m_Ring.Counters().Submits;
+    }
+
+public:
+
+    explicit CServer(const CBench &Bench): m_Bench(Bench), m_Handle(-1), m_Poll(-1), m_Stop(false),
+        m_Replies(0), m_Calls(0), m_CPU(0) {
+
+    }
+
+    ~CServer() {
+        m_Ring.Close();
+
+        if (m_Poll != -1)
+            close(m_Poll);
+        if (m_Handle != -1)
+            close(m_Handle);
+    }
+
+    bool Open(sockaddr_in &Address) {
+        m_Handle = Bind(Address);
+
+        if (m_Handle == -1)
+            return false;
+
+        m_Slab.resize((m_Bench.Mode == bmMmsg ? m_Bench.Batch : 1) * DATAGRAM_MAX_SIZE);
+        m_Headers.resize(m_Bench.Batch);
+        m_Vectors.resize(m_Bench.Batch);
+        m_Addresses.resize(m_Bench.Batch);
+
+        if (m_Bench.Mode == bmUring && !m_Ring.Open(m_Handle, 4096, 2048)) {
+            std::perror("io_uring");
+            return false;
+        }
+
+        m_Poll = epoll_create1(0);
+
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = m_Ring.Active() ? m_Ring.Handle() : m_Handle;
+
+        return epoll_ctl(m_Poll, EPOLL_CTL_ADD, event.data.fd, &event) == 0;
+    }
+
+    void Run() {
+        const auto start = ThreadCPU();
+
+        epoll_event event {};
+
+        while (!m_Stop.load(std::memory_order_relaxed)) {
+            if (epoll_wait(m_Poll, &event, 1, 10) <= 0)
+                continue;
+
+            switch (m_Bench.Mode) {
+                case bmEpoll:
+                    Epoll();
+                    break;
+                case bmMmsg:
+                    Mmsg();
+                    break;
+                case bmUring:
+                    Uring();
+                    break;
+            }
+        }
+
+        m_CPU = ThreadCPU() - start;
+    }
+
+    void Stop() { m_Stop = true; }
+
+    // Queues replies that nobody has submitted and closes the ring at once.
+    bool CloseInFlight(const sockaddr_in &Address) {
+        if (!m_Ring.Active())
+            return true;
+
+        const CDatagramPeer Peer(m_Handle, Address);
+        const CString Data(m_Bench.Size, 'x');
+
+        size_t queued = 0;
+
+        for (size_t i = 0; i < 512 && m_Ring.Send(Peer, Data); ++i) {
+            queued++;
+            if (i == 255)
+                m_Ring.Submit();
+        }
+
+        const auto sent = m_Ring.Counters().Sent + m_Ring.Counters().SendErrors;
+
+        m_Ring.Close();
+
+        const auto done = m_Ring.Counters().Sent + m_Ring.Counters().SendErrors;
+
+        std::printf("close: %zu replies queued, %llu completed or cancelled by Close()\n", queued, (unsigned long long) (done - sent));
+
+        return queued != 0 && done - sent >= queued;
+    }
+
+    size_t Replies() const { return m_Replies; }
+    uint64_t Calls() const { return m_Calls; }
+    double CPU() const { return m_CPU; }
+
+};
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool Run(const CBench &Bench, CResult &Result) {
+    CServer Server(Bench);
+
+    sockaddr_in server {};
+    sockaddr_in client {};
+
+    if (!Server.Open(server))
+        return false;
+
+    const int handle = Bind(client);
+
+    if (handle == -1)
+        return false;
+
+    std::thread thread([&Server]() { Server.Run(); });
+
+    std::vector<char> payload(Bench.Size, 'x');
+    std::vector<char> buffer(DATAGRAM_MAX_SIZE);
+
+    size_t sent = 0;
+    size_t received = 0;
+
+    const auto start = Seconds();
+    auto last = start;
+
+    while (received < Bench.Datagrams) {
+        while (sent < Bench.Datagrams && sent - received < Bench.Window) {
+            if (sendto(handle, payload.data(), payload.size(), 0, (sockaddr *) &server, sizeof(server)) < 0)
+                break;
+            sent++;
+        }
+
+        const auto size = recv(handle, buffer.data(), buffer.size(), 0);
+
+        if (size >= 0) {
+            received++;
+            last = Seconds();
+            continue;
+        }
+
+        // A datagram lost on the way is not resent: the window is refilled after a pause.
+        if (Seconds() - last > 0.2) {
+            if (sent == Bench.Datagrams)
+                break;
+            received = sent;
+            last = Seconds();
+        }
+    }
+
+    Result.Seconds = last - start;
+
+    Server.Stop();
+    thread.join();
+
+    Result.Replies = Server.Replies();
+    Result.Calls = Server.Calls();
+    Result.CPU = Server.CPU();
+
+    bool closed = true;
+
+    if (Bench.Mode == bmUring) {
+        closed = Server.CloseInFlight(client);
+        CHECK(closed);
+    }
+
+    close(handle);
+
+    return closed;
+}
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    CBench Bench;
+
+    int first = bmEpoll;
+    int last = bmUring;
+
+    int option;
+
+    while ((option = getopt(argc, argv, "m:n:s:w:b:")) != -1) {
+        switch (option) {
+            case 'm':
+                for (int i = bmEpoll; i <= bmUring; ++i) {
+                    if (strcmp(optarg, GModes[i]) == 0)
+                        first = last = i;
+                }
+                break;
+            case 'n':
+                Bench.Datagrams = strtoul(optarg, nullptr, 10);
+                break;
+            case 's':
+                Bench.Size = strtoul(optarg, nullptr, 10);
+                break;
+            case 'w':
+                Bench.Window = strtoul(optarg, nullptr, 10);
+                break;
+            case 'b':
+                Bench.Batch = strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                std::fprintf(stderr, "Usage: uring_bench [-m epoll|mmsg|uring] [-n datagrams] [-s size] [-w window] [-b batch]\n");
+                return 2;
+        }
+    }
+
+    if (Bench.Size == 0 || Bench.Window == 0 || Bench.Batch == 0)
+        return 2;
+
+    std::printf("%-6s %10s %8s %12s %12s %14s\n", "mode", "replies", "seconds", "pps", "cpu ns/dgram", "calls/dgram");
+
+    for (int mode = first; mode <= last; ++mode) {
+        Bench.Mode = (CMode) mode;
+
+        CResult Result;
+
+        if (!Run(Bench, Result)) {
+            std::fprintf(stderr, "uring_bench: %s failed\n", GModes[mode]);
+            GFailures++;
+            continue;
+        }
+
+        const auto replies = Result.Replies != 0 ? (double) Result.Replies : 1;
+
+        std::printf("%-6s %10zu %8.3f %12.0f %12.0f %14.3f\n", GModes[mode], Result.Replies, Result.Seconds,
+                    Result.Seconds > 0 ? Result.Replies / Result.Seconds : 0, Result.CPU * 1e9 / replies,
+                    (double) Result.Calls / replies);
+    }
+
+    if (GFailures != 0) {
+        std::fprintf(stderr, "uring_bench: %d check(s) failed\n", GFailures);
+        return 1;
+    }
+
+    return 0;
+}